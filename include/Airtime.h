@@ -0,0 +1,36 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include <Arduino.h>
+
+#define AIRTIME_BUCKETS 12 //resolution of the rolling window
+
+// How long a frame of this many payload bytes is on the air, in microseconds.
+// sf, bw, cr and preamble are the codes AT+PARAMETER takes, so bw is 7, 8 or
+// 9 for 125, 250 or 500kHz and cr is 1 to 4 for 4/5 to 4/8.
+uint32_t timeOnAir(uint8_t length, uint8_t sf, uint8_t bw, uint8_t cr, uint8_t preamble);
+
+// How long just the preamble and sync word of a frame take, in microseconds
+uint32_t preambleTime(uint8_t sf, uint8_t bw, uint8_t preamble);
+
+// Adds up airtime over a rolling window, like the one duty cycle rules use.
+// The window is split into buckets, and the oldest bucket is dropped whenever
+// a new one starts.
+class AirtimeMeter
+    {
+    public:
+        AirtimeMeter(uint32_t window);
+        void add(uint32_t micros);
+        uint32_t total();            //microseconds on the air in the window
+        uint16_t permille();         //share of the window, in tenths of a percent
+        uint32_t window() {return _bucketLength*AIRTIME_BUCKETS;}
+
+    private:
+        uint32_t _buckets[AIRTIME_BUCKETS]={};
+        uint32_t _bucketLength;  //ms
+        uint32_t _bucketStart=0; //millis() when the current bucket started
+        uint8_t _current=0;
+        void _advance();
+    };
+
+#endif // AIRTIME_H
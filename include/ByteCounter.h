@@ -0,0 +1,19 @@
+#ifndef BYTECOUNTER_H
+#define BYTECOUNTER_H
+
+#include <Arduino.h>
+
+// Count the bytes that would be printed, so the length of an MQTT message
+// can be known before it is streamed out.
+class ByteCounter: public Print
+    {
+    public:
+        size_t count=0;
+        size_t write(uint8_t) override
+            {
+            count++;
+            return 1;
+            }
+    };
+
+#endif // BYTECOUNTER_H
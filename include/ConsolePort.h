@@ -0,0 +1,31 @@
+#ifndef CONSOLEPORT_H
+#define CONSOLEPORT_H
+
+#include <Arduino.h>
+
+// The console, on whichever UART it is on at the moment. Everything that
+// logs holds on to this rather than to a UART, so the console can move
+// without telling them. use() flushes what was sent on the old one first.
+class ConsolePort: public Stream
+    {
+    public:
+        ConsolePort(HardwareSerial& port) : _port(&port) {}
+        void begin(unsigned long baudRate) {_port->begin(baudRate);}
+        void use(HardwareSerial& port)
+            {
+            _port->flush();
+            _port=&port;
+            }
+        using Print::write;
+        size_t write(uint8_t c) override {return _port->write(c);}
+        size_t write(const uint8_t* buffer, size_t size) override {return _port->write(buffer,size);}
+        int available() override {return _port->available();}
+        int read() override {return _port->read();}
+        int peek() override {return _port->peek();}
+        void flush() override {_port->flush();}
+
+    private:
+        HardwareSerial* _port;
+    };
+
+#endif // CONSOLEPORT_H
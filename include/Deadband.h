@@ -0,0 +1,45 @@
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <Arduino.h>
+
+#define DEADBAND_CACHE_SIZE 128 //field topics remembered at once, must be a power of 2
+
+// The last value published on one field topic
+typedef struct
+    {
+    bool used;
+    bool numeric;
+    uint16_t address;     //node that sent it
+    uint32_t topicHash;
+    uint32_t publishedAt; //millis()
+    float value;          //if numeric
+    uint32_t textHash;    //if not
+    } deadbandEntry;
+
+// Change-only publishing. Remembers the last value published on each field
+// topic, in an open addressed hash table like the node table, so a field
+// whose value hasn't moved past the deadband can be left alone until the
+// heartbeat is due. Ask isNew() about a field, publish it if so, then call
+// published() so it is remembered. A field that fails to publish is asked
+// about again next time.
+class Deadband
+    {
+    public:
+        void configure(float absolute, uint8_t percent, uint16_t heartbeat);
+        bool isNew(uint16_t address, const char* topic, const char* reading, size_t length);
+        void published();
+        void clear();
+        uint32_t suppressed=0; //fields not published because they hadn't changed
+
+    private:
+        deadbandEntry _entries[DEADBAND_CACHE_SIZE]={};
+        float _absolute=0;
+        uint8_t _percent=0;
+        uint32_t _heartbeat=0; //ms
+        deadbandEntry _pending;  //what published() will remember
+        deadbandEntry* _slot=nullptr;
+        deadbandEntry* _find(uint32_t topicHash);
+    };
+
+#endif // DEADBAND_H
@@ -0,0 +1,35 @@
+#ifndef DUPLICATECACHE_H
+#define DUPLICATECACHE_H
+
+#include <Arduino.h>
+#include "RYLR998.h"
+
+#define DUPLICATE_CACHE_SIZE 16 //most recent frames remembered
+
+// One frame we have already dealt with
+typedef struct
+    {
+    bool used;
+    uint16_t address;
+    uint32_t payloadHash;
+    uint32_t lastSeen; //millis() when it last came in, for expiry and LRU
+    } seenFrame;
+
+// Remembers the last few frames that were published, so that a transmitter
+// resending a frame because it missed our ack doesn't get published again.
+// Frames are matched on source address and payload hash. When the cache is
+// full the least recently seen frame is forgotten.
+class DuplicateCache
+    {
+    public:
+        bool isDuplicate(const rcvFrame& frame, uint32_t window);
+        void remember(const rcvFrame& frame);
+        void forget(uint16_t address, uint32_t payloadHash);
+        uint32_t suppressed=0; //duplicates found, which were acked but not published
+
+    private:
+        seenFrame _frames[DUPLICATE_CACHE_SIZE]={};
+        seenFrame* _find(uint16_t address, uint32_t hash);
+    };
+
+#endif // DUPLICATECACHE_H
@@ -0,0 +1,50 @@
+#ifndef FIRMWAREUPDATE_H
+#define FIRMWAREUPDATE_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <ESP8266HTTPClient.h>
+
+#define UPDATE_CHUNK_SIZE 1024   //most bytes taken from the download each pass through loop()
+#define UPDATE_CONNECT_TIMEOUT 5000 //ms to wait for the server to answer the request
+#define UPDATE_STALL_TIMEOUT 30000  //ms without any data before giving up
+#define UPDATE_MD5_LENGTH 32     //hex digits
+
+typedef enum
+    {
+    UPDATE_IDLE,
+    UPDATE_DOWNLOADING,
+    UPDATE_VERIFIED, //the new firmware is in flash and goes in at the next reboot
+    UPDATE_FAILED
+    } updateState;
+
+// Pulls new firmware from a web server a chunk at a time, so the rest of
+// loop() keeps running while it comes in. Start it with start(), then call
+// service() every time through loop() until it isn't running().
+class FirmwareUpdate
+    {
+    public:
+        void setLogOutput(Print& log);
+        bool start(const char* url, const char* md5);
+        static bool isValidMd5(const char* md5);
+        void service();
+        void cancel();
+        bool running() {return _state==UPDATE_DOWNLOADING;}
+        updateState state() {return _state;}
+        uint32_t received() {return _received;}
+        uint32_t size() {return _size;}
+
+    private:
+        Print* _log=&Serial;
+        WiFiClient _client;
+        HTTPClient _http;
+        updateState _state=UPDATE_IDLE;
+        uint32_t _size=0;
+        uint32_t _received=0;
+        uint32_t _lastData=0;    //millis() when data last came in
+        uint8_t _lastReported=0; //percent, for the progress messages
+        uint8_t _chunk[UPDATE_CHUNK_SIZE];
+        void _fail(const char* why);
+    };
+
+#endif // FIRMWAREUPDATE_H
@@ -0,0 +1,89 @@
+#ifndef FRAMERULES_H
+#define FRAMERULES_H
+
+#include <Arduino.h>
+#include "RYLR998.h"
+
+#define RULES_MAX 8         //rules that can be set at once
+#define RULE_KEY_SIZE 16    //longest key name a rule can match, plus the NUL
+#define RULE_TEXT_SIZE 32   //longest new key name or topic root, plus the NUL
+#define RULE_LIMIT_NODES 16 //nodes rate limited at once
+
+typedef enum
+    {
+    RULE_MATCH_ANY,     //every frame
+    RULE_MATCH_ADDRESS, //source address from low to high
+    RULE_MATCH_NETWORK, //network ID of the module it came in on
+    RULE_MATCH_KEY,     //a field with this name
+    RULE_MATCH_COUNT
+    } ruleMatch;
+
+typedef enum
+    {
+    RULE_DROP,   //don't publish it
+    RULE_RENAME, //publish a field under another name
+    RULE_LIMIT,  //publish a node's frames at most once every so many seconds
+    RULE_ROUTE,  //publish under another topic root
+    RULE_ACTION_COUNT
+    } ruleAction;
+
+// One rule, already parsed, so checking it is only a few comparisons
+typedef struct
+    {
+    uint8_t match;
+    uint8_t action;
+    uint16_t low;       //address or network ID
+    uint16_t high;
+    uint16_t seconds;   //for RULE_LIMIT
+    uint8_t keyLength;
+    char key[RULE_KEY_SIZE];
+    char text[RULE_TEXT_SIZE]; //new name for RULE_RENAME, topic root for RULE_ROUTE
+    } frameRule;
+
+// The rules as kept in the settings
+typedef struct
+    {
+    uint8_t count;
+    frameRule rules[RULES_MAX];
+    } ruleTable;
+
+// Filtering and routing of frames before they are published. Rules are
+// written like "addr:100-199 drop" or "key:battery route:home/batteries/"
+// and are turned into frameRules when they are added, so nothing is parsed
+// per frame. The first rule that matches a frame by address or network
+// decides what happens to the whole frame, and the first one that matches
+// a field by key decides what happens to that field.
+class FrameRules
+    {
+    public:
+        void begin(ruleTable& table);
+        bool add(const char* spec);
+        bool check(const char* spec); //whether add() could make sense of it
+        bool remove(uint8_t index);
+        void clear();
+        uint8_t count() {return _table->count;}
+        bool isValid();
+        size_t printRule(Print& out, uint8_t index);
+        size_t printJson(Print& out);
+        size_t measureJson();
+        const frameRule* match(uint16_t address, uint8_t networkID);
+        bool admit(const frameRule* rule, uint16_t address);
+        const frameRule* keyRule(const char* key, size_t keyLength);
+        uint32_t dropped=0; //frames not published because of a drop rule
+        uint32_t limited=0; //or a rate limit
+
+    private:
+        ruleTable* _table=nullptr;
+        bool _hasKeyRules=false;
+        bool _hasFrameRules=false;
+        struct
+            {
+            uint16_t address;
+            uint32_t passedAt; //millis() of the last frame let through
+            } _limits[RULE_LIMIT_NODES];
+        uint8_t _limitCount=0;
+        void _compile();
+        bool _parse(const char* spec, frameRule& rule);
+    };
+
+#endif // FRAMERULES_H
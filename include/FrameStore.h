@@ -0,0 +1,56 @@
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include <Arduino.h>
+#include "RYLR998.h"
+
+#define FRAME_STORE_SIZE 6144 //bytes of RAM for frames waiting on the uplink
+#define FRAME_STORE_FILE "/frames2.log"
+#define FRAME_STORE_OLD_FILE "/frames.log" //from before frames had a channel
+#define FRAME_STORE_FLASH_LIMIT 32768 //most bytes to spill into LittleFS
+
+// Stored form of a received frame. The payload bytes follow it directly.
+typedef struct __attribute__((packed))
+    {
+    uint32_t receivedAt; //millis() when the frame came in
+    uint16_t address;
+    int16_t rssi;
+    int8_t snr;
+    uint8_t length;
+    uint8_t channel;
+    } storedFrame;
+
+// First in, first out store for received frames while WiFi or the MQTT broker is
+// unavailable. Frames are kept as compact binary records in a RAM ring buffer,
+// and optionally spill into a LittleFS log once the RAM is full.
+class FrameStore
+    {
+    public:
+        void begin(bool spillToFlash, Print& log);
+        bool push(const rcvFrame& frame);
+        bool peek(rcvFrame& frame, char* payload, uint32_t* receivedAt = nullptr);
+        void pop();
+        bool isEmpty();
+        uint16_t count();
+        uint32_t stored=0;    //frames accepted into the store
+        uint32_t forwarded=0; //frames taken back out after publishing
+        uint32_t dropped=0;   //frames lost because there was no room
+        uint32_t spilled=0;   //frames that went to flash
+
+    private:
+        uint8_t _buffer[FRAME_STORE_SIZE];
+        uint16_t _head=0;  //oldest record
+        uint16_t _used=0;  //bytes in use
+        uint16_t _count=0; //records in RAM
+        bool _spill=false;
+        bool _mounted=false;
+        Print* _log=&Serial;
+        uint32_t _flashRead=0;  //offset of the oldest record in the flash log
+        uint32_t _flashSize=0;  //bytes written to the flash log
+        uint16_t _flashCount=0; //records in the flash log
+        void _copyIn(uint16_t at, const void* data, uint16_t length);
+        void _copyOut(uint16_t at, void* data, uint16_t length);
+        bool _pushFlash(const storedFrame& header, const char* payload);
+    };
+
+#endif // FRAMESTORE_H
@@ -0,0 +1,53 @@
+#ifndef JSONSCANNER_H
+#define JSONSCANNER_H
+
+#include <Arduino.h>
+
+#define JSON_SCANNER_FIELDS 16 //most fields in a payload that can be streamed
+
+typedef enum
+    {
+    JSON_FIELD_STRING,
+    JSON_FIELD_INTEGER,
+    JSON_FIELD_NUMBER,  //has a fraction or exponent, or is too big for a long
+    JSON_FIELD_BOOL,
+    JSON_FIELD_NULL
+    } jsonFieldType;
+
+// One key and value, pointing straight into the payload. Neither is NUL
+// terminated; strings are without their quotes.
+typedef struct
+    {
+    const char* key;
+    uint8_t keyLength;
+    const char* value;
+    uint8_t valueLength;
+    jsonFieldType type;
+    } jsonField;
+
+// Splits a flat JSON object into its key and value pairs without copying or
+// building a document. Anything it can't hand back as plain text (a nested
+// object or array, an escape sequence, too many fields, or bad syntax) makes
+// scan() fail, and the payload has to go through ArduinoJson instead.
+class JsonScanner
+    {
+    public:
+        bool scan(const char* json, uint8_t length);
+        uint8_t count() {return _count;}
+        const jsonField& field(uint8_t index) {return _fields[index];}
+        uint8_t closingBrace() {return _close;} //offset of the final }
+
+    private:
+        jsonField _fields[JSON_SCANNER_FIELDS];
+        uint8_t _count=0;
+        uint8_t _close=0;
+        const char* _json;
+        uint8_t _length;
+        uint8_t _at;
+        void _skipSpace();
+        bool _string(const char*& text, uint8_t& length);
+        bool _literal(const char* word);
+        bool _number(jsonFieldType& type);
+    };
+
+#endif // JSONSCANNER_H
@@ -0,0 +1,60 @@
+#ifndef MESSAGEQUEUE_H
+#define MESSAGEQUEUE_H
+
+#include <Arduino.h>
+
+#define MESSAGE_QUEUE_SIZE 8    //messages waiting for the display, must be a power of 2
+#define MESSAGE_LINE_WIDTH 21   //characters across the display in the smallest text
+#define MESSAGE_LINES 8         //lines down it
+#define MESSAGE_SIZE (MESSAGE_LINES*(MESSAGE_LINE_WIDTH+1)) //a full screen, with the newlines
+#define MESSAGE_KEY_NODE 0x80000000UL //or'ed with a node address for that node's frame summary
+
+typedef struct
+    {
+    uint32_t key;   //messages with the same key replace each other while waiting
+    char text[MESSAGE_SIZE];
+    } queuedMessage;
+
+// Messages waiting their turn on the display. One side of the program adds
+// them with push() and the display takes them off with pop(), a second at a
+// time. A message with the same key as one still waiting replaces it where it
+// is, so a node that sends often only has its latest frame shown, and the
+// same status message doesn't queue up over and over. When it's full new
+// messages are dropped, and counted, rather than overwriting ones that
+// haven't been shown.
+class MessageQueue
+    {
+    public:
+        bool push(uint32_t key, const char* text);
+        bool push(const char* text); //keyed by the text itself
+        bool pop(char* text, size_t size);
+        uint8_t count() {return _tail-_head;}
+        bool isEmpty() {return _tail==_head;}
+        bool isFull() {return count()>=MESSAGE_QUEUE_SIZE;}
+        uint32_t dropped=0;   //messages thrown away because the queue was full
+        uint32_t coalesced=0; //messages that replaced one still waiting
+
+    private:
+        queuedMessage _messages[MESSAGE_QUEUE_SIZE];
+        volatile uint8_t _head=0; //free running, only pop() moves it
+        volatile uint8_t _tail=0; //free running, only push() moves it
+    };
+
+// Builds the screen shown for one frame: who it came from and how well it was
+// heard on the first line, then a line per field, as many as fit.
+class FrameSummary
+    {
+    public:
+        void begin(uint16_t address, int16_t rssi, int8_t snr);
+        void add(const char* key, size_t keyLength, const char* reading, size_t length);
+        bool end(MessageQueue& queue);
+
+    private:
+        char _text[MESSAGE_SIZE];
+        size_t _length=0;
+        uint8_t _lines=0;
+        uint16_t _address=0;
+        bool _open=false;
+    };
+
+#endif // MESSAGEQUEUE_H
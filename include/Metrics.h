@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include "MessageQueue.h"
+
+#define METRIC_BUCKETS 8 //histogram buckets, each 4 times as wide as the one before
+
+// The parts of handling a frame that get timed
+typedef enum
+    {
+    STAGE_LINE,    //assembling a line from the LoRa module's UART
+    STAGE_PARSE,   //parsing a +RCV line
+    STAGE_DECODE,  //scanning or deserializing the payload
+    STAGE_PUBLISH, //one MQTT publish
+    STAGE_ACK,     //from sending an ack to the module answering it
+    STAGE_DISPLAY, //moving the display buffer to the OLED
+    STAGE_LOOP,    //one pass through loop()
+    STAGE_COUNT
+    } metricStage;
+
+typedef struct
+    {
+    uint32_t count;
+    uint32_t min;   //cycles
+    uint32_t max;   //cycles
+    uint64_t total; //cycles
+    uint32_t buckets[METRIC_BUCKETS];
+    } stageStats;
+
+// Timing of each stage, counted in CPU cycles from ESP.getCycleCount() and
+// reported in microseconds. Bucket n of the histogram counts times under
+// 64<<(2n) microseconds, so 64us, 256us, 1ms, 4ms, 16ms, 65ms, 262ms, and the
+// last one everything longer.
+class Metrics
+    {
+    public:
+        Metrics();
+        void record(metricStage stage, uint32_t cycles);
+        void reset();
+        void snapshot(MessageQueue& messages);
+        size_t printJson(Print& out);
+        size_t measureJson();
+
+    private:
+        stageStats _stages[STAGE_COUNT];
+        uint32_t _uptime=0; //seconds; this and the heap figures are as of the last snapshot()
+        uint32_t _heap=0;
+        uint8_t _fragmentation=0;
+        uint32_t _maxBlock=0;
+        uint32_t _displayDropped=0;   //from the display's MessageQueue
+        uint32_t _displayCoalesced=0;
+    };
+
+#endif // METRICS_H
@@ -0,0 +1,51 @@
+#ifndef NODETABLE_H
+#define NODETABLE_H
+
+#include <Arduino.h>
+#include "RYLR998.h"
+
+#define NODE_TABLE_SIZE 64 //most transmitters tracked at once, must be a power of 2
+#define NODE_EMA_WEIGHT 0.125 //weight of the newest sample in the moving averages
+#define NODE_GAP_FACTOR 2.5 //a frame this many average intervals late means we missed some
+#define NODE_DUPLICATE_WINDOW 15000 //ms within which the same payload again is a retry
+
+// What we know about one transmitter
+typedef struct
+    {
+    bool used;
+    uint16_t address;
+    uint32_t firstSeen;   //millis() of the first frame
+    uint32_t lastSeen;    //millis() of the latest frame
+    uint32_t frames;      //frames received, including duplicates
+    uint32_t duplicates;  //frames identical to the one before, shortly after it
+    uint32_t gaps;        //times the node went quiet for longer than usual
+    uint32_t payloadHash; //hash of the latest payload, to spot duplicates
+    uint32_t airtime;     //ms on the air, all frames including duplicates
+    float rssi;           //moving average
+    float snr;            //moving average
+    float interval;       //moving average of ms between frames
+    float battery;        //last reported battery value
+    bool hasBattery;
+    } nodeStats;
+
+// Statistics for every transmitter we hear, in an open addressed hash table
+// keyed by LoRa source address. When the table is full the node that has been
+// quiet the longest is forgotten to make room.
+class NodeTable
+    {
+    public:
+        nodeStats* update(const rcvFrame& frame, uint32_t airtime);
+        nodeStats* find(uint16_t address);
+        uint16_t count();
+        uint32_t totalFrames();
+        size_t printJson(Print& out, bool compact, uint32_t now);
+        size_t measureJson(bool compact, uint32_t now);
+        static uint32_t hashPayload(const char* payload, uint8_t length);
+
+    private:
+        nodeStats _nodes[NODE_TABLE_SIZE]={};
+        uint16_t _count=0;
+        nodeStats* _slot(uint16_t address, bool create);
+    };
+
+#endif // NODETABLE_H
@@ -0,0 +1,84 @@
+#ifndef QOSPUBLISHER_H
+#define QOSPUBLISHER_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+
+#define QOS_IN_FLIGHT 8 //frames that can be waiting on the broker at once
+#define QOS_MAX_TOPIC 160 //longest topic beginPublish() can send
+#define MQTT_PUBACK 4 //control packet type
+
+// A frame that was published at QoS 1 and is waiting for the broker to
+// confirm it before its sender gets an ack
+typedef struct
+    {
+    uint16_t packetId; //of the frame's last PUBLISH
+    uint16_t address;
+    uint8_t channel;   //module the ack goes out on
+    uint32_t payloadHash;
+    uint32_t sentAt;   //millis()
+    bool confirmed;
+    bool failed;       //the connection went before it was confirmed
+    } qosFrame;
+
+// QoS 1 publishing on top of PubSubClient, which only publishes at QoS 0.
+// beginPublish() writes the PUBLISH header with a packet ID itself, and
+// PUBACKs are picked out of the bytes PubSubClient reads by MqttTap. The
+// broker has to send PUBACKs in the order the PUBLISHes arrived, so a PUBACK
+// confirms every frame sent before it as well, and each frame only needs to
+// track the ID of its last PUBLISH.
+class QosPublisher
+    {
+    public:
+        bool beginPublish(PubSubClient& client, const char* topic, size_t length, bool retain);
+        bool await(uint16_t address, uint8_t channel, uint32_t payloadHash);
+        bool waitingFor(uint16_t address);
+        bool nextResult(qosFrame& frame, uint32_t timeout);
+        void puback(uint16_t packetId);
+        void fail();
+        uint8_t inFlight() {return _count;}
+        uint32_t confirmed=0; //frames the broker confirmed
+        uint32_t timedOut=0;  //frames it didn't, in time or at all
+
+    private:
+        qosFrame _frames[QOS_IN_FLIGHT]; //oldest first, starting at _head
+        uint8_t _head=0;
+        uint8_t _count=0;
+        uint16_t _nextId=1;
+        uint16_t _lastId=0; //ID of the last PUBLISH sent, until a frame is tied to it
+    };
+
+// Sits between PubSubClient and the network, passing everything through
+// and watching incoming packets for PUBACKs
+class MqttTap: public Client
+    {
+    public:
+        MqttTap(Client& client, QosPublisher& publisher);
+        int connect(IPAddress ip, uint16_t port) override;
+        int connect(const char* host, uint16_t port) override;
+        size_t write(uint8_t b) override;
+        size_t write(const uint8_t* buf, size_t size) override;
+        int available() override;
+        int read() override;
+        int read(uint8_t* buf, size_t size) override;
+        int peek() override;
+        void flush() override;
+        void stop() override;
+        uint8_t connected() override;
+        operator bool() override;
+
+    private:
+        Client& _client;
+        QosPublisher& _publisher;
+        uint8_t _state=0;      //0 for the fixed header, 1 for remaining length, 2 for the rest
+        uint8_t _type=0;
+        uint32_t _remaining=0; //bytes of the packet still to come
+        uint8_t _shift=0;
+        uint16_t _packetId=0;
+        uint8_t _idBytes=0;
+        void _reset();
+        void _watch(uint8_t b);
+    };
+
+#endif // QOSPUBLISHER_H
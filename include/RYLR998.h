@@ -12,14 +12,111 @@
 #include <SoftwareSerial.h>
 #include <ArduinoJson.h>
 
+#define RYLR998_LINE_SIZE 272 //longest +RCV line is about 264 bytes with a 240 byte payload
+#define RYLR998_MAX_PAYLOAD 240
+#define RYLR998_RX_BUFFER_SIZE 512 //room for two full size frames in the serial receive buffer
+#define RYLR998_COMMAND_SIZE 264 //"AT+SEND=65535,240," plus a full payload
+#define RYLR998_COMMAND_QUEUE 4 //commands that can be waiting for the module at once
+#define RYLR998_HELD_LINES 4 //frames kept while blocking commands run, a radio= is about 13 of them
+#define RYLR998_COMMAND_TIMEOUT 2000 //ms to wait for the module to answer a command
+#define RYLR998_RESPONSE_SIZE 48
+#define RYLR998_PROBE_TIMEOUT 100 //ms to wait for each answer to AT when begin() has limited attempts
+#define RYLR998_PROBE_BACKOFF 50 //ms before the second attempt, doubled after each one
+#define RYLR998_ERROR_INVALID -2 //lastError() when setRadio() was given settings the module can't take
+#define RYLR998_ERROR_READBACK -3 //lastError() when the module didn't read back what it was given
+#define RYLR998_BINARY_MAGIC 0xB1 //first byte of a binary payload, format version 1
+#define RYLR998_BINARY_ESCAPE 0xDB //escapes bytes that can't go through the module's AT interface
+
+// Binary payloads are the magic byte followed by fields. Each field starts
+// with (field ID<<3)|type and then the value, if the type has one. Integers
+// are LEB128 varints, signed ones zigzag encoded first. Fixed point values
+// are signed varints scaled by 10, 100 or 1000. NUL, CR, LF and the escape
+// byte itself are sent as the escape byte followed by the byte XOR 0x20.
+typedef enum
+    {
+    BINARY_UNSIGNED=0,
+    BINARY_SIGNED=1,
+    BINARY_FIXED1=2, //one decimal place
+    BINARY_FIXED2=3,
+    BINARY_FIXED3=4,
+    BINARY_FALSE=5,  //no value follows
+    BINARY_TRUE=6,   //no value follows
+    BINARY_STRING=7  //varint length, then the characters
+    } binaryType;
+
+// Field IDs are shared by every node. The names are the keys the gateway
+// publishes them under, same as if the node had sent JSON.
+typedef enum
+    {
+    BINARY_FIELD_DISTANCE=1,
+    BINARY_FIELD_ISPRESENT=2, //published as ISPRSENT, like the JSON nodes send it
+    BINARY_FIELD_BATTERY=3,
+    BINARY_FIELD_ANALOG=4,
+    BINARY_FIELD_TEMPERATURE=5,
+    BINARY_FIELD_HUMIDITY=6,
+    BINARY_FIELD_PRESSURE=7,
+    BINARY_FIELD_COUNT=8,
+    BINARY_FIELD_STATE=9,
+    BINARY_FIELD_UPTIME=10,
+    BINARY_FIELD_MAX=31
+    } binaryField;
+
+// One received frame, parsed in place. payload points into the driver's line
+// buffer and is only valid until the next call to handleIncoming().
+typedef struct
+    {
+    uint16_t address;
+    uint8_t length;
+    const char* payload;
+    uint8_t payloadLength;
+    int16_t rssi;
+    int8_t snr;
+    uint8_t channel; //which module it came in on, see setChannel()
+    } rcvFrame;
+
+// Called when a queued command completes. ok is false on +ERR or timeout,
+// in which case response is the +ERR line or empty.
+typedef void (*commandCallback)(bool ok, const char* response);
+
+// Everything that decides who a module can hear, set together with
+// setRadio() because some of them depend on each other
+typedef struct
+    {
+    uint32_t band;          //Hz
+    uint8_t networkID;      //3-15 or 18
+    uint8_t spreadingFactor;
+    uint8_t bandwidth;      //7=125kHz, 8=250kHz, 9=500kHz
+    uint8_t codingRate;     //1-4
+    uint8_t preamble;       //12, or 4-24 with network ID 18
+    int8_t power;           //dBm, 0-22
+    } loraRadio;
+
+typedef struct
+    {
+    char text[RYLR998_COMMAND_SIZE];
+    commandCallback callback;
+    unsigned long timeout;
+    bool sync; //someone is blocked in _sendCommand() waiting for this one
+    } loraCommand;
+
 class RYLR998 
     {
     public:
         RYLR998(int rx, int tx);
-        void begin(long baudRate);
+        RYLR998(HardwareSerial& uart, bool swapPins=true); //swapPins puts UART0 on GPIO13(RX)/GPIO15(TX)
+        bool begin(long baudRate, uint8_t attempts = 0); //0 keeps trying until the module answers
         void setJsonDocument(StaticJsonDocument<250>& doc);
+        void setAutoDecode(bool autoDecode); //false leaves decoding received frames to the caller
+        void setChannel(uint8_t channel); //tags received frames, for gateways with more than one module
         bool handleIncoming();
+        bool replayLine(const char* line);
+        bool available();
+        bool decodeFrame(const rcvFrame& frame);
         bool send(uint16_t address, const String& data);
+        bool sendAsync(uint16_t address, const char* data, commandCallback callback = nullptr);
+        bool queueCommand(const char* command, commandCallback callback = nullptr, unsigned long timeout = RYLR998_COMMAND_TIMEOUT);
+        bool commandPending();
+        int lastError();
         bool setMode(uint8_t mode, uint16_t rxTime = 0, uint16_t lowSpeedTime = 0);
         bool setBand(uint32_t frequency);
         bool setParameter(uint8_t sf, uint8_t bw, uint8_t cr, uint8_t preamble);
@@ -28,8 +125,14 @@ class RYLR998
         bool setCPIN(const String& password);
         bool setRFPower(uint8_t power);
         bool setBaudRate(uint32_t baudrate);
+        bool changeBaudRate(uint32_t baudrate);
+        uint32_t baudRate() {return _baudRate;}
+        static bool radioIsValid(const loraRadio& radio);
+        bool setRadio(const loraRadio& radio);
+        bool getRadio(loraRadio& radio);
         bool setdebug(bool debugMode);
-        bool testComm();
+        void setLogOutput(Print& log);
+        bool testComm(unsigned long timeout = RYLR998_COMMAND_TIMEOUT);
         String getMode();
         String getBand();
         String getParameter();
@@ -38,15 +141,75 @@ class RYLR998
         String getCPIN();
         String getRFPower();
         String getBaudRate();
+        const rcvFrame& getFrame() {return _frame;}
+        uint32_t lineCycles() {return _lineCycles;}   //CPU cycles spent assembling the latest line
+        uint32_t parseCycles() {return _parseCycles;} //CPU cycles spent parsing the latest +RCV line
+        uint32_t heldDropped=0; //frames lost because too many came in during blocking commands
 
     private:
-        SoftwareSerial _serial;
+        SoftwareSerial _swSerial;
+        HardwareSerial* _hwSerial=nullptr; //set when running on a hardware UART
+        bool _swapPins=false;
+        Stream* _serial;
+        Print* _log=&Serial; //where debug and error messages go
         int8_t _rxPin;
         int8_t _txPin;
+        uint32_t _baudRate=0;
+        void _openSerial(uint32_t baudRate);
+        bool _applyRadio(const loraRadio& radio);
         bool _debug=false;
         StaticJsonDocument<250>* _doc;
-        String _sendCommand(const String& command, unsigned long timeout = 2000);
-        void _parseRcvString(const String& input, String& address, String& length, String& jsonData, String& rssi, String& snr);
+        bool _autoDecode=true;
+        uint8_t _channel=0;
+        char _line[RYLR998_LINE_SIZE]; //incoming line is assembled here a byte at a time
+        uint16_t _lineLength=0;
+        bool _lineOverflow=false;
+        uint32_t _lineCycles=0;
+        uint32_t _lineCyclesSoFar=0; //for the line still being assembled
+        uint32_t _parseCycles=0;
+        bool _readLine();
+        char _heldLines[RYLR998_HELD_LINES][RYLR998_LINE_SIZE]; //frames that arrived during blocking commands
+        uint8_t _heldHead=0; //oldest of them
+        uint8_t _heldCount=0;
+        bool _handleLine();
+        loraCommand _commands[RYLR998_COMMAND_QUEUE]; //circular queue, head is the one in flight
+        uint8_t _commandHead=0;
+        uint8_t _commandCount=0;
+        bool _commandInFlight=false;
+        unsigned long _commandStart=0;
+        int _lastError=0;
+        char _syncResponse[RYLR998_RESPONSE_SIZE];
+        bool _syncDone=false;
+        void _serviceCommands();
+        void _completeCommand(const char* response);
+        void _pumpCommands();
+        String _sendCommand(const String& command, unsigned long timeout = RYLR998_COMMAND_TIMEOUT);
+        rcvFrame _frame={};
+        bool _parseRcv(char* input, rcvFrame& frame);
+        bool _decodeBinary(const rcvFrame& frame);
+    };
+
+// Builds a binary payload for sending with send() or sendAsync(). Each add
+// returns false, leaving the payload as it was, if the field won't fit.
+class BinaryPayload
+    {
+    public:
+        BinaryPayload();
+        bool addUnsigned(binaryField field, uint32_t value);
+        bool addSigned(binaryField field, int32_t value);
+        bool addFixed(binaryField field, float value, uint8_t decimals);
+        bool addBool(binaryField field, bool value);
+        bool addString(binaryField field, const char* value);
+        const char* data() {return _data;}
+        uint8_t length() {return _length;}
+
+    private:
+        char _data[RYLR998_MAX_PAYLOAD+1];
+        uint8_t _length=0;
+        uint8_t _start=0; //where the field being added began
+        bool _put(uint8_t b);
+        bool _putVarint(uint32_t value);
+        bool _putHeader(binaryField field, binaryType type);
     };
 
 #endif // RYLR998_H
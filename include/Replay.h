@@ -0,0 +1,62 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "RYLR998.h"
+
+#define REPLAY_FILE "/replay.txt" //recorded +RCV lines, one per line
+#define REPLAY_RESULT_FILE "/replay.last" //results of the last complete run
+#define REPLAY_RATE_REGRESSION 90 //flag a run slower than this percentage of the last one
+#define REPLAY_LATENCY_REGRESSION 125 //flag a worst case latency over this percentage of the last one
+
+// What a replay run measured. Kept in flash so the next run over the same
+// capture can be compared to it.
+typedef struct
+    {
+    uint32_t frames;      //frames that went through the pipeline
+    uint32_t skipped;     //lines that didn't
+    uint32_t rate;        //frames per second, times 100
+    uint32_t meanLatency; //microseconds from line to published
+    uint32_t worstLatency;
+    int32_t heapPerFrame; //bytes of free heap lost per frame
+    uint32_t lowestHeap;
+    } replayResult;
+
+// Plays recorded +RCV lines back through the receive pipeline, so changes to
+// parsing, decoding and publishing can be measured on the bench without a
+// transmitter. Lines can be recorded from live traffic with record(), or
+// written to REPLAY_FILE with the PlatformIO filesystem uploader.
+class Replay
+    {
+    public:
+        void setLogOutput(Print& log);
+        bool start(uint16_t rate); //frames per second, 0 for as fast as they'll go
+        void stop();
+        bool running() {return _running;}
+        const char* nextLine();
+        void frameDone(uint32_t cycles, uint32_t heapBefore);
+        void lineSkipped() {_result.skipped++;}
+        bool record(uint16_t frames);
+        void capture(const rcvFrame& frame);
+        uint16_t recording() {return _toRecord;}
+        const replayResult& result() {return _result;}
+
+    private:
+        Print* _log=&Serial;
+        File _file;
+        bool _running=false;
+        uint16_t _rate=0;
+        uint32_t _lines=0;       //lines handed out so far
+        uint32_t _startMicros=0;
+        uint64_t _totalCycles=0;
+        uint32_t _worstCycles=0;
+        int64_t _heapLost=0;
+        uint16_t _toRecord=0;    //frames still to record
+        replayResult _result={};
+        char _line[RYLR998_LINE_SIZE];
+        void _finish();
+        void _compare(const replayResult& last);
+    };
+
+#endif // REPLAY_H
@@ -0,0 +1,123 @@
+#ifndef SETTINGSTABLE_H
+#define SETTINGSTABLE_H
+
+#include <Arduino.h>
+
+typedef enum
+    {
+    SETTING_STRING, //char array, NUL terminated
+    SETTING_BOOL,   //bool
+    SETTING_FLAG,   //byte that is 0 or 1
+    SETTING_BYTE,
+    SETTING_UINT16,
+    SETTING_INT,
+    SETTING_UINT32,
+    SETTING_FLOAT
+    } settingType;
+
+// Where one setting lives in the settings struct, what it can be set to, and
+// what has to happen once it has been
+typedef struct
+    {
+    const char* name;  //as used in commands and the settings JSON
+    uint8_t type;
+    uint16_t offset;   //in the settings struct
+    uint16_t size;     //of the member, which for a string includes the NUL
+    int32_t min;       //for numbers; strings just have to fit
+    int32_t max;
+    void (*changed)(); //called once the setting has changed and been saved, or nullptr
+    const char* help;  //what goes after the "=" in the list of settings
+    } settingField;
+
+// strcmp() for compile time
+constexpr int compareNames(const char* a, const char* b)
+    {
+    while (*a && *a==*b)
+        {
+        a++;
+        b++;
+        }
+    return (unsigned char)*a-(unsigned char)*b;
+    }
+
+// The entries of a table in name order, by index
+template <size_t N>
+struct nameOrder
+    {
+    uint8_t index[N];
+    };
+
+// Sort a table of anything with a name by name, at compile time, so it can
+// be listed in whatever order reads best and still binary searched
+template <typename T, size_t N>
+constexpr nameOrder<N> sortByName(const T (&table)[N])
+    {
+    nameOrder<N> order{};
+    for (size_t i=0; i<N; i++)
+        order.index[i]=i;
+    for (size_t i=1; i<N; i++)
+        for (size_t j=i; j>0 && compareNames(table[order.index[j]].name,table[order.index[j-1]].name)<0; j--)
+            {
+            uint8_t swap=order.index[j];
+            order.index[j]=order.index[j-1];
+            order.index[j-1]=swap;
+            }
+    return order;
+    }
+
+// There have to be no two entries with the same name for the search to work
+template <typename T, size_t N>
+constexpr bool namesAreUnique(const T (&table)[N], const nameOrder<N>& order)
+    {
+    for (size_t i=1; i<N; i++)
+        if (compareNames(table[order.index[i-1]].name,table[order.index[i]].name)==0)
+            return false;
+    return true;
+    }
+
+// Binary search a table sorted by sortByName()
+template <typename T>
+const T* findByName(const T* table, const uint8_t* order, size_t count, const char* name)
+    {
+    size_t low=0;
+    size_t high=count;
+    while (low<high)
+        {
+        size_t middle=(low+high)/2;
+        const T* entry=&table[order[middle]];
+        int compared=strcmp(name,entry->name);
+        if (compared==0)
+            return entry;
+        if (compared<0)
+            high=middle;
+        else
+            low=middle+1;
+        }
+    return nullptr;
+    }
+
+// Reads, writes and prints settings by name, using a table of settingFields
+// that describes the settings struct. The same table drives the list on the
+// console, the settings JSON and setting values from commands.
+class SettingsTable
+    {
+    public:
+        SettingsTable(const settingField* fields, const uint8_t* order, uint8_t count, void* settings);
+        const settingField* find(const char* name);
+        bool check(const settingField& field, const char* val);
+        bool set(const settingField& field, const char* val);
+        size_t printValue(Print& out, const settingField& field);
+        size_t printJsonValue(Print& out, const settingField& field);
+        size_t printJsonFields(Print& out);
+        void show(Print& out);
+        uint8_t count() {return _count;}
+        const settingField& field(uint8_t index) {return _fields[index];}
+
+    private:
+        const settingField* _fields;
+        const uint8_t* _order; //_fields by name
+        uint8_t _count;
+        uint8_t* _settings;
+    };
+
+#endif // SETTINGSTABLE_H
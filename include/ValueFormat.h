@@ -0,0 +1,21 @@
+#ifndef VALUEFORMAT_H
+#define VALUEFORMAT_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define FORMAT_MAX_DECIMALS 6 //more than this doesn't fit the fixed point math
+
+// Turn values into text for publishing. Each of these writes at most size-1
+// characters plus a NUL into out, cutting the value short if it doesn't fit,
+// and returns the number of characters written.
+size_t formatInteger(char* out, size_t size, long value);
+size_t formatFixed(char* out, size_t size, double value, uint8_t decimals);
+size_t formatBool(char* out, size_t size, bool value);
+size_t formatString(char* out, size_t size, const char* value);
+
+// Format whatever type of value is in a JSON variant. Returns 0, with out
+// empty, if it isn't a type that can be published.
+size_t formatValue(char* out, size_t size, JsonVariant value, uint8_t decimals);
+
+#endif // VALUEFORMAT_H
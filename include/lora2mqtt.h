@@ -14,6 +14,12 @@
 #define MQTT_TOPIC_ANALOG "analog"
 #define MQTT_TOPIC_RSSI "rssi"
 #define MQTT_TOPIC_SNR "snr"
+#define MQTT_TOPIC_ADDRESS "address"
+#define MQTT_TOPIC_LENGTH "length"
+#define MQTT_TOPIC_CHANNEL "channel" //which module a frame came in on, when there is more than one
+#define MQTT_TOPIC_JSON "json" //whole frame as one message goes to <topicroot><address>/json
+#define MQTT_TOPIC_NODE_SUMMARY "nodesummary" //periodic summary of all nodes
+#define MQTT_TOPIC_METRICS "metrics" //periodic timing report
 #define MQTT_CLIENT_ID_ROOT "DeliveryReporter"
 #define MQTT_TOPIC_COMMAND_REQUEST "command"
 #define MQTT_PAYLOAD_SETTINGS_COMMAND "settings" //show all user accessable settings
@@ -21,14 +27,48 @@
 #define MQTT_PAYLOAD_REBOOT_COMMAND "reboot" //reboot the controller
 #define MQTT_PAYLOAD_VERSION_COMMAND "version" //show the version number
 #define MQTT_PAYLOAD_STATUS_COMMAND "status" //show the most recent flow values
-#define JSON_STATUS_SIZE SSID_SIZE+PASSWORD_SIZE+USERNAME_SIZE+MQTT_TOPIC_SIZE+150 //+150 for associated field names, etc
+#define MQTT_PAYLOAD_STORE_COMMAND "store" //show the store and forward counters
+#define MQTT_PAYLOAD_NODES_COMMAND "nodes" //show the statistics for each node
+#define MQTT_PAYLOAD_DUPLICATES_COMMAND "duplicates" //show how many resent frames were suppressed
+#define MQTT_PAYLOAD_AIRTIME_COMMAND "airtime" //show channel utilisation and ack scheduling
+#define MQTT_PAYLOAD_METRICS_COMMAND "metrics" //show the timing metrics
+#define MQTT_PAYLOAD_RULES_COMMAND "rules" //show the filtering and routing rules
+#define MQTT_COMMAND_SIZE 200 //longest command accepted over MQTT, room for an update URL
+#define COMMAND_LINE_SIZE 200 //longest command line from the console or MQTT
+#define COMMAND_MAX_PARTS 8 //commands that can go on one line, separated by ";"
+#define MQTT_COMMAND_QUEUE_LENGTH 4 //MQTT commands that can be waiting to run
+#define REBOOT_DELAY 2000 //ms to let the reboot response get to the broker before rebooting
+#define UPDATE_DRAIN_TIMEOUT 30000 //most ms to wait for stored frames to go out before rebooting into new firmware
+#define MQTT_BUFFER_SIZE 500 //for commands coming in and messages not streamed out
 #define PUBLISH_DELAY 400 //milliseconds to wait after publishing to MQTT to allow transaction to finish
 #define WIFI_TIMEOUT_SECONDS 20 // give up on wifi after this long
+#define WIFI_RETRY_DELAY 3000 // ms to wait after a failed wifi connection before starting over
+#define MQTT_BACKOFF_MIN 1000 // ms to wait after the first failed broker connection
+#define MQTT_BACKOFF_MAX 60000 // longest wait between broker connection attempts
+#define MQTT_CONNECT_TIMEOUT 3 // seconds a single broker connection attempt can take
 #define FULL_BATTERY_COUNT 3686 //raw A0 count with a freshly charged 18650 lithium battery 
 #define FULL_BATTERY_VOLTS 412 //4.12 volts for a fully charged 18650 lithium battery 
 #define ONE_HOUR 3600000 //milliseconds
 #define LORA_RX_PIN D5
 #define LORA_TX_PIN D6
+// Build with -DLORA_HARDWARE_SERIAL to run the LoRa module on UART0 instead of
+// SoftwareSerial. The module then connects to D7 (GPIO13, RX) and D8 (GPIO15, TX),
+// the console moves to UART1 TX on D4 (GPIO2), and configuration is MQTT only.
+// Until the settings are complete the console stays on UART0, over USB, so a
+// new gateway can be set up from there. It moves as soon as they are.
+// Build with -DLORA_RADIO_COUNT=2 or 3 for more modules, each on its own
+// channel, on SoftwareSerial at the pins below. They all use loRaBaudRate.
+#ifndef LORA_RADIO_COUNT
+#define LORA_RADIO_COUNT 1
+#endif
+#define LORA_MAX_RADIOS 3 // modules there are settings for
+#ifdef LORA_HARDWARE_SERIAL
+#define LORA_EXTRA_RX_PINS {D5,D3}
+#define LORA_EXTRA_TX_PINS {D6,D0}
+#else
+#define LORA_EXTRA_RX_PINS {D7,D3}
+#define LORA_EXTRA_TX_PINS {D8,D0}
+#endif
 #define DEFAULT_LORA_ADDRESS 1
 #define DEFAULT_LORA_NETWORK_ID 18
 #define DEFAULT_LORA_BAND 915000000
@@ -38,6 +78,36 @@
 #define DEFAULT_LORA_PREAMBLE 12
 #define DEFAULT_LORA_BAUD_RATE 115200
 #define DEFAULT_LORA_POWER 22
+#define DEFAULT_LORA_RX_TIME 50 // ms listening in each smart receiving cycle
+#define DEFAULT_LORA_SLEEP_TIME 50 // ms asleep in each one, less than the default 66ms preamble
+#define LORA_BAND_MIN 820000000 //Hz, the module's range
+#define LORA_BAND_MAX 960000000
+#define LORA_SMART_TIME_MIN 30
+#define LORA_SMART_TIME_MAX 60000
+#define LORA_MODE_TRANSCEIVER 0
+#define LORA_MODE_SMART_RECEIVE 2
+#define LOW_POWER_LISTEN_INTERVAL 3 // DTIM beacons the WiFi radio sleeps through in low power mode
+#define LOW_POWER_IDLE_MS 50 // longest rest between loop() passes in low power mode
+#define MAX_FRAMES_PER_LOOP 4 // most LoRa frames to process in one pass through loop()
+#define FRAME_STORE_FORWARD_INTERVAL 250 // ms between stored frames forwarded once the broker is back
+#define DEFAULT_NODE_SUMMARY_INTERVAL 300 // seconds between node statistics summaries
+#define DEFAULT_DUPLICATE_WINDOW 30 // seconds a resent frame is acked but not published again
+#define DEFAULT_DECIMALS 2 // decimal places for published numbers
+#define DEFAULT_DEADBAND 0 // smallest change in a number published with changeonly=1
+#define DEFAULT_DEADBAND_PERCENT 0 // the same, in percent of the last value published
+#define DEFAULT_HEARTBEAT 900 // seconds before an unchanged field is published again anyway
+#define DEFAULT_METRICS_INTERVAL 0 // seconds between timing reports, off unless tuning
+#define LORA_PROBE_ATTEMPTS 5 // times to try the module at boot before carrying on without it
+#define SETTINGS_COMMIT_DELAY 5000 // ms after the last settings change before they are written to flash
+#define DEFAULT_PUBLISH_QOS 0 // ack frames as soon as they are written to the broker connection
+#define DEFAULT_DUTY_CYCLE 0 // tenths of a percent of airtime for acks, none needed at 915MHz
+#define AIRTIME_WINDOW 3600000UL // ms, duty cycle rules go by the hour
+#define AIRTIME_RECENT_WINDOW 12000UL // ms of recent airtime used to tell if the channel is busy
+#define AIRTIME_WARNING 2000000UL // us, a full size frame taking longer than this is a problem
+#define ACK_QUEUE_LENGTH 4 // acks that can be waiting to go out
+#define ACK_MAX_DELAY 2000 // ms an ack can be held back before the sender gives up on it
+#define PUBACK_TIMEOUT 1000 // ms to wait for the broker to confirm a frame before NAKing it
+#define ACK_BUSY_PERMILLE 500 // hold acks while the channel was this busy recently, in tenths of a percent
 #define SCREEN_WIDTH 128      // OLED display width, in pixels
 #define SCREEN_HEIGHT 32      // OLED display height, in pixels
 #define OLED_RESET    -1      // Reset pin # (or -1 if sharing Arduino reset pin)
@@ -46,24 +116,170 @@
 #define DOT_SPACING   4       // spacing between dots
 
 #define RSSI_DOT_RADIUS 2       // Radius of the little dot at the bottom of the wifi indicator
-#define SHOWBUF_LENGTH 20     // Number of entries in the show buffer
-#define SHOWBUF_WIDTH 20     // Max size of entries in the show buffer
+#define WIFI_ICON_SIZE 21       // Width and height of the wifi indicator, big enough for the outer arc
+#define OLED_I2C_CLOCK 400000   // I2C bus speed for the display
+#define OLED_I2C_CHUNK 31       // display bytes per I2C transmission, plus the control byte
+#define PUBLISH_MODE_FIELDS 0 // publish each field to its own topic
+#define PUBLISH_MODE_JSON 1   // publish the whole frame as one JSON message
+#define PUBLISH_MODE_BOTH 2   // do both
+
+
+typedef enum
+  {
+  WIFI_STATE_IDLE,       //need to start a connection
+  WIFI_STATE_CONNECTING, //waiting for an IP address
+  WIFI_STATE_WAITING,    //connection timed out, waiting to try again
+  WIFI_STATE_CONNECTED
+  } wifiState;
+
+typedef enum
+  {
+  TOPIC_ADDRESS,      //these four are the fields added to every frame
+  TOPIC_LENGTH,
+  TOPIC_RSSI,
+  TOPIC_SNR,
+  TOPIC_COMMAND,
+  TOPIC_NODE_SUMMARY,
+  TOPIC_METRICS,
+  TOPIC_CHANNEL,
+  TOPIC_SUFFIX_COUNT
+  } topicSuffix;
+
+typedef struct
+  {
+  uint16_t address;
+  uint8_t channel;        //module to send it on
+  bool ok;
+  unsigned long queuedAt; //millis() when the frame it answers was handled
+  bool held;              //had to wait at least once
+  } pendingAck;
+
+// What a line of commands will leave behind, worked out while it's being
+// checked so that each part is checked against the ones before it
+typedef struct
+  {
+  loraRadio radios[LORA_MAX_RADIOS]; //each module's radio settings
+  bool radioChanged[LORA_MAX_RADIOS];
+  uint8_t rules; //how many rules there will be
+  } pendingCommands;
+
+// A command that does something rather than set a setting. check() says
+// whether run() would make sense of it, without doing anything. check is
+// nullptr if there's nothing to check, run if check() did everything.
+typedef struct
+  {
+  const char* name;
+  bool (*check)(const char* val, pendingCommands& pending);
+  bool (*run)(const char* val);
+  } commandHandler;
+
+// Radio settings for one of the extra modules. The first module's are
+// separate settings of their own, from before there could be more than one.
+typedef struct
+  {
+  uint32_t band;
+  uint32_t configHash; //radioConfigHash() of the settings last applied, 0 if unsure
+  byte networkID;
+  byte spreadingFactor;
+  byte bandwidth;
+  byte codingRate;
+  byte preamble;
+  int8_t power;
+  } radioSettings;
 
 
 void showSettings();
 String getConfigCommand();
-bool processCommand(String cmd);
+bool processCommand(const char* cmd);
+bool checkRule(const char* val, pendingCommands& pending);
+bool commandRule(const char* val);
+bool checkDeleteRule(const char* val, pendingCommands& pending);
+bool commandDeleteRule(const char* val);
+bool checkCount(const char* val, pendingCommands& pending);
+bool commandRecord(const char* val);
+bool commandReplay(const char* val);
+bool commandSave(const char* val);
+bool checkYes(const char* val, pendingCommands& pending);
+bool commandResetMqttId(const char* val);
+bool commandFactoryDefaults(const char* val);
+bool checkUpdate(const char* val, pendingCommands& pending);
+bool commandUpdate(const char* val);
+void serviceFirmwareUpdate();
 void checkForCommand();
-bool report();
+bool report(const rcvFrame& frame);
+bool ack(bool ok);
+bool ack(bool ok, uint16_t address, uint8_t channel);
+void sendAcks();
+uint32_t frameAirtime(uint8_t length, uint8_t channel=0);
+void loadFrame(const rcvFrame& frame);
+bool publishField(uint16_t address, const char* key, size_t keyLength, const char* reading, size_t length);
+bool publishScannedFields(const rcvFrame& frame);
+bool publishDocFields(const rcvFrame& frame);
+bool publishFrame(const rcvFrame& frame, bool* started=nullptr);
+void handleFrame(RYLR998& radio);
+void forwardStoredFrames();
+void updateNodeStats(const rcvFrame& frame);
+boolean publishNodes(char* topic, bool compact, boolean retain);
+void publishNodeSummary();
+void serviceReplay();
+void servicePubacks();
+boolean beginFramePublish(char* topic, size_t length, boolean retain);
+boolean publishMetrics(char* topic, boolean retain);
+void publishMetricsReport();
+boolean publishRules(char* topic, boolean retain);
+size_t printSettingsJson(Print& out);
+boolean publishSettings(char* topic, boolean retain);
+bool uplinkConnected();
+void setTopicRoot();
+void useTopicRoot(const char* root);
+char* topicFor(const char* suffix, size_t length);
+char* topicFor(const char* suffix);
+char* topicFor(topicSuffix suffix);
 boolean publish(char* topic, const char* reading, boolean retain);
+boolean publish(char* topic, const char* reading, size_t length, boolean retain);
+boolean publishJson(char* topic, JsonDocument& json, boolean retain);
+boolean publishJsonFrame(char* topic, const rcvFrame& frame, boolean retain);
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) ;
-void setup_wifi();
+void processMqttCommands();
+void handleMqttCommand(char* charbuf);
 void connectToWiFi();
 void reconnect();
 void showSub(char* topic, bool subgood);
 void initializeSettings();
 boolean saveSettings();
-void deserialize(StaticJsonDocument<250> &doc);
+boolean commitSettings();
+uint32_t radioConfigHash(uint8_t radio=0);
+void radioConfigured(bool ok, uint8_t radio=0, bool complete=false);
+void configureLoRa(uint8_t radio);
+radioSettings radioConfig(uint8_t radio);
+void defaultRadioSettings(radioSettings& config);
+bool setRadioField(loraRadio& config, const char* field, long value);
+bool checkRadioSetting(const char* name, const char* val, pendingCommands& pending);
+bool checkRadio(const char* val, pendingCommands& pending);
+bool checkRadios(pendingCommands& pending);
+loraRadio loraRadioFor(const radioSettings& config);
+void storeRadioConfig(uint8_t radio, const loraRadio& config);
+bool applyRadio(uint8_t radio, const loraRadio& config);
+bool isFrameField(const char* key, size_t keyLength);
+void queue(const char* text);
+bool loRaAvailable();
+void setLoRaMode();
+void setLoRaMode(uint8_t radio);
+bool smartReceiveFits(uint8_t radio);
+bool useSmartReceive(uint8_t radio);
+void warnSmartReceive(uint8_t radio);
+void setLoRaAddress();
+void setLoRaBaudRate();
+void setLowPower();
+void setDebug();
+void setDisplayRotation();
+void setSpillToFlash();
+void setChangeOnly();
+void setWiFiSleep();
+void setDeadband();
+void lowPowerIdle();
+void startGateway();
+void serviceSettings();
 void setup();
 void loop();
 void incomingSerialData();
@@ -0,0 +1,85 @@
+/* Time on air for LoRa frames, and a meter to add it up.
+ *
+ * The RYLR998 is built around an SX1262, so this is the formula from the SX126x
+ * datasheet, with the CRC on and an explicit header like the module uses. Low
+ * data rate optimization comes on by itself once a symbol takes more than
+ * 16ms, at SF11 and SF12 at 125kHz and SF12 at 250kHz.
+ */
+
+#include "Airtime.h"
+
+static uint32_t symbolTime(uint8_t sf, uint8_t bw)
+    {
+    static const uint32_t bandwidths[]={125000,250000,500000};
+    uint32_t hz=bandwidths[constrain(bw,7,9)-7];
+    return (uint32_t)(((uint64_t)1000000<<sf)/hz); //microseconds
+    }
+
+uint32_t preambleTime(uint8_t sf, uint8_t bw, uint8_t preamble)
+    {
+    sf=constrain(sf,5,12);
+    // preamble plus 4.25 symbols of sync word, or 6.25 at SF5 and SF6, in quarter symbols
+    uint32_t preambleQuarters=preamble*4+(sf<7?25:17);
+    return preambleQuarters*symbolTime(sf,bw)/4;
+    }
+
+uint32_t timeOnAir(uint8_t length, uint8_t sf, uint8_t bw, uint8_t cr, uint8_t preamble)
+    {
+    sf=constrain(sf,5,12);
+    cr=constrain(cr,1,4);
+
+    uint32_t symbol=symbolTime(sf,bw);
+    bool lowDataRate=symbol>=16380;
+
+    int32_t bits=8*length+16-4*sf+(sf<7?20:28);
+    int32_t perBlock=4*(sf-(lowDataRate?2:0));
+    uint32_t blocks=bits>0?(bits+perBlock-1)/perBlock:0;
+    uint32_t symbols=8+blocks*(cr+4);
+
+    return preambleTime(sf,bw,preamble)+symbols*symbol;
+    }
+
+AirtimeMeter::AirtimeMeter(uint32_t window)
+    {
+    _bucketLength=window/AIRTIME_BUCKETS;
+    }
+
+void AirtimeMeter::add(uint32_t micros)
+    {
+    _advance();
+    _buckets[_current]+=micros;
+    }
+
+uint32_t AirtimeMeter::total()
+    {
+    _advance();
+    uint32_t sum=0;
+    for (int i=0; i<AIRTIME_BUCKETS; i++)
+        sum+=_buckets[i];
+    return sum;
+    }
+
+uint16_t AirtimeMeter::permille()
+    {
+    return min(total()/window(),(uint32_t)1000); //us per ms of window is tenths of a percent
+    }
+
+// Move to the bucket for the current time, emptying any that have gone by
+void AirtimeMeter::_advance()
+    {
+    uint32_t steps=(millis()-_bucketStart)/_bucketLength;
+    if (steps==0)
+        return;
+    if (steps>=AIRTIME_BUCKETS)
+        {
+        memset(_buckets,0,sizeof(_buckets));
+        _bucketStart=millis();
+        return;
+        }
+    for (uint32_t i=0; i<steps; i++)
+        {
+        _current=(_current+1)%AIRTIME_BUCKETS;
+        _buckets[_current]=0;
+        }
+    _bucketStart+=steps*_bucketLength;
+    }
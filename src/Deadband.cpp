@@ -0,0 +1,99 @@
+/* Change-only publishing for field topics.
+ *
+ * A numeric field counts as changed when it has moved by more than the
+ * absolute deadband and by more than the relative one, as a percentage of
+ * the value last published. Either one set to 0 doesn't hold anything back,
+ * so with both at 0 only repeats of the same value are left out. Any other
+ * field counts as changed when its text is different. Whatever happens, a
+ * field is published again once the heartbeat has gone by without it, so
+ * the retained value never gets too stale, and straight away if a
+ * different node was the last to publish on its topic.
+ *
+ * The table is open addressed with linear probing on a hash of the topic.
+ * When it's full the entry published longest ago is replaced.
+ */
+
+#include "Deadband.h"
+#include "NodeTable.h"
+
+void Deadband::configure(float absolute, uint8_t percent, uint16_t heartbeat)
+    {
+    _absolute=absolute;
+    _percent=percent;
+    _heartbeat=heartbeat*1000UL;
+    }
+
+// Forget everything, so every field gets published the next time it comes in
+void Deadband::clear()
+    {
+    memset(_entries,0,sizeof(_entries));
+    _slot=nullptr;
+    }
+
+bool Deadband::isNew(uint16_t address, const char* topic, const char* reading, size_t length)
+    {
+    uint32_t now=millis();
+    memset(&_pending,0,sizeof(_pending));
+    _pending.used=true;
+    _pending.address=address;
+    _pending.topicHash=NodeTable::hashPayload(topic,strlen(topic));
+    _pending.publishedAt=now;
+
+    char number[24];
+    char* end=nullptr;
+    if (length>0 && length<sizeof(number))
+        {
+        memcpy(number,reading,length);
+        number[length]='\0';
+        _pending.value=strtod(number,&end);
+        }
+    _pending.numeric=end==number+length && length>0;
+    if (!_pending.numeric)
+        _pending.textHash=NodeTable::hashPayload(reading,length);
+
+    _slot=_find(_pending.topicHash);
+    const deadbandEntry& last=*_slot;
+    if (!last.used || last.topicHash!=_pending.topicHash || last.address!=address
+            || last.numeric!=_pending.numeric
+            || (_heartbeat>0 && now-last.publishedAt>=_heartbeat))
+        return true;
+
+    bool changed;
+    if (_pending.numeric)
+        {
+        float change=fabsf(_pending.value-last.value);
+        changed=change>_absolute && change*100>fabsf(last.value)*_percent;
+        }
+    else
+        changed=_pending.textHash!=last.textHash;
+    if (!changed)
+        suppressed++;
+    return changed;
+    }
+
+// The field isNew() was last asked about went out, so remember it
+void Deadband::published()
+    {
+    if (_slot)
+        *_slot=_pending;
+    _slot=nullptr;
+    }
+
+// The entry for this topic, or where it would go
+deadbandEntry* Deadband::_find(uint32_t topicHash)
+    {
+    uint16_t start=topicHash&(DEADBAND_CACHE_SIZE-1);
+    for (uint16_t probe=0; probe<DEADBAND_CACHE_SIZE; probe++)
+        {
+        deadbandEntry* entry=&_entries[(start+probe)&(DEADBAND_CACHE_SIZE-1)];
+        if (!entry->used || entry->topicHash==topicHash)
+            return entry;
+        }
+
+    uint32_t now=millis();
+    deadbandEntry* oldest=&_entries[0];
+    for (int i=1; i<DEADBAND_CACHE_SIZE; i++)
+        if (now-_entries[i].publishedAt>now-oldest->publishedAt)
+            oldest=&_entries[i];
+    return oldest;
+    }
@@ -0,0 +1,65 @@
+/* Suppression of retransmitted frames.
+ *
+ * A transmitter that doesn't hear {"ack":true} sends the same frame again. A
+ * frame is only remembered here once it has been published or stored, so a
+ * frame that failed still gets another chance when it is resent. The cache is
+ * small enough that a linear search is quicker than anything clever.
+ */
+
+#include "DuplicateCache.h"
+#include "NodeTable.h"
+
+// Check whether this frame was already handled within the last window ms.
+// A hit counts as suppressed and refreshes the entry, so a node that keeps
+// retrying keeps getting acked without being published.
+bool DuplicateCache::isDuplicate(const rcvFrame& frame, uint32_t window)
+    {
+    if (window==0)
+        return false;
+    seenFrame* seen=_find(frame.address, NodeTable::hashPayload(frame.payload, frame.payloadLength));
+    uint32_t now=millis();
+    if (seen==nullptr || now-seen->lastSeen>window)
+        return false;
+    seen->lastSeen=now;
+    suppressed++;
+    return true;
+    }
+
+// Note a frame that has been dealt with, pushing out the least recently seen
+// one if there is no room.
+void DuplicateCache::remember(const rcvFrame& frame)
+    {
+    uint32_t hash=NodeTable::hashPayload(frame.payload, frame.payloadLength);
+    seenFrame* seen=_find(frame.address, hash);
+    if (seen==nullptr)
+        {
+        uint32_t now=millis();
+        seen=&_frames[0];
+        for (int i=0; i<DUPLICATE_CACHE_SIZE && seen->used; i++)
+            if (!_frames[i].used || now-_frames[i].lastSeen>now-seen->lastSeen)
+                seen=&_frames[i];
+        seen->used=true;
+        seen->address=frame.address;
+        seen->payloadHash=hash;
+        }
+    seen->lastSeen=millis();
+    }
+
+// Take back a frame that turned out not to have been delivered after all
+void DuplicateCache::forget(uint16_t address, uint32_t payloadHash)
+    {
+    seenFrame* seen=_find(address, payloadHash);
+    if (seen!=nullptr)
+        seen->used=false;
+    }
+
+seenFrame* DuplicateCache::_find(uint16_t address, uint32_t hash)
+    {
+    for (int i=0; i<DUPLICATE_CACHE_SIZE; i++)
+        {
+        seenFrame* seen=&_frames[i];
+        if (seen->used && seen->address==address && seen->payloadHash==hash)
+            return seen;
+        }
+    return nullptr;
+    }
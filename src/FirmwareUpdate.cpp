@@ -0,0 +1,151 @@
+/* Over the air firmware updates, pulled from a web server.
+ *
+ * The request and its headers are a single blocking exchange, limited by
+ * UPDATE_CONNECT_TIMEOUT. After that the body is read as it arrives, at most
+ * UPDATE_CHUNK_SIZE bytes per pass through loop(), so frames keep being
+ * received, acked, stored and forwarded while it comes in.
+ *
+ * The image goes into the free flash after the running firmware, which is
+ * never touched. Only once all of it is there and its MD5 matches does
+ * Update.end() tell the boot loader to copy it over the old one, which
+ * happens at the next reboot. Anything else, like a short download, a
+ * stalled server or the wrong hash, throws it away and carries on with
+ * the firmware we have.
+ *
+ * Only plain http URLs work. The server has to send a Content-Length.
+ */
+
+#include "FirmwareUpdate.h"
+#include <Updater.h>
+
+void FirmwareUpdate::setLogOutput(Print& log)
+    {
+    _log=&log;
+    }
+
+// Request the firmware and get ready to take it. md5 is the hash of the
+// whole image, in hex. Returns false, with the reason on the log, if the
+// download can't be started.
+bool FirmwareUpdate::start(const char* url, const char* md5)
+    {
+    if (running())
+        {
+        _log->println("UPDATE:Already updating");
+        return false;
+        }
+    if (!isValidMd5(md5))
+        {
+        _log->println("UPDATE:The hash has to be 32 hex digits of MD5");
+        return false;
+        }
+    _received=0;
+    _size=0;
+    _lastReported=0;
+    _state=UPDATE_DOWNLOADING; //so _fail() cleans up from here on
+
+    _http.setTimeout(UPDATE_CONNECT_TIMEOUT);
+    _http.useHTTP10(true); //no chunked transfer encoding, so the body is just the image
+    if (!_http.begin(_client,url))
+        {
+        _fail("Can't use that URL, it has to be http://");
+        return false;
+        }
+    int code=_http.GET();
+    if (code!=HTTP_CODE_OK)
+        {
+        _log->print("UPDATE:Server answered ");
+        _log->println(code);
+        _fail("Download failed");
+        return false;
+        }
+    int size=_http.getSize();
+    if (size<=0)
+        {
+        _fail("Server didn't say how big the firmware is");
+        return false;
+        }
+    if (!Update.begin(size))
+        {
+        _fail("Not enough room for the new firmware");
+        return false;
+        }
+    Update.setMD5(md5);
+    _size=size;
+    _lastData=millis();
+    _log->print("UPDATE:Downloading ");
+    _log->print(_size);
+    _log->println(" bytes");
+    return true;
+    }
+
+bool FirmwareUpdate::isValidMd5(const char* md5)
+    {
+    return strlen(md5)==UPDATE_MD5_LENGTH && strspn(md5,"0123456789abcdefABCDEF")==UPDATE_MD5_LENGTH;
+    }
+
+// Take whatever has arrived, up to a chunk, and write it to flash. Never
+// waits for more.
+void FirmwareUpdate::service()
+    {
+    if (!running())
+        return;
+    WiFiClient* stream=_http.getStreamPtr();
+    size_t available=stream?stream->available():0;
+    if (available==0)
+        {
+        if (!stream || !stream->connected())
+            _fail("Connection closed before the download was done");
+        else if (millis()-_lastData>=UPDATE_STALL_TIMEOUT)
+            _fail("Download stalled");
+        return;
+        }
+
+    size_t wanted=min(min(available,(size_t)UPDATE_CHUNK_SIZE),(size_t)(_size-_received));
+    int length=stream->read(_chunk,wanted);
+    if (length<=0)
+        return;
+    if (Update.write(_chunk,length)!=(size_t)length)
+        {
+        _fail("Couldn't write the firmware to flash");
+        return;
+        }
+    _received+=length;
+    _lastData=millis();
+    uint8_t percent=(uint64_t)_received*100/_size;
+    if (percent/10!=_lastReported/10)
+        {
+        _log->print("UPDATE:");
+        _log->print(percent);
+        _log->println("%");
+        _lastReported=percent;
+        }
+    if (_received<_size)
+        return;
+
+    _http.end();
+    if (!Update.end())
+        {
+        _log->print("UPDATE:");
+        _log->println(Update.getErrorString());
+        _fail("New firmware didn't check out, keeping this one");
+        return;
+        }
+    _state=UPDATE_VERIFIED;
+    _log->println("UPDATE:New firmware checked out, it goes in at the next reboot");
+    }
+
+void FirmwareUpdate::cancel()
+    {
+    if (running())
+        _fail("Cancelled");
+    }
+
+void FirmwareUpdate::_fail(const char* why)
+    {
+    _log->print("UPDATE:");
+    _log->println(why);
+    if (Update.isRunning())
+        Update.end(false); //throws away what was written
+    _http.end();
+    _state=UPDATE_FAILED;
+    }
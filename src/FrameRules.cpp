@@ -0,0 +1,330 @@
+/* Rules for which frames and fields get published, and where.
+ *
+ * A rule is a match and an action separated by a space:
+ *   any             every frame
+ *   addr:<n>        frames from this address
+ *   addr:<n>-<m>    frames from any address in this range
+ *   net:<n>         frames heard on this network ID
+ *   key:<name>      fields with this name, in any case
+ * and
+ *   drop            don't publish it
+ *   limit:<s>       publish a node's frames at most once every s seconds
+ *   route:<root>    publish under this topic root instead of topicroot
+ *   rename:<name>   publish a field under this name (key rules only)
+ * Frames that aren't published are still acked, so the sender doesn't keep
+ * sending them. Key rules apply to the field topics, not the JSON message.
+ *
+ * The rules live in the settings, so main.cpp saves them after a change.
+ *
+ * The list looks like
+ *   {"rules":["addr:100-199 drop","key:battery route:home/batteries/"],
+ *    "dropped":12,"limited":40}
+ */
+
+#include "FrameRules.h"
+#include "ByteCounter.h"
+
+static const char* const matchNames[RULE_MATCH_COUNT]={"any","addr","net","key"};
+static const char* const actionNames[RULE_ACTION_COUNT]={"drop","rename","limit","route"};
+
+void FrameRules::begin(ruleTable& table)
+    {
+    _table=&table;
+    _compile();
+    }
+
+// Work out what the per frame checks can skip, and forget the rate limits,
+// since the rules they were for may have gone
+void FrameRules::_compile()
+    {
+    _hasKeyRules=false;
+    _hasFrameRules=false;
+    for (uint8_t i=0; i<_table->count; i++)
+        {
+        if (_table->rules[i].match==RULE_MATCH_KEY)
+            _hasKeyRules=true;
+        else
+            _hasFrameRules=true;
+        }
+    _limitCount=0;
+    }
+
+// Check the table loaded from the settings. Anything not written by this
+// firmware gets thrown away.
+bool FrameRules::isValid()
+    {
+    if (_table->count>RULES_MAX)
+        return false;
+    for (uint8_t i=0; i<_table->count; i++)
+        {
+        const frameRule& rule=_table->rules[i];
+        if (rule.match>=RULE_MATCH_COUNT || rule.action>=RULE_ACTION_COUNT
+                || rule.keyLength>=RULE_KEY_SIZE
+                || memchr(rule.text,'\0',RULE_TEXT_SIZE)==nullptr)
+            return false;
+        }
+    return true;
+    }
+
+bool FrameRules::add(const char* spec)
+    {
+    if (_table->count>=RULES_MAX)
+        return false;
+    frameRule rule;
+    if (!_parse(spec,rule))
+        return false;
+    _table->rules[_table->count++]=rule;
+    _compile();
+    return true;
+    }
+
+bool FrameRules::check(const char* spec)
+    {
+    frameRule rule;
+    return _parse(spec,rule);
+    }
+
+// Remove a rule, counting from 0
+bool FrameRules::remove(uint8_t index)
+    {
+    if (index>=_table->count)
+        return false;
+    for (uint8_t i=index; i+1<_table->count; i++)
+        _table->rules[i]=_table->rules[i+1];
+    _table->count--;
+    _compile();
+    return true;
+    }
+
+void FrameRules::clear()
+    {
+    memset(_table,0,sizeof(ruleTable));
+    _compile();
+    }
+
+bool FrameRules::_parse(const char* spec, frameRule& rule)
+    {
+    memset(&rule,0,sizeof(rule));
+    while (*spec==' ')
+        spec++;
+    const char* action=strchr(spec,' ');
+    if (!action)
+        return false;
+    size_t matchLength=action-spec;
+    while (*action==' ')
+        action++;
+
+    const char* arg=(const char*)memchr(spec,':',matchLength);
+    size_t nameLength=arg?arg-spec:matchLength;
+    size_t argLength=arg?matchLength-nameLength-1:0;
+    if (arg)
+        arg++;
+
+    rule.match=RULE_MATCH_COUNT;
+    for (uint8_t m=0; m<RULE_MATCH_COUNT; m++)
+        if (strlen(matchNames[m])==nameLength && strncmp(spec,matchNames[m],nameLength)==0)
+            rule.match=m;
+    switch (rule.match)
+        {
+        case RULE_MATCH_ANY:
+            if (arg)
+                return false;
+            break;
+        case RULE_MATCH_ADDRESS:
+        case RULE_MATCH_NETWORK:
+            {
+            if (!arg || !isdigit(*arg))
+                return false;
+            char* end;
+            rule.low=strtoul(arg,&end,10);
+            rule.high=rule.low;
+            if (*end=='-' && rule.match==RULE_MATCH_ADDRESS)
+                rule.high=strtoul(end+1,&end,10);
+            if (end!=arg+argLength || rule.high<rule.low)
+                return false;
+            break;
+            }
+        case RULE_MATCH_KEY:
+            if (argLength==0 || argLength>=RULE_KEY_SIZE
+                    || memchr(arg,'"',argLength) || memchr(arg,'\\',argLength))
+                return false;
+            memcpy(rule.key,arg,argLength);
+            rule.keyLength=argLength;
+            break;
+        default:
+            return false;
+        }
+
+    arg=strchr(action,':');
+    nameLength=arg?arg-action:strcspn(action," \r\n");
+    if (arg)
+        {
+        arg++;
+        argLength=strcspn(arg," \r\n");
+        if (argLength==0 || argLength>=RULE_TEXT_SIZE || arg[strspn(arg+argLength," \r\n")+argLength]!='\0')
+            return false;
+        }
+    else if (action[nameLength+strspn(action+nameLength," \r\n")]!='\0')
+        return false;
+
+    rule.action=RULE_ACTION_COUNT;
+    for (uint8_t a=0; a<RULE_ACTION_COUNT; a++)
+        if (strlen(actionNames[a])==nameLength && strncmp(action,actionNames[a],nameLength)==0)
+            rule.action=a;
+    switch (rule.action)
+        {
+        case RULE_DROP:
+            return !arg;
+        case RULE_LIMIT:
+            {
+            if (!arg || !isdigit(*arg))
+                return false;
+            char* end;
+            unsigned long seconds=strtoul(arg,&end,10);
+            rule.seconds=seconds;
+            return end==arg+argLength && seconds>0 && seconds<=UINT16_MAX
+                && rule.match!=RULE_MATCH_KEY; //limits are per node, not per field
+            }
+        case RULE_RENAME:
+            if (rule.match!=RULE_MATCH_KEY)
+                return false;
+            [[fallthrough]];
+        case RULE_ROUTE:
+            if (!arg || memchr(arg,'"',argLength) || memchr(arg,'\\',argLength))
+                return false;
+            memcpy(rule.text,arg,argLength);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+// Print a rule the way it was written
+size_t FrameRules::printRule(Print& out, uint8_t index)
+    {
+    const frameRule& rule=_table->rules[index];
+    size_t n=out.print(matchNames[rule.match]);
+    if (rule.match==RULE_MATCH_ADDRESS || rule.match==RULE_MATCH_NETWORK)
+        {
+        n+=out.print(":");
+        n+=out.print(rule.low);
+        if (rule.high!=rule.low)
+            {
+            n+=out.print("-");
+            n+=out.print(rule.high);
+            }
+        }
+    else if (rule.match==RULE_MATCH_KEY)
+        {
+        n+=out.print(":");
+        n+=out.write(rule.key,rule.keyLength);
+        }
+    n+=out.print(" ");
+    n+=out.print(actionNames[rule.action]);
+    if (rule.action==RULE_LIMIT)
+        {
+        n+=out.print(":");
+        n+=out.print(rule.seconds);
+        }
+    else if (rule.action!=RULE_DROP)
+        {
+        n+=out.print(":");
+        n+=out.print(rule.text);
+        }
+    return n;
+    }
+
+size_t FrameRules::printJson(Print& out)
+    {
+    size_t n=out.print("{\"rules\":[");
+    for (uint8_t i=0; i<_table->count; i++)
+        {
+        if (i>0)
+            n+=out.print(",");
+        n+=out.print("\"");
+        n+=printRule(out,i);
+        n+=out.print("\"");
+        }
+    n+=out.print("],\"dropped\":");
+    n+=out.print(dropped);
+    n+=out.print(",\"limited\":");
+    n+=out.print(limited);
+    n+=out.print("}");
+    return n;
+    }
+
+size_t FrameRules::measureJson()
+    {
+    ByteCounter counter;
+    printJson(counter);
+    return counter.count;
+    }
+
+// The first rule for whole frames that this one matches, or nullptr
+const frameRule* FrameRules::match(uint16_t address, uint8_t networkID)
+    {
+    if (!_hasFrameRules)
+        return nullptr;
+    for (uint8_t i=0; i<_table->count; i++)
+        {
+        const frameRule& rule=_table->rules[i];
+        if (rule.match==RULE_MATCH_ANY
+                || (rule.match==RULE_MATCH_ADDRESS && address>=rule.low && address<=rule.high)
+                || (rule.match==RULE_MATCH_NETWORK && networkID==rule.low))
+            return &rule;
+        }
+    return nullptr;
+    }
+
+// Whether a frame that matched this rule should be published. Counts the
+// ones that aren't.
+bool FrameRules::admit(const frameRule* rule, uint16_t address)
+    {
+    if (!rule)
+        return true;
+    if (rule->action==RULE_DROP)
+        {
+        dropped++;
+        return false;
+        }
+    if (rule->action!=RULE_LIMIT)
+        return true;
+
+    uint32_t now=millis();
+    uint8_t slot=0;
+    for (uint8_t i=0; i<_limitCount; i++)
+        {
+        if (_limits[i].address==address)
+            {
+            if (now-_limits[i].passedAt<rule->seconds*1000UL)
+                {
+                limited++;
+                return false;
+                }
+            _limits[i].passedAt=now;
+            return true;
+            }
+        if (now-_limits[i].passedAt>now-_limits[slot].passedAt)
+            slot=i; //the one let through longest ago, if there's no room
+        }
+    if (_limitCount<RULE_LIMIT_NODES)
+        slot=_limitCount++;
+    _limits[slot].address=address;
+    _limits[slot].passedAt=now;
+    return true;
+    }
+
+// The first rule for a field with this name, or nullptr
+const frameRule* FrameRules::keyRule(const char* key, size_t keyLength)
+    {
+    if (!_hasKeyRules)
+        return nullptr;
+    for (uint8_t i=0; i<_table->count; i++)
+        {
+        const frameRule& rule=_table->rules[i];
+        if (rule.match==RULE_MATCH_KEY && rule.keyLength==keyLength
+                && strncasecmp(rule.key,key,keyLength)==0)
+            return &rule;
+        }
+    return nullptr;
+    }
@@ -0,0 +1,219 @@
+/* Store and forward for received LoRa frames.
+ *
+ * Each record is a storedFrame header followed by the payload bytes. Records
+ * go into a RAM ring buffer first. When that is full, and spilling is enabled,
+ * they get appended to a log file in LittleFS instead. Once anything is in the
+ * flash log, new records go there too so that they come back out in the order
+ * they arrived. The log is deleted when it has been completely read back.
+ *
+ * Records in the flash log survive a reboot; records in RAM do not.
+ */
+
+#include <LittleFS.h>
+#include "FrameStore.h"
+
+void FrameStore::begin(bool spillToFlash, Print& log)
+    {
+    _log=&log;
+    _spill=spillToFlash;
+    if (!_spill || _mounted) //already picked up anything left in flash
+        return;
+
+    if (!LittleFS.begin())
+        {
+        _log->println("FRAMESTORE:Unable to mount LittleFS, not spilling to flash");
+        _spill=false;
+        return;
+        }
+    _mounted=true;
+    if (LittleFS.exists(FRAME_STORE_OLD_FILE))
+        {
+        _log->println("FRAMESTORE:Discarding frames stored by older firmware");
+        LittleFS.remove(FRAME_STORE_OLD_FILE);
+        }
+
+    // pick up anything left over from before a reboot
+    File file=LittleFS.open(FRAME_STORE_FILE,"r+");
+    if (file)
+        {
+        storedFrame header;
+        while (file.read((uint8_t*)&header,sizeof(header))==sizeof(header)
+                && header.length<=RYLR998_MAX_PAYLOAD //no frame is longer, so the rest is garbage
+                && _flashSize+sizeof(header)+header.length<=file.size()
+                && file.seek(header.length,SeekCur))
+            {
+            _flashSize+=sizeof(header)+header.length;
+            _flashCount++;
+            }
+        if (file.size()>_flashSize)
+            file.truncate(_flashSize); //lost power in the middle of a write, or damaged
+        file.close();
+        if (_flashCount==0)
+            LittleFS.remove(FRAME_STORE_FILE);
+        }
+    }
+
+// Add a frame to the newest end of the store. Returns false if there was no
+// room for it, in which case the frame is counted as dropped.
+bool FrameStore::push(const rcvFrame& frame)
+    {
+    storedFrame header;
+    header.receivedAt=millis();
+    header.address=frame.address;
+    header.rssi=frame.rssi;
+    header.snr=frame.snr;
+    header.length=frame.payloadLength;
+    header.channel=frame.channel;
+    uint16_t size=sizeof(header)+header.length;
+
+    bool ok=false;
+    if (_flashCount==0 && FRAME_STORE_SIZE-_used>=size)
+        {
+        uint16_t tail=(_head+_used)%FRAME_STORE_SIZE;
+        _copyIn(tail,&header,sizeof(header));
+        _copyIn((tail+sizeof(header))%FRAME_STORE_SIZE,frame.payload,header.length);
+        _used+=size;
+        _count++;
+        ok=true;
+        }
+    else if (_spill && _pushFlash(header,frame.payload))
+        {
+        spilled++;
+        ok=true;
+        }
+
+    if (ok)
+        stored++;
+    else
+        dropped++;
+    return ok;
+    }
+
+// Copy the oldest frame out without removing it. payload must have room for
+// RYLR998_MAX_PAYLOAD+1 bytes; it is NUL terminated.
+bool FrameStore::peek(rcvFrame& frame, char* payload, uint32_t* receivedAt)
+    {
+    storedFrame header;
+    if (_count>0)
+        {
+        _copyOut(_head,&header,sizeof(header));
+        _copyOut((_head+sizeof(header))%FRAME_STORE_SIZE,payload,header.length);
+        }
+    else if (_flashCount>0)
+        {
+        File log=LittleFS.open(FRAME_STORE_FILE,"r");
+        bool good=log
+            && log.seek(_flashRead,SeekSet)
+            && log.read((uint8_t*)&header,sizeof(header))==sizeof(header)
+            && header.length<=RYLR998_MAX_PAYLOAD //or it would overrun payload
+            && log.read((uint8_t*)payload,header.length)==header.length;
+        if (log)
+            log.close();
+        if (!good)
+            {
+            _log->println("FRAMESTORE:Flash log is damaged, discarding it");
+            dropped+=_flashCount;
+            LittleFS.remove(FRAME_STORE_FILE);
+            _flashCount=0;
+            _flashRead=0;
+            _flashSize=0;
+            return false;
+            }
+        }
+    else
+        return false;
+
+    payload[header.length]='\0';
+    frame.address=header.address;
+    frame.length=header.length;
+    frame.payload=payload;
+    frame.payloadLength=header.length;
+    frame.rssi=header.rssi;
+    frame.snr=header.snr;
+    frame.channel=header.channel;
+    if (receivedAt)
+        *receivedAt=header.receivedAt;
+    return true;
+    }
+
+// Remove the oldest frame, once it has been forwarded
+void FrameStore::pop()
+    {
+    storedFrame header;
+    if (_count>0)
+        {
+        _copyOut(_head,&header,sizeof(header));
+        uint16_t size=sizeof(header)+header.length;
+        _head=(_head+size)%FRAME_STORE_SIZE;
+        _used-=size;
+        _count--;
+        forwarded++;
+        }
+    else if (_flashCount>0)
+        {
+        File log=LittleFS.open(FRAME_STORE_FILE,"r");
+        if (log && log.seek(_flashRead,SeekSet)
+                && log.read((uint8_t*)&header,sizeof(header))==sizeof(header))
+            _flashRead+=sizeof(header)+header.length;
+        else
+            _flashRead=_flashSize; //can't read it, so throw it all away
+        if (log)
+            log.close();
+        _flashCount--;
+        forwarded++;
+        if (_flashCount==0 || _flashRead>=_flashSize)
+            {
+            LittleFS.remove(FRAME_STORE_FILE);
+            _flashCount=0;
+            _flashRead=0;
+            _flashSize=0;
+            }
+        }
+    }
+
+bool FrameStore::isEmpty()
+    {
+    return _count==0 && _flashCount==0;
+    }
+
+uint16_t FrameStore::count()
+    {
+    return _count+_flashCount;
+    }
+
+bool FrameStore::_pushFlash(const storedFrame& header, const char* payload)
+    {
+    if (_flashSize+sizeof(header)+header.length>FRAME_STORE_FLASH_LIMIT)
+        return false;
+    File log=LittleFS.open(FRAME_STORE_FILE,"a");
+    if (!log)
+        return false;
+    bool ok=log.write((const uint8_t*)&header,sizeof(header))==sizeof(header)
+         && log.write((const uint8_t*)payload,header.length)==header.length;
+    if (ok)
+        {
+        _flashSize+=sizeof(header)+header.length;
+        _flashCount++;
+        }
+    else
+        log.truncate(_flashSize); //don't leave half a record behind
+    log.close();
+    return ok;
+    }
+
+// Copy bytes into the ring buffer, wrapping around the end if need be
+void FrameStore::_copyIn(uint16_t at, const void* data, uint16_t length)
+    {
+    const uint8_t* src=(const uint8_t*)data;
+    uint16_t first=min((uint16_t)(FRAME_STORE_SIZE-at),length);
+    memcpy(_buffer+at,src,first);
+    memcpy(_buffer,src+first,length-first);
+    }
+
+void FrameStore::_copyOut(uint16_t at, void* data, uint16_t length)
+    {
+    uint8_t* dst=(uint8_t*)data;
+    uint16_t first=min((uint16_t)(FRAME_STORE_SIZE-at),length);
+    memcpy(dst,_buffer+at,first);
+    memcpy(dst+first,_buffer,length-first);
+    }
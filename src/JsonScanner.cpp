@@ -0,0 +1,159 @@
+/* A scanner for the flat JSON objects that nodes send, like
+ *   {"DISTANCE":8123,"ISPRSENT":0,"BATTERY":3.41}
+ *
+ * Keys and values are handed back as pointers into the payload, so the caller
+ * can publish them directly. The whole payload is checked before anything is
+ * handed back, so a payload that needs ArduinoJson is found out before any of
+ * it has been published.
+ */
+
+#include "JsonScanner.h"
+
+bool JsonScanner::scan(const char* json, uint8_t length)
+    {
+    _json=json;
+    _length=length;
+    _at=0;
+    _count=0;
+
+    _skipSpace();
+    if (_at>=_length || _json[_at++]!='{')
+        return false;
+    _skipSpace();
+    if (_at<_length && _json[_at]=='}')
+        {
+        _close=_at++;
+        }
+    else
+        {
+        while (true)
+            {
+            if (_count>=JSON_SCANNER_FIELDS)
+                return false;
+            jsonField& field=_fields[_count];
+
+            _skipSpace();
+            if (!_string(field.key, field.keyLength))
+                return false;
+            _skipSpace();
+            if (_at>=_length || _json[_at++]!=':')
+                return false;
+            _skipSpace();
+            if (_at>=_length)
+                return false;
+
+            const char* start=_json+_at;
+            char c=_json[_at];
+            if (c=='"')
+                {
+                if (!_string(field.value, field.valueLength))
+                    return false;
+                field.type=JSON_FIELD_STRING;
+                }
+            else
+                {
+                if (c=='t' && _literal("true"))
+                    field.type=JSON_FIELD_BOOL;
+                else if (c=='f' && _literal("false"))
+                    field.type=JSON_FIELD_BOOL;
+                else if (c=='n' && _literal("null"))
+                    field.type=JSON_FIELD_NULL;
+                else if (!_number(field.type)) //this is where nested objects and arrays end up
+                    return false;
+                field.value=start;
+                field.valueLength=_json+_at-start;
+                }
+            _count++;
+
+            _skipSpace();
+            if (_at>=_length)
+                return false;
+            c=_json[_at++];
+            if (c=='}')
+                {
+                _close=_at-1;
+                break;
+                }
+            if (c!=',')
+                return false;
+            }
+        }
+
+    _skipSpace();
+    return _at==_length; //nothing but white space after the object
+    }
+
+void JsonScanner::_skipSpace()
+    {
+    while (_at<_length && (_json[_at]==' ' || _json[_at]=='\t' || _json[_at]=='\r' || _json[_at]=='\n'))
+        _at++;
+    }
+
+// A quoted string without escapes. text and length are what is between the quotes.
+bool JsonScanner::_string(const char*& text, uint8_t& length)
+    {
+    if (_at>=_length || _json[_at]!='"')
+        return false;
+    uint8_t start=++_at;
+    while (_at<_length && _json[_at]!='"')
+        {
+        if (_json[_at]=='\\' || (uint8_t)_json[_at]<0x20)
+            return false; //ArduinoJson can sort those out
+        _at++;
+        }
+    if (_at>=_length)
+        return false;
+    text=_json+start;
+    length=_at-start;
+    _at++; //closing quote
+    return true;
+    }
+
+bool JsonScanner::_literal(const char* word)
+    {
+    uint8_t length=strlen(word);
+    if (_length-_at<length || strncmp(_json+_at, word, length)!=0)
+        return false;
+    _at+=length;
+    return true;
+    }
+
+// A number as JSON spells it: -12, 3.41, 1e3 and so on
+bool JsonScanner::_number(jsonFieldType& type)
+    {
+    uint8_t digits=0;
+    type=JSON_FIELD_INTEGER;
+    if (_at<_length && _json[_at]=='-')
+        _at++;
+    while (_at<_length && isdigit(_json[_at]))
+        {
+        _at++;
+        digits++;
+        }
+    if (digits==0)
+        return false;
+    if (digits>9)
+        type=JSON_FIELD_NUMBER; //might not fit in a long
+
+    if (_at<_length && _json[_at]=='.')
+        {
+        _at++;
+        if (_at>=_length || !isdigit(_json[_at]))
+            return false;
+        while (_at<_length && isdigit(_json[_at]))
+            _at++;
+        type=JSON_FIELD_NUMBER;
+        }
+    if (_at<_length && (_json[_at]=='e' || _json[_at]=='E'))
+        {
+        _at++;
+        if (_at<_length && (_json[_at]=='+' || _json[_at]=='-'))
+            _at++;
+        if (_at>=_length || !isdigit(_json[_at]))
+            return false;
+        while (_at<_length && isdigit(_json[_at]))
+            _at++;
+        type=JSON_FIELD_NUMBER;
+        }
+    return true;
+    }
@@ -0,0 +1,94 @@
+/* Messages for the display.
+ *
+ * The queue is a ring of MESSAGE_QUEUE_SIZE slots with free running head and
+ * tail counts, so tail-head is how many are waiting and full and empty can't
+ * be mistaken for each other. push() only moves the tail and pop() only
+ * moves the head.
+ *
+ * A frame summary looks like
+ *   Node 123 -87dBm 9dB
+ *   temperature 21.50
+ *   battery 3.71
+ * Lines too long for the display are cut off rather than wrapped, so one
+ * long value can't push the rest off the screen.
+ */
+
+#include "MessageQueue.h"
+#include "NodeTable.h"
+
+bool MessageQueue::push(uint32_t key, const char* text)
+    {
+    for (uint8_t i=_head; i!=_tail; i++)
+        {
+        queuedMessage& waiting=_messages[i&(MESSAGE_QUEUE_SIZE-1)];
+        if (waiting.key==key)
+            {
+            snprintf(waiting.text,sizeof(waiting.text),"%s",text);
+            coalesced++;
+            return true;
+            }
+        }
+    if (isFull())
+        {
+        dropped++;
+        return false;
+        }
+    queuedMessage& message=_messages[_tail&(MESSAGE_QUEUE_SIZE-1)];
+    message.key=key;
+    snprintf(message.text,sizeof(message.text),"%s",text);
+    _tail++; //only once the message is all there
+    return true;
+    }
+
+bool MessageQueue::push(const char* text)
+    {
+    return push(NodeTable::hashPayload(text,strlen(text))&~MESSAGE_KEY_NODE,text);
+    }
+
+// Take the oldest message off the queue. Returns false if there isn't one.
+bool MessageQueue::pop(char* text, size_t size)
+    {
+    if (isEmpty())
+        return false;
+    snprintf(text,size,"%s",_messages[_head&(MESSAGE_QUEUE_SIZE-1)].text);
+    _head++;
+    return true;
+    }
+
+void FrameSummary::begin(uint16_t address, int16_t rssi, int8_t snr)
+    {
+    _address=address;
+    _length=snprintf(_text,sizeof(_text),"Node %u %ddBm %ddB",address,rssi,snr);
+    if (_length>MESSAGE_LINE_WIDTH)
+        _length=MESSAGE_LINE_WIDTH;
+    _text[_length]='\0';
+    _lines=1;
+    _open=true;
+    }
+
+void FrameSummary::add(const char* key, size_t keyLength, const char* reading, size_t length)
+    {
+    if (!_open || _lines>=MESSAGE_LINES)
+        return;
+    size_t room=sizeof(_text)-_length;
+    if (room>MESSAGE_LINE_WIDTH+2) //the newline, a full line and the NUL
+        room=MESSAGE_LINE_WIDTH+2;
+    int added=snprintf(_text+_length,room,"\n%.*s %.*s",(int)keyLength,key,(int)length,reading);
+    if (added<=1)
+        {
+        _text[_length]='\0';
+        return;
+        }
+    _length+=min((size_t)added,room-1);
+    _lines++;
+    }
+
+// Queue the summary, in place of this node's last one if that hasn't been
+// shown yet
+bool FrameSummary::end(MessageQueue& queue)
+    {
+    if (!_open)
+        return false;
+    _open=false;
+    return queue.push(MESSAGE_KEY_NODE|_address,_text);
+    }
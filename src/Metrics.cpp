@@ -0,0 +1,124 @@
+/* Where the time goes while handling frames.
+ *
+ * Time a stage with
+ *   uint32_t start=ESP.getCycleCount();
+ *   ...
+ *   metrics.record(STAGE_PUBLISH,ESP.getCycleCount()-start);
+ * The cycle counter wraps every 53 seconds at 80MHz, which is far longer than
+ * anything timed here.
+ *
+ * The JSON looks like
+ *   {"uptime":3600,"heap":21344,"fragmentation":12,"maxblock":16384,
+ *    "display":{"dropped":0,"coalesced":14},"stages":{"line":{"count":120,"min":41,"max":950,"mean":88,
+ *    "histogram":[80,38,2,0,0,0,0,0]},...}}
+ * with times in microseconds.
+ */
+
+#include "Metrics.h"
+#include "ByteCounter.h"
+
+static const char* const stageNames[STAGE_COUNT]=
+    {
+    "line",
+    "parse",
+    "decode",
+    "publish",
+    "ack",
+    "display",
+    "loop"
+    };
+
+Metrics::Metrics()
+    {
+    reset();
+    }
+
+void Metrics::record(metricStage stage, uint32_t cycles)
+    {
+    stageStats& stats=_stages[stage];
+    stats.count++;
+    stats.total+=cycles;
+    if (cycles<stats.min)
+        stats.min=cycles;
+    if (cycles>stats.max)
+        stats.max=cycles;
+
+    uint32_t us=cycles/ESP.getCpuFreqMHz();
+    uint8_t bucket=0;
+    for (uint32_t limit=64; bucket<METRIC_BUCKETS-1 && us>=limit; limit<<=2)
+        bucket++;
+    stats.buckets[bucket]++;
+    }
+
+void Metrics::reset()
+    {
+    memset(_stages,0,sizeof(_stages));
+    for (int i=0; i<STAGE_COUNT; i++)
+        _stages[i].min=UINT32_MAX;
+    }
+
+// Take the uptime, heap and display queue figures that get printed. The heap
+// changes all the time, so this has to be done once before measureJson() and
+// printJson() or the two won't agree on the length.
+void Metrics::snapshot(MessageQueue& messages)
+    {
+    _displayDropped=messages.dropped;
+    _displayCoalesced=messages.coalesced;
+    _uptime=millis()/1000;
+    _heap=ESP.getFreeHeap();
+    _fragmentation=ESP.getHeapFragmentation();
+    _maxBlock=ESP.getMaxFreeBlockSize();
+    }
+
+size_t Metrics::printJson(Print& out)
+    {
+    uint32_t mhz=ESP.getCpuFreqMHz();
+    size_t n=0;
+    n+=out.print("{\"uptime\":");
+    n+=out.print(_uptime);
+    n+=out.print(",\"heap\":");
+    n+=out.print(_heap);
+    n+=out.print(",\"fragmentation\":");
+    n+=out.print(_fragmentation);
+    n+=out.print(",\"maxblock\":");
+    n+=out.print(_maxBlock);
+    n+=out.print(",\"display\":{\"dropped\":");
+    n+=out.print(_displayDropped);
+    n+=out.print(",\"coalesced\":");
+    n+=out.print(_displayCoalesced);
+    n+=out.print("},\"stages\":{");
+
+    for (int i=0; i<STAGE_COUNT; i++)
+        {
+        stageStats& stats=_stages[i];
+        if (i>0)
+            n+=out.print(",");
+        n+=out.print("\"");
+        n+=out.print(stageNames[i]);
+        n+=out.print("\":{\"count\":");
+        n+=out.print(stats.count);
+        n+=out.print(",\"min\":");
+        n+=out.print(stats.count?stats.min/mhz:0);
+        n+=out.print(",\"max\":");
+        n+=out.print(stats.max/mhz);
+        n+=out.print(",\"mean\":");
+        n+=out.print(stats.count?(uint32_t)(stats.total/stats.count/mhz):0);
+        n+=out.print(",\"histogram\":[");
+        for (int b=0; b<METRIC_BUCKETS; b++)
+            {
+            if (b>0)
+                n+=out.print(",");
+            n+=out.print(stats.buckets[b]);
+            }
+        n+=out.print("]}");
+        }
+    n+=out.print("}}");
+    return n;
+    }
+
+size_t Metrics::measureJson()
+    {
+    ByteCounter counter;
+    printJson(counter);
+    return counter.count;
+    }
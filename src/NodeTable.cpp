@@ -0,0 +1,201 @@
+/* Per transmitter statistics.
+ *
+ * The table is open addressed with linear probing. Entries are never removed,
+ * only replaced when the table is full, so a lookup can stop at the first
+ * unused slot.
+ *
+ * The full JSON form, used for the "nodes" command, looks like
+ *   {"count":2,"nodes":[{"address":3,"age":12,"frames":120,"rssi":-47.3,"snr":9.1,
+ *     "interval":60.2,"gaps":1,"duplicates":0,"airtime":4.9,"utilisation":0.07,
+ *     "battery":3.41},...]}
+ * where age, interval and airtime are in seconds, and utilisation is the
+ * percentage of the time since the node was first heard that it was on the air. The compact form, used for the
+ * periodic summary, maps each address to [frames,rssi,snr,age]:
+ *   {"3":[120,-47,9,12],"7":[88,-101,-4,30]}
+ */
+
+#include "NodeTable.h"
+#include "ByteCounter.h"
+
+// Record a frame from a node, which took airtime microseconds to send, and
+// return its entry. Duplicates and gaps are worked out here; anything from the
+// payload itself (like battery) is up to the caller.
+nodeStats* NodeTable::update(const rcvFrame& frame, uint32_t airtime)
+    {
+    nodeStats* node=_slot(frame.address, true);
+    uint32_t now=millis();
+    uint32_t hash=hashPayload(frame.payload, frame.payloadLength);
+
+    if (node->frames==0)
+        {
+        node->firstSeen=now;
+        node->rssi=frame.rssi;
+        node->snr=frame.snr;
+        }
+    else
+        {
+        uint32_t elapsed=now-node->lastSeen;
+        if (hash==node->payloadHash && elapsed<NODE_DUPLICATE_WINDOW)
+            {
+            node->duplicates++; //a retry, which would drag the average interval down
+            }
+        else
+            {
+            if (node->interval>0 && elapsed>node->interval*NODE_GAP_FACTOR)
+                node->gaps++;
+            node->interval=node->interval==0?elapsed:node->interval+(elapsed-node->interval)*NODE_EMA_WEIGHT;
+            }
+        node->rssi+=(frame.rssi-node->rssi)*NODE_EMA_WEIGHT;
+        node->snr+=(frame.snr-node->snr)*NODE_EMA_WEIGHT;
+        }
+    node->lastSeen=now;
+    node->payloadHash=hash;
+    node->airtime+=(airtime+500)/1000;
+    node->frames++;
+    return node;
+    }
+
+nodeStats* NodeTable::find(uint16_t address)
+    {
+    return _slot(address, false);
+    }
+
+uint16_t NodeTable::count()
+    {
+    return _count;
+    }
+
+uint32_t NodeTable::totalFrames()
+    {
+    uint32_t total=0;
+    for (int i=0; i<NODE_TABLE_SIZE; i++)
+        total+=_nodes[i].frames;
+    return total;
+    }
+
+// now is the millis() that ages are worked out from. It has to be the same
+// for measureJson() and printJson() or the lengths won't agree.
+size_t NodeTable::printJson(Print& out, bool compact, uint32_t now)
+    {
+    size_t n=0;
+    bool first=true;
+    if (compact)
+        n+=out.print("{");
+    else
+        {
+        n+=out.print("{\"count\":");
+        n+=out.print(_count);
+        n+=out.print(",\"nodes\":[");
+        }
+
+    for (int i=0; i<NODE_TABLE_SIZE; i++)
+        {
+        nodeStats& node=_nodes[i];
+        if (!node.used)
+            continue;
+        if (!first)
+            n+=out.print(",");
+        first=false;
+
+        uint32_t age=(now-node.lastSeen)/1000;
+        if (compact)
+            {
+            n+=out.print("\"");
+            n+=out.print(node.address);
+            n+=out.print("\":[");
+            n+=out.print(node.frames);
+            n+=out.print(",");
+            n+=out.print((int)lroundf(node.rssi));
+            n+=out.print(",");
+            n+=out.print((int)lroundf(node.snr));
+            n+=out.print(",");
+            n+=out.print(age);
+            n+=out.print("]");
+            }
+        else
+            {
+            n+=out.print("{\"address\":");
+            n+=out.print(node.address);
+            n+=out.print(",\"age\":");
+            n+=out.print(age);
+            n+=out.print(",\"frames\":");
+            n+=out.print(node.frames);
+            n+=out.print(",\"rssi\":");
+            n+=out.print(node.rssi,1);
+            n+=out.print(",\"snr\":");
+            n+=out.print(node.snr,1);
+            n+=out.print(",\"interval\":");
+            n+=out.print(node.interval/1000,1);
+            n+=out.print(",\"gaps\":");
+            n+=out.print(node.gaps);
+            n+=out.print(",\"duplicates\":");
+            n+=out.print(node.duplicates);
+            n+=out.print(",\"airtime\":");
+            n+=out.print(node.airtime/1000.0,1);
+            n+=out.print(",\"utilisation\":");
+            n+=out.print(now==node.firstSeen?0.0:node.airtime*100.0/(now-node.firstSeen),2);
+            if (node.hasBattery)
+                {
+                n+=out.print(",\"battery\":");
+                n+=out.print(node.battery,2);
+                }
+            n+=out.print("}");
+            }
+        }
+    n+=out.print(compact?"}":"]}");
+    return n;
+    }
+
+size_t NodeTable::measureJson(bool compact, uint32_t now)
+    {
+    ByteCounter counter;
+    printJson(counter, compact, now);
+    return counter.count;
+    }
+
+// FNV-1a, cheap and good enough to tell payloads apart
+uint32_t NodeTable::hashPayload(const char* payload, uint8_t length)
+    {
+    uint32_t hash=2166136261UL;
+    for (uint8_t i=0; i<length; i++)
+        {
+        hash^=(uint8_t)payload[i];
+        hash*=16777619UL;
+        }
+    return hash;
+    }
+
+// Find the entry for an address, optionally making one if it isn't there
+nodeStats* NodeTable::_slot(uint16_t address, bool create)
+    {
+    uint16_t start=(uint16_t)((address*40503UL)>>4)&(NODE_TABLE_SIZE-1);
+    for (uint16_t probe=0; probe<NODE_TABLE_SIZE; probe++)
+        {
+        nodeStats* node=&_nodes[(start+probe)&(NODE_TABLE_SIZE-1)];
+        if (node->used && node->address==address)
+            return node;
+        if (!node->used)
+            {
+            if (!create)
+                return nullptr;
+            memset(node,0,sizeof(nodeStats));
+            node->used=true;
+            node->address=address;
+            _count++;
+            return node;
+            }
+        }
+    if (!create)
+        return nullptr;
+
+    // full, so forget whoever has been quiet the longest
+    uint32_t now=millis();
+    nodeStats* oldest=&_nodes[0];
+    for (int i=1; i<NODE_TABLE_SIZE; i++)
+        if (now-_nodes[i].lastSeen>now-oldest->lastSeen)
+            oldest=&_nodes[i];
+    memset(oldest,0,sizeof(nodeStats));
+    oldest->used=true;
+    oldest->address=address;
+    return oldest;
+    }
@@ -0,0 +1,235 @@
+/* QoS 1 publishing for frames, so a node is only acked once the broker has
+ * really got its data.
+ *
+ * A QoS 1 PUBLISH is the same as a QoS 0 one apart from the QoS bits in the
+ * fixed header and a packet ID after the topic, so beginPublish() writes that
+ * header through PubSubClient::write(), which goes straight to the network,
+ * and the payload follows with write() and endPublish() as usual. Several
+ * frames can be waiting at once. PubSubClient throws PUBACKs away after
+ * reading them, so MqttTap spots them on the way in.
+ *
+ * The session is clean, so the broker forgets unconfirmed packets when the
+ * connection goes, and so do we.
+ */
+
+#include "QosPublisher.h"
+
+bool QosPublisher::beginPublish(PubSubClient& client, const char* topic, size_t length, bool retain)
+    {
+    size_t topicLength=strlen(topic);
+    if (topicLength>QOS_MAX_TOPIC || !client.connected())
+        return false;
+
+    uint8_t buffer[QOS_MAX_TOPIC+9];
+    uint8_t at=0;
+    buffer[at++]=0x32|(retain?1:0); //PUBLISH, QoS 1
+    uint32_t remaining=2+topicLength+2+length;
+    do
+        {
+        uint8_t digit=remaining&0x7F;
+        remaining>>=7;
+        buffer[at++]=remaining>0?digit|0x80:digit;
+        } while (remaining>0);
+    buffer[at++]=topicLength>>8;
+    buffer[at++]=topicLength&0xFF;
+    memcpy(buffer+at,topic,topicLength);
+    at+=topicLength;
+
+    uint16_t id=_nextId++;
+    if (_nextId==0)
+        _nextId=1; //0 isn't a valid packet ID
+    buffer[at++]=id>>8;
+    buffer[at++]=id&0xFF;
+
+    if (client.write(buffer,at)!=at)
+        return false;
+    _lastId=id;
+    return true;
+    }
+
+// Hold the ack for a frame whose last PUBLISH just went out. Returns false
+// if too many are waiting already, or nothing has been published since the
+// last frame was tied to its PUBLISH, in which case the caller should ack it
+// straight away.
+bool QosPublisher::await(uint16_t address, uint8_t channel, uint32_t payloadHash)
+    {
+    if (_count>=QOS_IN_FLIGHT || _lastId==0)
+        return false;
+    qosFrame& frame=_frames[(_head+_count)%QOS_IN_FLIGHT];
+    frame.packetId=_lastId;
+    _lastId=0; //a frame that publishes nothing mustn't wait on this one's PUBACK
+    frame.address=address;
+    frame.channel=channel;
+    frame.payloadHash=payloadHash;
+    frame.sentAt=millis();
+    frame.confirmed=false;
+    frame.failed=false;
+    _count++;
+    return true;
+    }
+
+bool QosPublisher::waitingFor(uint16_t address)
+    {
+    for (uint8_t i=0; i<_count; i++)
+        if (_frames[(_head+i)%QOS_IN_FLIGHT].address==address)
+            return true;
+    return false;
+    }
+
+// Hand back the oldest frame once it is confirmed, failed, or has waited
+// longer than timeout ms. frame.confirmed says which.
+bool QosPublisher::nextResult(qosFrame& frame, uint32_t timeout)
+    {
+    if (_count==0)
+        return false;
+    qosFrame& oldest=_frames[_head];
+    if (!oldest.confirmed && !oldest.failed && millis()-oldest.sentAt<=timeout)
+        return false;
+    frame=oldest;
+    if (frame.confirmed)
+        confirmed++;
+    else
+        timedOut++;
+    _head=(_head+1)%QOS_IN_FLIGHT;
+    _count--;
+    return true;
+    }
+
+// The broker has this packet and, since PUBACKs come in order, everything
+// sent before it
+void QosPublisher::puback(uint16_t packetId)
+    {
+    for (uint8_t i=0; i<_count; i++)
+        {
+        qosFrame& frame=_frames[(_head+i)%QOS_IN_FLIGHT];
+        if ((int16_t)(packetId-frame.packetId)<0)
+            break;
+        frame.confirmed=true;
+        }
+    }
+
+// The connection is gone, so nothing waiting will be confirmed now
+void QosPublisher::fail()
+    {
+    for (uint8_t i=0; i<_count; i++)
+        {
+        qosFrame& frame=_frames[(_head+i)%QOS_IN_FLIGHT];
+        if (!frame.confirmed)
+            frame.failed=true;
+        }
+    }
+
+MqttTap::MqttTap(Client& client, QosPublisher& publisher): _client(client), _publisher(publisher)
+    {
+    }
+
+int MqttTap::connect(IPAddress ip, uint16_t port)
+    {
+    _reset();
+    _publisher.fail();
+    return _client.connect(ip,port);
+    }
+
+int MqttTap::connect(const char* host, uint16_t port)
+    {
+    _reset();
+    _publisher.fail();
+    return _client.connect(host,port);
+    }
+
+size_t MqttTap::write(uint8_t b)
+    {
+    return _client.write(b);
+    }
+
+size_t MqttTap::write(const uint8_t* buf, size_t size)
+    {
+    return _client.write(buf,size);
+    }
+
+int MqttTap::available()
+    {
+    return _client.available();
+    }
+
+int MqttTap::read()
+    {
+    int b=_client.read();
+    if (b>=0)
+        _watch(b);
+    return b;
+    }
+
+int MqttTap::read(uint8_t* buf, size_t size)
+    {
+    int n=_client.read(buf,size);
+    for (int i=0; i<n; i++)
+        _watch(buf[i]);
+    return n;
+    }
+
+int MqttTap::peek()
+    {
+    return _client.peek();
+    }
+
+void MqttTap::flush()
+    {
+    _client.flush();
+    }
+
+void MqttTap::stop()
+    {
+    _publisher.fail();
+    _client.stop();
+    }
+
+uint8_t MqttTap::connected()
+    {
+    return _client.connected();
+    }
+
+MqttTap::operator bool()
+    {
+    return (bool)_client;
+    }
+
+void MqttTap::_reset()
+    {
+    _state=0;
+    _remaining=0;
+    }
+
+// Follow the incoming packets a byte at a time: the type, the remaining
+// length, then the body, of which only a PUBACK's packet ID matters
+void MqttTap::_watch(uint8_t b)
+    {
+    switch (_state)
+        {
+        case 0:
+            _type=b>>4;
+            _remaining=0;
+            _shift=0;
+            _state=1;
+            break;
+        case 1:
+            _remaining|=(uint32_t)(b&0x7F)<<_shift;
+            _shift+=7;
+            if (b&0x80)
+                break;
+            _packetId=0;
+            _idBytes=0;
+            _state=_remaining>0?2:0;
+            break;
+        default:
+            if (_type==MQTT_PUBACK && _idBytes<2)
+                {
+                _packetId=(_packetId<<8)|b;
+                if (++_idBytes==2)
+                    _publisher.puback(_packetId);
+                }
+            if (--_remaining==0)
+                _state=0;
+            break;
+        }
+    }
@@ -93,30 +93,80 @@
 
 #include "RYLR998.h"
 
-RYLR998::RYLR998(int rx, int tx) : _serial(rx, tx), _doc(nullptr) 
+RYLR998::RYLR998(int rx, int tx) : _swSerial(rx, tx), _doc(nullptr) 
     {
+    _serial=&_swSerial;
     _rxPin=rx;
     _txPin=tx;
+    _line[0]='\0';
     }
 
-void RYLR998::begin(long baudRate)
+// Use a hardware UART instead of SoftwareSerial. On the ESP8266 only UART0 can
+// receive, so the caller has to move its own console output somewhere else
+// (UART1, via setLogOutput()) before calling begin().
+RYLR998::RYLR998(HardwareSerial& uart, bool swapPins) : _doc(nullptr)
     {
-    if (_debug)
-        Serial.println("LORA:Setting softwareSerial baud rate to "+String(baudRate));
-    _serial.begin(baudRate, SWSERIAL_8N1, _rxPin, _txPin, false, 120,1200);
-    
-    //clear out any lingering buffer contents
-    _serial.flush();
-    while(_serial.available())
+    _hwSerial=&uart;
+    _serial=&uart;
+    _swapPins=swapPins;
+    _rxPin=-1;
+    _txPin=-1;
+    _line[0]='\0';
+    }
+
+// Start the serial connection and check that the module answers. With
+// attempts set, it gives up after that many tries, waiting a little longer
+// before each one, and returns false.
+bool RYLR998::begin(long baudRate, uint8_t attempts)
+    {
+    _openSerial(baudRate);
+
+    unsigned long timeout=attempts?RYLR998_PROBE_TIMEOUT:RYLR998_COMMAND_TIMEOUT;
+    unsigned long backoff=RYLR998_PROBE_BACKOFF;
+    for (uint8_t tries=0; attempts==0 || tries<attempts; tries++)
       {
-      _serial.read(); 
+      if (testComm(timeout))
+        return true;
+      _log->print(".");
+      if (attempts)
+        {
+        delay(backoff);
+        backoff*=2;
+        }
       }
+    return false;
+    }
 
-    while(!testComm())
+// Start, or restart, the serial connection to the module at this baud rate
+void RYLR998::_openSerial(uint32_t baudRate)
+    {
+    if (_hwSerial)
+        {
+        if (_debug)
+            _log->println("LORA:Setting hardware serial baud rate to "+String(baudRate));
+        _hwSerial->setRxBufferSize(RYLR998_RX_BUFFER_SIZE); //must be done before begin()
+        _hwSerial->begin(baudRate);
+        if (_swapPins)
+            _hwSerial->swap();
+        }
+    else
+        {
+        if (_debug)
+            _log->println("LORA:Setting softwareSerial baud rate to "+String(baudRate));
+        if (_baudRate)
+            _swSerial.end();
+        _swSerial.begin(baudRate, SWSERIAL_8N1, _rxPin, _txPin, false, RYLR998_RX_BUFFER_SIZE,1200);
+        }
+    _baudRate=baudRate;
+    
+    //clear out any lingering buffer contents
+    _serial->flush();
+    while(_serial->available())
       {
-      Serial.print(".");
-      // keep trying until it works
+      _serial->read(); 
       }
+    _lineLength=0;
+    _lineOverflow=false;
     }
 
 void RYLR998::setJsonDocument(StaticJsonDocument<250> &doc)
@@ -124,56 +174,244 @@ void RYLR998::setJsonDocument(StaticJsonDocument<250> &doc)
     _doc = &doc;
     }
 
+// Normally every received frame is loaded into the JSON document. A caller that
+// would rather work from getFrame() can turn that off and use decodeFrame()
+// only when it needs to.
+void RYLR998::setAutoDecode(bool autoDecode)
+    {
+    _autoDecode=autoDecode;
+    }
+
+void RYLR998::setChannel(uint8_t channel)
+    {
+    _channel=channel;
+    }
+
+// Returns true when a +RCV frame has come in, and unless setAutoDecode(false)
+// was called, has been parsed into the JSON document. This
+// never waits for the rest of a line; partial lines stay in the line buffer
+// until a later call completes them. Call it repeatedly to drain queued frames.
+// It also runs the command engine, so queued commands go out from here and
+// their responses are matched up here.
 bool RYLR998::handleIncoming()
     {
     bool ok=false;
-    if (_serial.available())
+    if (_heldCount>0 && _lineLength==0) //a frame arrived while a blocking command was waiting
         {
-        String response = _serial.readStringUntil('\n');
-        
-        if (_debug)
-            Serial.println("LORA:Received from LoRa:"+response);
+        strcpy(_line,_heldLines[_heldHead]);
+        _heldHead=(_heldHead+1)%RYLR998_HELD_LINES;
+        _heldCount--;
+        ok=_handleLine();
+        }
+    while (!ok && _readLine())
+        ok=_handleLine();
+    _serviceCommands();
+    return ok;
+    }
+
+// True if anything from the module is waiting to be handled
+bool RYLR998::available()
+    {
+    return _heldCount>0 || _serial->available()>0;
+    }
+
+// Handle a recorded +RCV line as if it had just come from the module. Returns
+// true if it was a frame, like handleIncoming(). Fails while a line from the
+// module is part way in, since that is assembled in the same buffer.
+bool RYLR998::replayLine(const char* line)
+    {
+    if (_lineLength>0 || strncmp(line,"+RCV=",5)!=0 || strlen(line)>=RYLR998_LINE_SIZE)
+        return false;
+    strcpy(_line,line);
+    _lineCycles=0;
+    return _handleLine();
+    }
+
+// Load a frame into the JSON document: the payload's fields plus the standard
+// address, length, rssi and snr. This is also used to replay stored frames.
+// The payload can be JSON or, if it starts with RYLR998_BINARY_MAGIC, binary.
+bool RYLR998::decodeFrame(const rcvFrame& frame)
+    {
+    if (!_doc)
+        return false;
 
-        if (response.startsWith("+RCV="))
+    if (frame.payloadLength>0 && (uint8_t)frame.payload[0]==RYLR998_BINARY_MAGIC)
+        {
+        if (!_decodeBinary(frame))
+            _log->println(F("LORA:Malformed binary payload"));
+        }
+    else
+        {
+        //payload is const so ArduinoJson copies the strings out of the line buffer
+        DeserializationError error = deserializeJson(*_doc, frame.payload, frame.payloadLength);
+        if (error)
             {
-            int equalSignIndex = response.indexOf('=');
-            String result = response.substring(equalSignIndex + 1);
+            _log->print(F("LORA:deserializeJson() failed. Error is: "));
+            _log->println(error.c_str());
+            }
+        }
+    //These are the standard data that go with all messages
+    (*_doc)["address"]=frame.address;
+    (*_doc)["length"]=frame.length;
+    (*_doc)["rssi"]=frame.rssi;
+    (*_doc)["snr"]=frame.snr;
+    return true;
+    }
 
-            String address, length, jsonData, rssi, snr;
-            _parseRcvString(result, address, length, jsonData, rssi, snr);
+// Names for the binary field IDs, indexed by binaryField. They are spelt the
+// way JSON nodes send them, ISPRSENT and all, so a node publishes under the
+// same topics, and matches the same rules, whichever encoding it uses.
+static const char* const binaryFieldNames[]=
+    {
+    nullptr,
+    "DISTANCE",
+    "ISPRSENT",
+    "BATTERY",
+    "ANALOG",
+    "TEMPERATURE",
+    "HUMIDITY",
+    "PRESSURE",
+    "COUNT",
+    "STATE",
+    "UPTIME"
+    };
+
+// Read a varint. Returns false if it runs off the end or is too big.
+static bool readVarint(const uint8_t* data, uint8_t length, uint8_t& at, uint32_t& value)
+    {
+    value=0;
+    for (uint8_t shift=0; shift<35 && at<length; shift+=7)
+        {
+        uint8_t b=data[at++];
+        value|=(uint32_t)(b&0x7F)<<shift;
+        if ((b&0x80)==0)
+            return true;
+        }
+    return false;
+    }
 
-            if (_debug)
-                {
-                Serial.print("Address: ");
-                Serial.println(address);
-                Serial.print("Length: ");
-                Serial.println(length);
-                Serial.print("Json Data:");
-                Serial.println(jsonData);
-                Serial.print("Rssi: ");
-                Serial.println(rssi);
-                Serial.print("SNR: ");
-                Serial.println(snr);
-                }
+// Decode a binary payload into the JSON document. Whatever was decoded before
+// a problem is found is kept.
+bool RYLR998::_decodeBinary(const rcvFrame& frame)
+    {
+    static const float scales[]={10.0,100.0,1000.0};
+    uint8_t data[RYLR998_MAX_PAYLOAD];
+    uint8_t length=0;
+    _doc->clear();
 
-            if (_doc && jsonData)
+    // undo the escaping, skipping the magic byte
+    for (uint8_t i=1; i<frame.payloadLength; i++)
+        {
+        uint8_t b=frame.payload[i];
+        if (b==RYLR998_BINARY_ESCAPE)
+            {
+            if (++i>=frame.payloadLength)
+                return false;
+            b=frame.payload[i]^0x20;
+            }
+        data[length++]=b;
+        }
+
+    uint8_t at=0;
+    while (at<length)
+        {
+        uint8_t field=data[at]>>3;
+        uint8_t type=data[at]&0x07;
+        at++;
+
+        //not const, so ArduinoJson copies it like it does the keys of a JSON payload
+        char name[12];
+        if (field>0 && field<sizeof(binaryFieldNames)/sizeof(binaryFieldNames[0]))
+            strcpy(name, binaryFieldNames[field]);
+        else
+            snprintf(name, sizeof(name), "f%u", field);
+
+        uint32_t raw=0;
+        if (type<=BINARY_FIXED3 || type==BINARY_STRING)
+            {
+            if (!readVarint(data, length, at, raw))
+                return false;
+            }
+        int32_t zigzag=(int32_t)(raw>>1)^-(int32_t)(raw&1);
+
+        switch (type)
+            {
+            case BINARY_UNSIGNED:
+                (*_doc)[name]=raw;
+                break;
+            case BINARY_SIGNED:
+                (*_doc)[name]=zigzag;
+                break;
+            case BINARY_FIXED1:
+            case BINARY_FIXED2:
+            case BINARY_FIXED3:
+                (*_doc)[name]=zigzag/scales[type-BINARY_FIXED1];
+                break;
+            case BINARY_FALSE:
+            case BINARY_TRUE:
+                (*_doc)[name]=(type==BINARY_TRUE);
+                break;
+            case BINARY_STRING:
                 {
-                DeserializationError error = deserializeJson(*_doc, jsonData);
-                if (error)
-                    {
-                    Serial.print(F("LORA:deserializeJson() failed. Error is: "));
-                    Serial.println(error.c_str());
-                    }
-                //These are the standard data that go with all messages
-                (*_doc)["address"]=atoi(address.c_str());
-                (*_doc)["length"]=atoi(length.c_str());
-                (*_doc)["rssi"]=atoi(rssi.c_str());
-                (*_doc)["snr"]=atoi(snr.c_str());
-                ok=true;
+                if (raw>(uint32_t)(length-at))
+                    return false;
+                char text[RYLR998_MAX_PAYLOAD+1];
+                memcpy(text, data+at, raw);
+                text[raw]='\0';
+                (*_doc)[name]=text; //copied, like the name
+                at+=raw;
+                break;
                 }
             }
         }
-    return ok;
+    return true;
+    }
+
+// Deal with one complete line from the module. +RCV lines are parsed into the
+// JSON document and anything else is taken as the response to the command in
+// flight. Returns true if a frame was received.
+bool RYLR998::_handleLine()
+    {
+    if (_debug)
+        _log->println("LORA:Received from LoRa:"+String(_line));
+
+    if (strncmp(_line,"+RCV=",5)==0)
+        {
+        uint32_t start=ESP.getCycleCount();
+        bool parsed=_parseRcv(_line+5, _frame);
+        _parseCycles=ESP.getCycleCount()-start;
+        if (!parsed)
+            {
+            _log->println("LORA:Malformed +RCV line discarded");
+            return false;
+            }
+        _frame.channel=_channel;
+
+        if (_debug)
+            {
+            _log->print("Address: ");
+            _log->println(_frame.address);
+            _log->print("Length: ");
+            _log->println(_frame.length);
+            _log->print("Json Data:");
+            _log->println(_frame.payload);
+            _log->print("Rssi: ");
+            _log->println(_frame.rssi);
+            _log->print("SNR: ");
+            _log->println(_frame.snr);
+            }
+
+        return _autoDecode?decodeFrame(_frame):true;
+        }
+    else if (_commandInFlight)
+        {
+        _completeCommand(_line);
+        }
+    else if (_debug)
+        {
+        _log->println("LORA:Unsolicited response ignored");
+        }
+    return false;
     }
 
 bool RYLR998::send(uint16_t address, const String &data)
@@ -184,11 +422,21 @@ bool RYLR998::send(uint16_t address, const String &data)
                         data;
     String response = _sendCommand(command);
     if (response != "+OK")
-        Serial.println("LORA:Response from RYLR998: "+response);
+        _log->println("LORA:Response from RYLR998: "+response);
         
     return response == "+OK";
     }
 
+// Queue a transmission without waiting for the module. The callback, if any,
+// is called from handleIncoming() once the module answers or the command times
+// out. Returns false if the command queue is full.
+bool RYLR998::sendAsync(uint16_t address, const char* data, commandCallback callback)
+    {
+    char command[RYLR998_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "AT+SEND=%u,%u,%s", address, (unsigned)strlen(data), data);
+    return queueCommand(command, callback);
+    }
+
 bool RYLR998::setMode(uint8_t mode, uint16_t rxTime, uint16_t lowSpeedTime)
     {
     String command = "AT+MODE=" + String(mode);
@@ -249,12 +497,136 @@ bool RYLR998::setBaudRate(uint32_t baudrate)
     return response == "+OK";
     }
 
+// Move the module and our end of the serial connection to a new baud rate,
+// without restarting anything. If the module doesn't answer at the new rate,
+// both go back to the old one and it returns false.
+bool RYLR998::changeBaudRate(uint32_t baudrate)
+    {
+    uint32_t was=_baudRate;
+    if (baudrate==was)
+        return true;
+    if (!setBaudRate(baudrate))
+        return false;
+    delay(RYLR998_PROBE_BACKOFF); //the +OK was sent at the old rate
+    _openSerial(baudrate);
+    for (uint8_t tries=0; tries<3; tries++)
+        if (testComm(RYLR998_PROBE_TIMEOUT))
+            return true;
+
+    _log->println("LORA:No answer at "+String(baudrate)+" baud, going back to "+String(was));
+    _openSerial(was);
+    if (testComm(RYLR998_PROBE_TIMEOUT))
+        setBaudRate(was); //it hasn't switched yet, so make sure it never does
+    _lastError=-1;
+    return false;
+    }
+
+// Whether the module will take these radio settings together:
+//   SF up to 9 at 125kHz, 10 at 250kHz and 11 at 500kHz. The list above
+//   starts each range at SF7, but also has SF5 and 6 as valid, and gateways
+//   already use them, so those are let through.
+//   a preamble other than 12 only with network ID 18
+//   network ID 3 to 15, or 18
+bool RYLR998::radioIsValid(const loraRadio& radio)
+    {
+    if (radio.bandwidth<7 || radio.bandwidth>9)
+        return false;
+    if (radio.spreadingFactor<5 || radio.spreadingFactor>radio.bandwidth+2)
+        return false;
+    if (radio.codingRate<1 || radio.codingRate>4)
+        return false;
+    if (radio.networkID!=18 && (radio.networkID<3 || radio.networkID>15))
+        return false;
+    if (radio.networkID==18?radio.preamble<4 || radio.preamble>24:radio.preamble!=12)
+        return false;
+    return radio.power>=0 && radio.power<=22;
+    }
+
+// Give the module a complete set of radio settings and read them back. If
+// the module objects to any of them, or doesn't read back what it was given,
+// it is put back the way it was and this returns false, with lastError()
+// from the command that failed.
+bool RYLR998::setRadio(const loraRadio& radio)
+    {
+    if (!radioIsValid(radio))
+        {
+        _lastError=RYLR998_ERROR_INVALID;
+        return false;
+        }
+    loraRadio was;
+    if (!getRadio(was))
+        return false;
+    if (_applyRadio(radio))
+        {
+        loraRadio now;
+        if (getRadio(now) && now.band==radio.band && now.networkID==radio.networkID
+                && now.spreadingFactor==radio.spreadingFactor && now.bandwidth==radio.bandwidth
+                && now.codingRate==radio.codingRate && now.preamble==radio.preamble
+                && now.power==radio.power)
+            return true;
+        _log->println("LORA:Radio settings didn't read back as set");
+        if (_lastError==0)
+            _lastError=RYLR998_ERROR_READBACK;
+        }
+    int error=_lastError;
+    if (!_applyRadio(was))
+        _log->println("LORA:Couldn't put the radio settings back, error "+String(_lastError));
+    _lastError=error;
+    return false;
+    }
+
+// Send radio settings in an order the module will accept. The preamble has
+// to be 12 before the network ID can move off 18, and the network ID has to
+// be 18 before the preamble can be anything else.
+bool RYLR998::_applyRadio(const loraRadio& radio)
+    {
+    bool ok;
+    if (radio.preamble==12)
+        ok=setParameter(radio.spreadingFactor,radio.bandwidth,radio.codingRate,radio.preamble)
+           && setNetworkID(radio.networkID);
+    else
+        ok=setNetworkID(radio.networkID)
+           && setParameter(radio.spreadingFactor,radio.bandwidth,radio.codingRate,radio.preamble);
+    return ok && setBand(radio.band) && setRFPower(radio.power);
+    }
+
+// Read the module's radio settings
+bool RYLR998::getRadio(loraRadio& radio)
+    {
+    memset(&radio,0,sizeof(radio));
+    String band=_sendCommand("AT+BAND?");
+    String networkID=_sendCommand("AT+NETWORKID?");
+    String parameter=_sendCommand("AT+PARAMETER?");
+    String power=_sendCommand("AT+CRFOP?");
+    unsigned sf,bw,cr,preamble;
+    if (!band.startsWith("+BAND=") || !networkID.startsWith("+NETWORKID=") || !power.startsWith("+CRFOP=")
+            || sscanf(parameter.c_str(),"+PARAMETER=%u,%u,%u,%u",&sf,&bw,&cr,&preamble)!=4)
+        {
+        if (_lastError==0)
+            _lastError=RYLR998_ERROR_READBACK;
+        return false;
+        }
+    radio.band=strtoul(band.c_str()+6,NULL,10);
+    radio.networkID=atoi(networkID.c_str()+11);
+    radio.spreadingFactor=sf;
+    radio.bandwidth=bw;
+    radio.codingRate=cr;
+    radio.preamble=preamble;
+    radio.power=atoi(power.c_str()+7);
+    return true;
+    }
+
 bool RYLR998::setdebug(bool debugMode)
     {
     _debug=debugMode;
     return true;
     }
 
+void RYLR998::setLogOutput(Print& log)
+    {
+    _log=&log;
+    }
+
 String RYLR998::getMode()
     {
     String response=_sendCommand("AT+MODE?");
@@ -311,55 +683,317 @@ String RYLR998::getBaudRate()
     return response.substring(equalSignIndex + 1);
     }
 
-bool RYLR998::testComm()
+bool RYLR998::testComm(unsigned long timeout)
     {
     String command = "AT";
-    String response = _sendCommand(command);
+    String response = _sendCommand(command, timeout);
     return response == "+OK";
     }
 
 
-String RYLR998::_sendCommand(const String &command, unsigned long timeout)
+// Add a command to the queue. It is sent as soon as the module has answered
+// everything ahead of it. Returns false if the queue is full.
+bool RYLR998::queueCommand(const char* command, commandCallback callback, unsigned long timeout)
     {
-    if (_debug)
-        Serial.println("LORA:Sending lora command:"+command);
+    if (_commandCount>=RYLR998_COMMAND_QUEUE)
+        {
+        _log->println("LORA:Command queue full, dropping "+String(command));
+        return false;
+        }
+    if (strlen(command)>=RYLR998_COMMAND_SIZE)
+        {
+        _log->println("LORA:Command too long, dropping it");
+        return false;
+        }
+    loraCommand& cmd=_commands[(_commandHead+_commandCount)%RYLR998_COMMAND_QUEUE];
+    strcpy(cmd.text, command);
+    cmd.callback=callback;
+    cmd.timeout=timeout;
+    cmd.sync=false;
+    _commandCount++;
+    _serviceCommands();
+    return true;
+    }
 
-    yield();
-    _serial.println(command);
-    unsigned long start = millis();
-    String response = "";
-    while (millis() - start < timeout)
-      {
-      if (_serial.available())
+bool RYLR998::commandPending()
+    {
+    return _commandCount>0;
+    }
+
+// The +ERR code from the most recently completed command, or 0 if it worked
+int RYLR998::lastError()
+    {
+    return _lastError;
+    }
+
+// Time out the command in flight if the module never answered, and send the
+// next queued command if the module is free.
+void RYLR998::_serviceCommands()
+    {
+    if (_commandInFlight && millis()-_commandStart>=_commands[_commandHead].timeout)
+        {
+        _log->println("LORA:Timed out waiting for response to "+String(_commands[_commandHead].text));
+        _completeCommand("");
+        }
+    if (!_commandInFlight && _commandCount>0)
         {
-        response = _serial.readStringUntil('\n');
-        response.trim();
         if (_debug)
-            Serial.println("LORA:"+response);
-        break;
+            _log->println("LORA:Sending lora command:"+String(_commands[_commandHead].text));
+        _serial->print(_commands[_commandHead].text);
+        _serial->print("\r\n");
+        _commandStart=millis();
+        _commandInFlight=true;
         }
-      yield();
-      }
+    }
+
+// Finish off the command in flight with the response (empty on timeout).
+// +OK, +READY and query answers like +BAND=915000000 count as success.
+void RYLR998::_completeCommand(const char* response)
+    {
+    loraCommand& cmd=_commands[_commandHead];
+    bool ok=false;
+    _lastError=0;
+    if (strncmp(response,"+ERR=",5)==0)
+        _lastError=atoi(response+5);
+    else if (strcmp(response,"+OK")==0 || strcmp(response,"+READY")==0)
+        ok=true;
+    else if (response[0]=='+' && strchr(response,'='))
+        ok=true;
+    else if (response[0]=='\0')
+        _lastError=-1; //timed out
+
+    if (_debug)
+        _log->println("LORA:"+String(response));
+
+    if (cmd.sync)
+        {
+        strncpy(_syncResponse, response, RYLR998_RESPONSE_SIZE-1);
+        _syncResponse[RYLR998_RESPONSE_SIZE-1]='\0';
+        _syncDone=true;
+        }
+    commandCallback callback=cmd.callback; //the slot may be reused by the callback
+    _commandInFlight=false;
+    _commandHead=(_commandHead+1)%RYLR998_COMMAND_QUEUE;
+    _commandCount--;
+    if (callback)
+        callback(ok, response);
+    }
+
+// Send a command and wait for its response. This goes through the same queue
+// as everything else so responses can't get crossed. Received frames that show
+// up while waiting are held, up to RYLR998_HELD_LINES of them, for the next
+// handleIncoming() calls, and any more are counted in heldDropped.
+String RYLR998::_sendCommand(const String &command, unsigned long timeout)
+    {
+    yield();
+    while (_commandCount>=RYLR998_COMMAND_QUEUE) //make room
+        _pumpCommands();
+    if (!queueCommand(command.c_str(), nullptr, timeout))
+        return "";
+    _commands[(_commandHead+_commandCount-1)%RYLR998_COMMAND_QUEUE].sync=true;
+    _syncDone=false;
+    while (!_syncDone)
+        _pumpCommands();
+    String response=_syncResponse;
+    response.trim();
     return response;
     }
 
-void RYLR998::_parseRcvString(const String& input, String& address, String& length, String& jsonData, String& rssi, String& snr) 
+// One step of waiting for the module while blocked in _sendCommand()
+void RYLR998::_pumpCommands()
     {
-    int start = 0;
-    int end = input.indexOf(',', start);
-    address = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.indexOf(',', start);
-    length = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.lastIndexOf(',', input.lastIndexOf(',') - 1);
-    jsonData = input.substring(start, end);
-    
-    start = end + 1;
-    end = input.lastIndexOf(',');
-    rssi = input.substring(start, end);
-    
-    snr = input.substring(end + 1);
-    }
\ No newline at end of file
+    if (_readLine())
+        {
+        if (strncmp(_line,"+RCV=",5)!=0)
+            _handleLine();
+        else if (_heldCount<RYLR998_HELD_LINES)
+            {
+            strcpy(_heldLines[(_heldHead+_heldCount)%RYLR998_HELD_LINES],_line);
+            _heldCount++;
+            }
+        else
+            {
+            heldDropped++;
+            _log->println("LORA:Frame dropped while waiting for a command response");
+            }
+        }
+    _serviceCommands();
+    yield();
+    }
+
+// Move whatever bytes are waiting into the line buffer. Returns true when a
+// complete line (without the CR/LF) is in _line. Never blocks. A line too
+// long for the buffer is thrown away rather than handed back truncated.
+bool RYLR998::_readLine()
+    {
+    uint32_t start=ESP.getCycleCount();
+    while (_serial->available())
+        {
+        char c=(char)_serial->read();
+        if (c=='\n')
+            {
+            bool complete=!_lineOverflow;
+            if (_lineLength>0 && _line[_lineLength-1]=='\r')
+                _lineLength--;
+            _line[_lineLength]='\0';
+            _lineLength=0;
+            _lineOverflow=false;
+            _lineCycles=_lineCyclesSoFar+ESP.getCycleCount()-start;
+            _lineCyclesSoFar=0;
+            start=ESP.getCycleCount();
+            if (complete)
+                return true;
+            if (_debug)
+                _log->println("LORA:Discarded overlong line");
+            }
+        else if (_lineLength<RYLR998_LINE_SIZE-1)
+            {
+            _line[_lineLength++]=c;
+            }
+        else
+            {
+            _lineOverflow=true;
+            }
+        }
+    if (_lineLength>0)
+        _lineCyclesSoFar+=ESP.getCycleCount()-start;
+    return false;
+    }
+
+// Parse a decimal number, which may be negative. Returns a pointer to the first character
+// after the digits, or nullptr if there were no digits.
+static char* parseNumber(char* p, long& value)
+    {
+    bool negative=false;
+    if (*p=='-')
+        {
+        negative=true;
+        p++;
+        }
+    if (*p<'0' || *p>'9')
+        return nullptr;
+    value=0;
+    while (*p>='0' && *p<='9')
+        value=value*10+(*p++ - '0');
+    if (negative)
+        value=-value;
+    return p;
+    }
+
+// Parse the part of a +RCV line after the "=" in place, with no allocation:
+//   <Address>,<Length>,<Data>,<RSSI>,<SNR>
+// The length field is used to find the end of the data, so commas inside the
+// payload are fine. The payload is NUL terminated in the line buffer, so the
+// frame is only good until the next line is read.
+bool RYLR998::_parseRcv(char* input, rcvFrame& frame)
+    {
+    long value;
+    char* p=parseNumber(input, value);
+    if (!p || *p!=',' || value<0 || value>65535)
+        return false;
+    frame.address=value;
+
+    p=parseNumber(p+1, value);
+    if (!p || *p!=',' || value<0 || value>RYLR998_MAX_PAYLOAD)
+        return false;
+    frame.length=value;
+
+    char* payload=p+1;
+    if (strnlen(payload, frame.length+1)<=frame.length || payload[frame.length]!=',')
+        return false;
+    payload[frame.length]='\0';
+    frame.payload=payload;
+    frame.payloadLength=frame.length;
+
+    p=parseNumber(payload+frame.length+1, value);
+    if (!p || *p!=',')
+        return false;
+    frame.rssi=value;
+
+    p=parseNumber(p+1, value);
+    if (!p)
+        return false;
+    frame.snr=value;
+    return true;
+    }
+
+BinaryPayload::BinaryPayload()
+    {
+    _data[_length++]=(char)RYLR998_BINARY_MAGIC;
+    _data[_length]='\0';
+    }
+
+bool BinaryPayload::addUnsigned(binaryField field, uint32_t value)
+    {
+    return _putHeader(field, BINARY_UNSIGNED) && _putVarint(value);
+    }
+
+bool BinaryPayload::addSigned(binaryField field, int32_t value)
+    {
+    return _putHeader(field, BINARY_SIGNED) && _putVarint(((uint32_t)value<<1)^(uint32_t)(value>>31));
+    }
+
+// decimals is 1, 2 or 3
+bool BinaryPayload::addFixed(binaryField field, float value, uint8_t decimals)
+    {
+    decimals=constrain(decimals, 1, 3);
+    int32_t scaled=lroundf(value*(decimals==1?10:decimals==2?100:1000));
+    return _putHeader(field, (binaryType)(BINARY_FIXED1+decimals-1))
+        && _putVarint(((uint32_t)scaled<<1)^(uint32_t)(scaled>>31));
+    }
+
+bool BinaryPayload::addBool(binaryField field, bool value)
+    {
+    return _putHeader(field, value?BINARY_TRUE:BINARY_FALSE);
+    }
+
+bool BinaryPayload::addString(binaryField field, const char* value)
+    {
+    size_t length=strlen(value);
+    if (!_putHeader(field, BINARY_STRING) || !_putVarint(length))
+        return false;
+    for (size_t i=0; i<length; i++)
+        if (!_put(value[i]))
+            return false;
+    return true;
+    }
+
+// Start a field. If any byte of it doesn't fit, _put() takes the payload
+// back to where the field started.
+bool BinaryPayload::_putHeader(binaryField field, binaryType type)
+    {
+    _start=_length;
+    return _put((field<<3)|type);
+    }
+
+bool BinaryPayload::_putVarint(uint32_t value)
+    {
+    do
+        {
+        uint8_t b=value&0x7F;
+        value>>=7;
+        if (!_put(value?b|0x80:b))
+            return false;
+        } while (value);
+    return true;
+    }
+
+// Add one byte, escaped if need be. Rolls back the whole field on failure.
+bool BinaryPayload::_put(uint8_t b)
+    {
+    bool escape=b==0 || b=='\r' || b=='\n' || b==RYLR998_BINARY_ESCAPE;
+    if (_length+(escape?2:1)>RYLR998_MAX_PAYLOAD)
+        {
+        _length=_start;
+        _data[_length]='\0';
+        return false;
+        }
+    if (escape)
+        {
+        _data[_length++]=(char)RYLR998_BINARY_ESCAPE;
+        b^=0x20;
+        }
+    _data[_length++]=(char)b;
+    _data[_length]='\0';
+    return true;
+    }
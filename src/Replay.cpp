@@ -0,0 +1,201 @@
+/* Replaying recorded frames through the receive pipeline.
+ *
+ * REPLAY_FILE holds +RCV lines exactly as the module sends them, like
+ *   +RCV=12,36,{"DISTANCE":8123,"ISPRSENT":0},-41,11
+ * Each line is handed over when it is due at the requested rate, and the
+ * caller reports back how long the frame took with frameDone(). At the end of
+ * the file the results are logged and compared with the last run over the
+ * same number of frames, and anything noticeably worse is flagged.
+ *
+ * The ESP8266 core doesn't count allocations, so memory is reported as the
+ * free heap lost per frame and the lowest free heap seen.
+ */
+
+#include "Replay.h"
+
+void Replay::setLogOutput(Print& log)
+    {
+    _log=&log;
+    }
+
+bool Replay::start(uint16_t rate)
+    {
+    stop();
+    if (!LittleFS.begin())
+        {
+        _log->println("REPLAY:Unable to mount LittleFS");
+        return false;
+        }
+    _file=LittleFS.open(REPLAY_FILE,"r");
+    if (!_file)
+        {
+        _log->println("REPLAY:Nothing recorded in " REPLAY_FILE);
+        return false;
+        }
+    _rate=rate;
+    _lines=0;
+    _totalCycles=0;
+    _worstCycles=0;
+    _heapLost=0;
+    _result={};
+    _result.lowestHeap=ESP.getFreeHeap();
+    _startMicros=micros();
+    _running=true;
+    return true;
+    }
+
+void Replay::stop()
+    {
+    if (_running)
+        _file.close();
+    _running=false;
+    }
+
+// The next recorded line if it's time for it, otherwise nullptr
+const char* Replay::nextLine()
+    {
+    if (!_running)
+        return nullptr;
+    if (_rate>0 && micros()-_startMicros<(uint64_t)_lines*1000000/_rate)
+        return nullptr;
+
+    while (_file.available())
+        {
+        size_t length=_file.readBytesUntil('\n',_line,sizeof(_line)-1);
+        if (length>0 && _line[length-1]=='\r')
+            length--;
+        _line[length]='\0';
+        if (length>0)
+            {
+            _lines++;
+            return _line;
+            }
+        }
+    _finish();
+    return nullptr;
+    }
+
+void Replay::frameDone(uint32_t cycles, uint32_t heapBefore)
+    {
+    uint32_t heap=ESP.getFreeHeap();
+    _result.frames++;
+    _totalCycles+=cycles;
+    if (cycles>_worstCycles)
+        _worstCycles=cycles;
+    _heapLost+=(int32_t)(heapBefore-heap);
+    if (heap<_result.lowestHeap)
+        _result.lowestHeap=heap;
+    }
+
+// Append the next frames that come in to REPLAY_FILE. 0 stops recording.
+bool Replay::record(uint16_t frames)
+    {
+    if (frames>0 && !LittleFS.begin())
+        {
+        _log->println("REPLAY:Unable to mount LittleFS");
+        return false;
+        }
+    _toRecord=frames;
+    return true;
+    }
+
+void Replay::capture(const rcvFrame& frame)
+    {
+    if (_toRecord==0)
+        return;
+    File file=LittleFS.open(REPLAY_FILE,"a");
+    if (!file)
+        {
+        _log->println("REPLAY:Unable to open " REPLAY_FILE);
+        _toRecord=0;
+        return;
+        }
+    file.print("+RCV=");
+    file.print(frame.address);
+    file.print(",");
+    file.print(frame.length);
+    file.print(",");
+    file.write((const uint8_t*)frame.payload,frame.payloadLength);
+    file.print(",");
+    file.print(frame.rssi);
+    file.print(",");
+    file.print(frame.snr);
+    file.print("\n");
+    file.close();
+    if (--_toRecord==0)
+        _log->println("REPLAY:Recording finished");
+    }
+
+void Replay::_finish()
+    {
+    uint32_t elapsed=micros()-_startMicros;
+    uint32_t mhz=ESP.getCpuFreqMHz();
+    stop();
+    _result.rate=elapsed?(uint32_t)((uint64_t)_result.frames*100000000/elapsed):0;
+    _result.meanLatency=_result.frames?(uint32_t)(_totalCycles/_result.frames/mhz):0;
+    _result.worstLatency=_worstCycles/mhz;
+    _result.heapPerFrame=_result.frames?(int32_t)(_heapLost/_result.frames):0;
+
+    _log->print("REPLAY:");
+    _log->print(_result.frames);
+    _log->print(" frames, ");
+    _log->print(_result.skipped);
+    _log->print(" lines skipped, ");
+    _log->print(_result.rate/100);
+    _log->print(".");
+    _log->print(_result.rate/10%10);
+    _log->print(_result.rate%10);
+    _log->println(" frames/s");
+    _log->print("REPLAY:latency mean ");
+    _log->print(_result.meanLatency);
+    _log->print("us worst ");
+    _log->print(_result.worstLatency);
+    _log->print("us, heap lost per frame ");
+    _log->print(_result.heapPerFrame);
+    _log->print(" bytes, lowest free heap ");
+    _log->println(_result.lowestHeap);
+
+    replayResult last;
+    File file=LittleFS.open(REPLAY_RESULT_FILE,"r");
+    if (file && file.read((uint8_t*)&last,sizeof(last))==sizeof(last))
+        _compare(last);
+    file.close();
+    file=LittleFS.open(REPLAY_RESULT_FILE,"w");
+    if (file)
+        {
+        file.write((const uint8_t*)&_result,sizeof(_result));
+        file.close();
+        }
+    }
+
+// Flag anything worse than the last run. Runs over a different capture
+// aren't comparable, so those are left alone.
+void Replay::_compare(const replayResult& last)
+    {
+    if (last.frames!=_result.frames || last.frames==0)
+        return;
+    bool regressed=false;
+    if ((uint64_t)_result.rate*100<(uint64_t)last.rate*REPLAY_RATE_REGRESSION)
+        {
+        _log->print("REPLAY:*** Regression: frame rate was ");
+        _log->print(last.rate/100);
+        _log->println(" frames/s last time");
+        regressed=true;
+        }
+    if ((uint64_t)_result.worstLatency*100>(uint64_t)last.worstLatency*REPLAY_LATENCY_REGRESSION)
+        {
+        _log->print("REPLAY:*** Regression: worst latency was ");
+        _log->print(last.worstLatency);
+        _log->println("us last time");
+        regressed=true;
+        }
+    if (_result.heapPerFrame>last.heapPerFrame && _result.heapPerFrame>0)
+        {
+        _log->print("REPLAY:*** Regression: heap lost per frame was ");
+        _log->print(last.heapPerFrame);
+        _log->println(" bytes last time");
+        regressed=true;
+        }
+    if (!regressed)
+        _log->println("REPLAY:No worse than last time");
+    }
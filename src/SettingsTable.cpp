@@ -0,0 +1,167 @@
+/* Table driven access to the settings struct.
+ *
+ * Each settingField says where a member is and what type it is, so one loop
+ * can list the settings, stream them out as JSON, or set one from the text of
+ * a command. The JSON is written straight to the output in one pass, so the
+ * settings command doesn't need a buffer as big as all of the settings. It
+ * looks like
+ *   "broker":"10.0.0.2","port":1883,...,"spilltoflash":false,"deadband":0.500
+ * without the braces, so the caller can add things that aren't in the table.
+ */
+
+#include "SettingsTable.h"
+#include "ValueFormat.h"
+
+SettingsTable::SettingsTable(const settingField* fields, const uint8_t* order, uint8_t count, void* settings):
+    _fields(fields), _order(order), _count(count), _settings((uint8_t*)settings)
+    {
+    }
+
+const settingField* SettingsTable::find(const char* name)
+    {
+    return findByName(_fields,_order,_count,name);
+    }
+
+// Whether a value from a command is one this field can be set to: a number
+// in range for a number, or something short enough for a string. An empty
+// value means 0 or nothing.
+bool SettingsTable::check(const settingField& field, const char* val)
+    {
+    if (field.type==SETTING_STRING)
+        return strlen(val)<field.size;
+    char* end;
+    double value=field.type==SETTING_FLOAT?strtod(val,&end):strtol(val,&end,10);
+    if (*end!='\0')
+        return false;
+    return value>=field.min && value<=field.max;
+    }
+
+// Set a field from command text that check() has passed. An empty value
+// sets a number to 0 and a string to nothing.
+bool SettingsTable::set(const settingField& field, const char* val)
+    {
+    uint8_t* p=_settings+field.offset;
+    switch (field.type)
+        {
+        case SETTING_STRING:
+            {
+            size_t length=strnlen(val,field.size-1);
+            memcpy(p,val,length);
+            p[length]='\0';
+            return true;
+            }
+        case SETTING_BOOL:
+            *(bool*)p=atoi(val)==1;
+            return true;
+        case SETTING_FLAG:
+            *p=atoi(val)==1?1:0;
+            return true;
+        case SETTING_BYTE:
+            *p=atoi(val);
+            return true;
+        case SETTING_UINT16:
+            *(uint16_t*)p=strtoul(val,NULL,10);
+            return true;
+        case SETTING_INT:
+            *(int*)p=atol(val);
+            return true;
+        case SETTING_UINT32:
+            *(uint32_t*)p=strtoul(val,NULL,10);
+            return true;
+        case SETTING_FLOAT:
+            *(float*)p=atof(val);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+size_t SettingsTable::printValue(Print& out, const settingField& field)
+    {
+    const uint8_t* p=_settings+field.offset;
+    switch (field.type)
+        {
+        case SETTING_STRING:
+            return out.write(p,strnlen((const char*)p,field.size));
+        case SETTING_BOOL:
+            return out.print(*(const bool*)p?1:0);
+        case SETTING_FLAG:
+        case SETTING_BYTE:
+            return out.print(*p);
+        case SETTING_UINT16:
+            return out.print(*(const uint16_t*)p);
+        case SETTING_INT:
+            return out.print(*(const int*)p);
+        case SETTING_UINT32:
+            return out.print((unsigned long)*(const uint32_t*)p);
+        case SETTING_FLOAT:
+            {
+            char text[24];
+            size_t length=formatFixed(text,sizeof(text),*(const float*)p,3);
+            return out.write((const uint8_t*)text,length);
+            }
+        default:
+            return 0;
+        }
+    }
+
+// Print a value as JSON: strings quoted and escaped, flags as true or false
+size_t SettingsTable::printJsonValue(Print& out, const settingField& field)
+    {
+    const uint8_t* p=_settings+field.offset;
+    if (field.type==SETTING_BOOL || field.type==SETTING_FLAG)
+        return out.print(*p?"true":"false");
+    if (field.type!=SETTING_STRING)
+        return printValue(out,field);
+
+    size_t n=out.print("\"");
+    for (size_t i=0; i<field.size && p[i]; i++)
+        {
+        char c=p[i];
+        if (c=='"' || c=='\\')
+            {
+            n+=out.print("\\");
+            n+=out.write(c);
+            }
+        else if ((uint8_t)c<0x20)
+            {
+            char escape[8];
+            snprintf(escape,sizeof(escape),"\\u%04x",c);
+            n+=out.print(escape);
+            }
+        else
+            n+=out.write(c);
+        }
+    n+=out.print("\"");
+    return n;
+    }
+
+size_t SettingsTable::printJsonFields(Print& out)
+    {
+    size_t n=0;
+    for (uint8_t i=0; i<_count; i++)
+        {
+        if (i>0)
+            n+=out.print(",");
+        n+=out.print("\"");
+        n+=out.print(_fields[i].name);
+        n+=out.print("\":");
+        n+=printJsonValue(out,_fields[i]);
+        }
+    return n;
+    }
+
+// List the settings, one per line, like
+//   port=<port number> (1883)
+void SettingsTable::show(Print& out)
+    {
+    for (uint8_t i=0; i<_count; i++)
+        {
+        out.print(_fields[i].name);
+        out.print("=");
+        out.print(_fields[i].help);
+        out.print(" (");
+        printValue(out,_fields[i]);
+        out.println(")");
+        }
+    }
@@ -0,0 +1,96 @@
+/* Value formatting for MQTT payloads.
+ *
+ * sprintf and dtostrf drag in the whole printf machinery, are slow for
+ * doubles, and will happily write past the end of the buffer. These build the
+ * digits backwards in a small local buffer and then copy out only as much as
+ * fits.
+ */
+
+#include "ValueFormat.h"
+
+static const uint32_t powersOfTen[FORMAT_MAX_DECIMALS+1]={1,10,100,1000,10000,100000,1000000};
+
+// Copy text to out, cutting it short if need be
+static size_t copyOut(char* out, size_t size, const char* text, size_t length)
+    {
+    if (size==0)
+        return 0;
+    if (length>size-1)
+        length=size-1;
+    memcpy(out,text,length);
+    out[length]='\0';
+    return length;
+    }
+
+// Write the digits of value backwards, ending just before end. At least
+// minDigits are written, padded with leading zeros. Returns the first digit.
+static char* digits(char* end, unsigned long value, uint8_t minDigits)
+    {
+    char* p=end;
+    do
+        {
+        *--p='0'+value%10;
+        value/=10;
+        } while (value>0 || end-p<minDigits);
+    return p;
+    }
+
+size_t formatInteger(char* out, size_t size, long value)
+    {
+    char text[24];
+    char* end=text+sizeof(text);
+    char* p=digits(end,value<0?0UL-(unsigned long)value:(unsigned long)value,1);
+    if (value<0)
+        *--p='-';
+    return copyOut(out,size,p,end-p);
+    }
+
+size_t formatFixed(char* out, size_t size, double value, uint8_t decimals)
+    {
+    if (isnan(value))
+        return copyOut(out,size,"nan",3);
+    if (isinf(value))
+        return value<0?copyOut(out,size,"-inf",4):copyOut(out,size,"inf",3);
+    if (fabs(value)>4294967040.0) //same limit as Print
+        return copyOut(out,size,"ovf",3);
+    if (decimals>FORMAT_MAX_DECIMALS)
+        decimals=FORMAT_MAX_DECIMALS;
+
+    uint32_t scale=powersOfTen[decimals];
+    uint64_t scaled=(uint64_t)(fabs(value)*scale+0.5); //rounded to the last decimal place
+    char text[24];
+    char* end=text+sizeof(text);
+    char* p=end;
+    if (decimals>0)
+        {
+        p=digits(p,(unsigned long)(scaled%scale),decimals);
+        *--p='.';
+        }
+    p=digits(p,(unsigned long)(scaled/scale),1);
+    if (value<0 && scaled>0) //no "-0.00"
+        *--p='-';
+    return copyOut(out,size,p,end-p);
+    }
+
+size_t formatBool(char* out, size_t size, bool value)
+    {
+    return value?copyOut(out,size,"true",4):copyOut(out,size,"false",5);
+    }
+
+size_t formatString(char* out, size_t size, const char* value)
+    {
+    return copyOut(out,size,value,strnlen(value,size));
+    }
+
+size_t formatValue(char* out, size_t size, JsonVariant value, uint8_t decimals)
+    {
+    if (value.is<const char*>())
+        return formatString(out,size,value.as<const char*>());
+    if (value.is<bool>())
+        return formatBool(out,size,value.as<bool>());
+    if (value.is<long>())
+        return formatInteger(out,size,value.as<long>());
+    if (value.is<double>())
+        return formatFixed(out,size,value.as<double>(),decimals);
+    return copyOut(out,size,"",0);
+    }
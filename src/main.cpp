@@ -5,6 +5,21 @@
  *  port=<port number>   (defaults to 1883)
  *  topicroot=<topic root> (something like buteomont/gate/package/ - must end with / and 
  *  "present", "distance", "analog", or "voltage" will be added)
+ *  publishmode=<0 to publish each field, 1 for one JSON message per frame, 2 for both>
+ *  spilltoflash=<1 to save frames to flash when the broker is down for a long time>
+ *  nodesummary=<seconds between node statistics summaries, 0 for none>
+ *  dupwindow=<seconds to ignore a resent frame, 0 to publish them all>
+ *  decimals=<decimal places for published numbers, 0-6>
+ *  dutycycle=<most airtime for acks, in tenths of a percent of each hour, 0 for no limit>
+ *  metrics=<seconds between timing reports, 0 for none>
+ *  qos=<1 to ack nodes only once the broker confirms their frames, 0 to ack once sent>
+ *  rule=<match action, like "addr:100-199 drop" or "key:battery route:home/batteries/",
+ *  see FrameRules.cpp. NULL removes them all>
+ *  delrule=<number of the rule to remove>
+ *  changeonly=<1 to publish a field topic only when its value has changed, 0 for every frame>
+ *  deadband=<smallest change in a number that gets published, with changeonly=1>
+ *  deadbandpct=<smallest change in a number that gets published, in percent, 0-100>
+ *  heartbeat=<seconds after which an unchanged field is published anyway, 0 for never>
  *  user=<mqtt user>
  *  pass=<mqtt password>
  *  ssid=<wifi ssid>
@@ -16,7 +31,38 @@
  *  loRaBandwidth=<bandwidth code>
  *  loRaCodingRate=<LoRa coding rate>
  *  loRaPreamble=<LoRa preamble
- *  loRaBaudRate=<LoRa baud rate for both RF and serial comms
+ *  loRaBaudRate=<LoRa baud rate for both RF and serial comms, changed without a reboot>
+ *  lowpower=<1 for smart receiving in the module, WiFi modem sleep and an idle loop>
+ *  loRaRxTime=<ms the module listens for in each smart receiving cycle, 30-60000>
+ *  loRaSleepTime=<ms the module sleeps for in each smart receiving cycle, 30-60000>
+ *  The sleep has to be shorter than the preamble, which at SF9, bandwidth 7
+ *  and preamble 12 is 66ms, or the module misses frames. If it isn't, the
+ *  module keeps listening and the rest of low power mode still applies.
+ *  loRa2Band, loRa2NetworkID, loRa2SpreadingFactor, loRa2Bandwidth, loRa2CodingRate,
+ *  loRa2Preamble, loRa2Power, and the same for loRa3, for a gateway built with
+ *  -DLORA_RADIO_COUNT=2 or 3. The other modules share the first one's address.
+ *  radio=<band>,<network ID>,<SF>,<BW>,<CR>,<preamble>,<power>[,<module number>]
+ *  sets all of a module's radio settings at once. They are checked against
+ *  each other before they are sent and read back after, and if the module
+ *  won't take them it is left as it was.
+ *  save  (write changed settings to flash now, otherwise it happens once they
+ *  have been left alone for a few seconds)
+ *  update=<http URL of a firmware .bin>,<its MD5 in hex>  (or update=cancel)
+ *  downloads new firmware while frames keep coming in, checks it, and
+ *  reboots into it once the stored frames have gone to the broker
+ * Several can go on one line separated by ";", like
+ *  loRaSpreadingFactor=9;loRaBandwidth=8
+ * They are all checked first, together, and none of them are carried out
+ * unless they are all right. Only what can't be known beforehand, like a
+ * module not answering or the update server being down, can still stop one.
+ *
+ * The receive pipeline is measured on the build machine with
+ * "pio run -e native -t exec", see test/native/bench.cpp. To measure it on
+ * the gateway itself as well:
+ *  record=<number of incoming frames to add to the replay file>
+ *  replay=<frames per second to play the replay file back at, 0 for flat out>
+ * Replayed frames are published like real ones, so point the gateway at a test
+ * broker first. They aren't acked, stored, or counted in the node statistics.
  * 
  * Once connected to an MQTT broker, configuration can be done similarly via the 
  * <topicroot>/command topic. 
@@ -117,6 +163,10 @@
  * This program will receive a JSON object from the RYLR998 object that looks something like this:
  * {"address":2,"rssi":-23,"snr":3,"data":{"distance":8123,"ispresent":0,"battery":3.41}}
  * and send each field to the MQTT broker over WiFi.
+ *
+ * Nodes can also send a binary payload (see BinaryPayload in RYLR998.h), which
+ * takes a fraction of the airtime. The example frame above is then 8 bytes instead of 45,
+ * and is published exactly as if it had been JSON.
  */
 
 #include <Arduino.h>
@@ -127,15 +177,45 @@
 #include <Adafruit_SSD1306.h>
 #include <Adafruit_GFX.h>
 #include "RYLR998.h"
+#include "FrameStore.h"
+#include "NodeTable.h"
+#include "DuplicateCache.h"
+#include "ValueFormat.h"
+#include "JsonScanner.h"
+#include "Airtime.h"
+#include "Metrics.h"
+#include "Replay.h"
+#include "QosPublisher.h"
+#include "FrameRules.h"
+#include "Deadband.h"
+#include "SettingsTable.h"
+#include "ByteCounter.h"
+#include "MessageQueue.h"
+#include "FirmwareUpdate.h"
+#include "ConsolePort.h"
 #include "lora2mqtt.h"
 
-#define VERSION "25.08.00.0"  //remember to update this after every change! YY.MM.DD.REV
+#define VERSION "26.10.14.29"  //remember to update this after every change! YY.MM.DD.REV
 
 WiFiClient wifiClient;
+#ifdef LORA_HARDWARE_SERIAL
+ConsolePort console(Serial); //UART0 until the LoRa module takes it over, then TX only on GPIO2
+RYLR998 lora(Serial);
+#else
+HardwareSerial& console=Serial;
 RYLR998 lora(LORA_RX_PIN, LORA_TX_PIN);
-PubSubClient mqttClient(wifiClient);
+#endif
+RYLR998* radios[LORA_RADIO_COUNT]={&lora}; //any more are on SoftwareSerial, made in initLoRa()
+QosPublisher qosPublisher; //frames waiting for the broker to confirm them
+uint32_t framePublishes=0; //PUBLISHes started for frames, so a frame can tell if it sent any
+MqttTap mqttTap(wifiClient,qosPublisher); //lets qosPublisher see the PUBACKs
+PubSubClient mqttClient(mqttTap);
+FrameStore frameStore; //frames waiting for the broker to come back
+Metrics metrics; //how long each part of handling a frame takes
+Replay replay; //plays recorded frames back for benchmarking
+boolean replaying=false; //the frame being handled came from the replay file
 StaticJsonDocument<250> doc;
-Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
+Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET, OLED_I2C_CLOCK, OLED_I2C_CLOCK);
 
 String commandString = "";     // a String to hold incoming commands from serial
 bool commandComplete = false;  // goes true when enter is pressed
@@ -166,83 +246,243 @@ typedef struct
   byte loRaPreamble=DEFAULT_LORA_PREAMBLE;
   uint32_t loRaBaudRate=DEFAULT_LORA_BAUD_RATE; //both for RF and serial comms
   int loRaPower=DEFAULT_LORA_POWER; //dbm
+  byte publishMode=PUBLISH_MODE_FIELDS; //one message per field, one JSON message per frame, or both
+  byte spillToFlash=0; //1 to keep frames in LittleFS when the RAM store fills during an outage
+  uint16_t nodeSummaryInterval=DEFAULT_NODE_SUMMARY_INTERVAL; //seconds between node summaries, 0 for none
+  uint16_t duplicateWindow=DEFAULT_DUPLICATE_WINDOW; //seconds a resent frame is acked but not published, 0 for off
+  byte decimals=DEFAULT_DECIMALS; //decimal places for numbers that aren't whole
+  uint16_t dutyCycle=DEFAULT_DUTY_CYCLE; //tenths of a percent of airtime our acks can use, 0 for no limit
+  uint16_t metricsInterval=DEFAULT_METRICS_INTERVAL; //seconds between timing reports, 0 for none
+  byte publishQos=DEFAULT_PUBLISH_QOS; //1 to publish frames at QoS 1 and ack them on PUBACK
+  uint32_t loRaConfigHash=0; //radioConfigHash() of the settings last applied to the module, 0 if unsure
+  byte lowPower=0; //1 for smart receiving in the module and sleeping WiFi between beacons
+  uint16_t loRaRxTime=DEFAULT_LORA_RX_TIME; //ms the module listens for in smart receiving mode
+  uint16_t loRaSleepTime=DEFAULT_LORA_SLEEP_TIME; //ms it sleeps for in between
+  radioSettings extraRadios[LORA_MAX_RADIOS-1]; //the second module on, whether or not this build has them
+  ruleTable rules; //filtering and routing, already parsed
+  byte changeOnly=0; //1 to leave out fields that haven't changed since they were last published
+  float deadband=DEFAULT_DEADBAND; //smallest change in a number worth publishing
+  byte deadbandPercent=DEFAULT_DEADBAND_PERCENT; //the same as a percentage of the last value
+  uint16_t heartbeat=DEFAULT_HEARTBEAT; //seconds an unchanged field can go unpublished, 0 for ever
   } conf;
 conf settings; //all settings in one struct makes it easier to store in EEPROM
 boolean settingsAreValid=false;
 
+// Every setting with a name, in the order they are listed on the console,
+// with the range of values it takes and what to do once it has changed
+#define SETTING(name,type,member,min,max,changed,help) \
+  {name,type,offsetof(conf,member),sizeof(conf::member),min,max,changed,help}
+constexpr settingField settingFields[]=
+  {
+  SETTING("broker",SETTING_STRING,mqttBrokerAddress,0,0,nullptr,"<MQTT broker host name or address>"),
+  SETTING("port",SETTING_INT,mqttBrokerPort,1,65535,nullptr,"<port number>"),
+  SETTING("topicroot",SETTING_STRING,mqttTopicRoot,0,0,setTopicRoot,"<topic root, must end with \"/\">"),
+  SETTING("publishmode",SETTING_BYTE,publishMode,PUBLISH_MODE_FIELDS,PUBLISH_MODE_BOTH,nullptr,"<0=each field, 1=one JSON message, 2=both>"),
+  SETTING("user",SETTING_STRING,mqttUsername,0,0,nullptr,"<mqtt user>"),
+  SETTING("pass",SETTING_STRING,mqttPassword,0,0,nullptr,"<mqtt password>"),
+  SETTING("ssid",SETTING_STRING,ssid,0,0,nullptr,"<wifi ssid>"),
+  SETTING("wifipass",SETTING_STRING,wifiPassword,0,0,nullptr,"<wifi password>"),
+  SETTING("address",SETTING_STRING,address,0,0,nullptr,"<Static IP address if so desired>"),
+  SETTING("netmask",SETTING_STRING,netmask,0,0,nullptr,"<Network mask to be used with static IP>"),
+  SETTING("spilltoflash",SETTING_FLAG,spillToFlash,0,1,setSpillToFlash,"1|0"),
+  SETTING("nodesummary",SETTING_UINT16,nodeSummaryInterval,0,65535,nullptr,"<seconds between node summaries, 0 for none>"),
+  SETTING("dupwindow",SETTING_UINT16,duplicateWindow,0,65535,nullptr,"<seconds to ignore a resent frame, 0 for none>"),
+  SETTING("decimals",SETTING_BYTE,decimals,0,FORMAT_MAX_DECIMALS,nullptr,"<decimal places for published numbers 0-6>"),
+  SETTING("dutycycle",SETTING_UINT16,dutyCycle,0,1000,nullptr,"<most ack airtime in tenths of a percent, 0 for no limit>"),
+  SETTING("changeonly",SETTING_FLAG,changeOnly,0,1,setChangeOnly,"1|0"),
+  SETTING("deadband",SETTING_FLOAT,deadband,0,1000000,setDeadband,"<smallest change in a number to publish>"),
+  SETTING("deadbandpct",SETTING_BYTE,deadbandPercent,0,100,setDeadband,"<smallest change in a number to publish, in percent>"),
+  SETTING("heartbeat",SETTING_UINT16,heartbeat,0,65535,setDeadband,"<seconds before an unchanged field is published anyway, 0 for never>"),
+  SETTING("metrics",SETTING_UINT16,metricsInterval,0,65535,nullptr,"<seconds between timing reports, 0 for none>"),
+  SETTING("qos",SETTING_BYTE,publishQos,0,1,nullptr,"<1 to ack frames once the broker confirms them, 0 once sent>"),
+  SETTING("debug",SETTING_BOOL,debug,0,1,setDebug,"1|0"),
+  SETTING("invertdisplay",SETTING_BOOL,invertdisplay,0,1,setDisplayRotation,"1|0"),
+  SETTING("loRaAddress",SETTING_INT,loRaAddress,0,65535,setLoRaAddress,"<LoRa module's address 0-65535>"),
+  SETTING("loRaBand",SETTING_UINT32,loRaBand,LORA_BAND_MIN,LORA_BAND_MAX,nullptr,"<Freq in Hz>"),
+  SETTING("loRaBandwidth",SETTING_BYTE,loRaBandwidth,7,9,nullptr,"<bandwidth code 7-9>"),
+  SETTING("loRaCodingRate",SETTING_BYTE,loRaCodingRate,1,4,nullptr,"<Coding rate code 1-4>"),
+  SETTING("loRaNetworkID",SETTING_INT,loRaNetworkID,3,18,nullptr,"<Network ID 3-15 or 18>"),
+  SETTING("loRaSpreadingFactor",SETTING_BYTE,loRaSpreadingFactor,5,11,nullptr,"<Spreading Factor 5-9, 10 or 11 with a wider bandwidth>"),
+  SETTING("loRaPreamble",SETTING_BYTE,loRaPreamble,4,24,nullptr,"<12, or 4-24 with network ID 18>"),
+  SETTING("loRaBaudRate",SETTING_UINT32,loRaBaudRate,300,115200,setLoRaBaudRate,"<baud rate>"),
+  SETTING("loRaPower",SETTING_INT,loRaPower,0,22,nullptr,"<RF power in dbm 0-22>"),
+  SETTING("lowpower",SETTING_FLAG,lowPower,0,1,setLowPower,"1|0"),
+  SETTING("loRaRxTime",SETTING_UINT16,loRaRxTime,LORA_SMART_TIME_MIN,LORA_SMART_TIME_MAX,setLoRaMode,"<ms listening in low power mode, 30-60000>"),
+  SETTING("loRaSleepTime",SETTING_UINT16,loRaSleepTime,LORA_SMART_TIME_MIN,LORA_SMART_TIME_MAX,setLoRaMode,"<ms asleep in low power mode, 30-60000>"),
+  };
+#undef SETTING
+constexpr auto settingOrder=sortByName(settingFields);
+static_assert(namesAreUnique(settingFields,settingOrder),"two settings have the same name");
+SettingsTable settingsTable(settingFields,settingOrder.index,sizeof(settingFields)/sizeof(settingFields[0]),&settings);
+
+// Commands that do something rather than set something. Each one gets the
+// text after the "=", or nullptr if there wasn't any. The check says whether
+// it makes sense, and the command returns false if it couldn't do it.
+constexpr commandHandler commandHandlers[]=
+  {
+  {"rule",checkRule,commandRule},
+  {"delrule",checkDeleteRule,commandDeleteRule},
+  {"record",checkCount,commandRecord},
+  {"replay",checkCount,commandReplay},
+  {"save",nullptr,commandSave},
+  {"radio",checkRadio,nullptr}, //sent with the rest of the radio settings
+  {"update",checkUpdate,commandUpdate},
+  {"resetmqttid",checkYes,commandResetMqttId},
+  {"factorydefaults",checkYes,commandFactoryDefaults},
+  };
+constexpr auto commandOrder=sortByName(commandHandlers);
+static_assert(namesAreUnique(commandHandlers,commandOrder),"two commands have the same name");
+boolean settingsDirty=false; //changed since they were last written to flash
+unsigned long settingsChangedAt=0;
+
 IPAddress ip;
 IPAddress mask;
 
-typedef struct
-  {
-  uint16_t distance;
-  bool isPresent;
-  float_t battery;
-  int8_t rssi;
-  int8_t snr;
-  uint8_t address;
-  } box;
-box boxStatus; 
+NodeTable nodeTable; //statistics for every transmitter we hear
+DuplicateCache duplicates; //frames recently published, to spot resends
+FrameRules frameRules; //what gets published and where, kept in settings.rules
+Deadband deadband; //the last value published on each field topic
+
+// The latest frame, kept so the status command can publish it again
+rcvFrame lastFrame={};
+char lastPayload[RYLR998_MAX_PAYLOAD+1];
+
+// A flat JSON payload is published straight from its text. Anything else is
+// loaded into doc instead. frameScanned says which one the current frame got.
+JsonScanner scanner;
+bool frameScanned=false;
+
+// Time on the air: everything heard or sent over the last hour, the same over
+// the last few seconds to tell if the channel is busy, and just our acks
+AirtimeMeter channelAirtime(AIRTIME_WINDOW);
+AirtimeMeter recentAirtime(AIRTIME_RECENT_WINDOW);
+AirtimeMeter ackAirtime(AIRTIME_WINDOW);
+
+// Acks waiting for the channel to quieten down or the duty cycle to allow them
+pendingAck acks[ACK_QUEUE_LENGTH];
+int ackHead=0;
+int ackCount=0;
+uint32_t acksHeld=0;    //acks that had to wait
+uint32_t acksDropped=0; //acks that waited so long the sender would have given up
 
 
 boolean rssiShowing=false; //used to redraw the RSSI indicator after clearing display
-String lastMessage=""; //contains the last message sent to display. Sometimes need to reshow it
-char showbuffer[SHOWBUF_LENGTH][SHOWBUF_WIDTH]; //used to show stuff on the display without slowing down processing
-int showHeadPointer=0; //The first entry in the show buffer
-int showTailPointer=0; //The last entry in the show buffer
+char lastMessage[MESSAGE_SIZE]=""; //contains the last message sent to display. Sometimes need to reshow it
+MessageQueue messages; //used to show stuff on the display without slowing down processing
+FrameSummary frameSummary; //the screen for the frame being published
+FirmwareUpdate firmwareUpdate;
 ulong showListeningStatus=millis()+15000; //how long to show a message before going back to "listening..."
 
+// The wifi indicator is drawn into this little bitmap only when the number of
+// bars changes, and then just copied onto the display.
+GFXcanvas1 wifiIcon(WIFI_ICON_SIZE, WIFI_ICON_SIZE);
+
 void drawWifiStrength(int32_t rssi)
   {
-  int strength = map(rssi, -100, -50, 0, 4);
-  static int xLoc=SCREEN_WIDTH-RSSI_DOT_RADIUS;
-  static int yLoc=SCREEN_HEIGHT-RSSI_DOT_RADIUS;
-  
-  // Draw the dot
-  display.fillCircle(xLoc, yLoc, RSSI_DOT_RADIUS, SSD1306_WHITE);
-  
-  // Draw the arcs
-  for (int i = 0; i < 4; i++) 
+  static int shownStrength=-1; //bars currently drawn in wifiIcon
+  int strength = constrain(map(rssi, -100, -50, 0, 4), 0, 4);
+
+  if (strength!=shownStrength)
     {
-    if (i < strength) 
-      {
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS + (i * 5), SSD1306_WHITE);
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+1 + (i * 5), SSD1306_WHITE);
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+2 + (i * 5), SSD1306_WHITE);
-     }
-    else 
+    //center of the dot, relative to the top left corner of the icon
+    int xLoc=WIFI_ICON_SIZE-RSSI_DOT_RADIUS;
+    int yLoc=WIFI_ICON_SIZE-RSSI_DOT_RADIUS;
+    wifiIcon.fillScreen(SSD1306_BLACK);
+
+    // Draw the dot
+    wifiIcon.fillCircle(xLoc, yLoc, RSSI_DOT_RADIUS, SSD1306_WHITE);
+    
+    // Draw the arcs, thick for the bars we have and thin for the ones we don't
+    for (int i = 0; i < 4; i++) 
       {
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS + (i * 5), SSD1306_WHITE);
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+1 + (i * 5), SSD1306_BLACK);
-      display.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+2 + (i * 5), SSD1306_BLACK);
-      } 
+      wifiIcon.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS + (i * 5), SSD1306_WHITE);
+      if (i < strength) 
+        {
+        wifiIcon.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+1 + (i * 5), SSD1306_WHITE);
+        wifiIcon.drawCircle(xLoc, yLoc, RSSI_DOT_RADIUS+2 + (i * 5), SSD1306_WHITE);
+        }
+      }
+    shownStrength=strength;
     }
+
+  display.drawBitmap(SCREEN_WIDTH-WIFI_ICON_SIZE, SCREEN_HEIGHT-WIFI_ICON_SIZE,
+                     wifiIcon.getBuffer(), WIFI_ICON_SIZE, WIFI_ICON_SIZE, SSD1306_WHITE);
   rssiShowing=true; //keep it up
-//  display.display();
+  }
+
+// A copy of what is on the OLED right now, so flushDisplay() knows what changed
+uint8_t shownBuffer[SCREEN_WIDTH*SCREEN_HEIGHT/8];
+bool shownBufferValid=false;
+
+// Move the display buffer to the OLED. Only the part of each page (8 pixel 
+// high band) that changed since the last flush is sent over I2C, which is 
+// usually a small fraction of the whole 512 bytes.
+void flushDisplay()
+  {
+  uint32_t start=ESP.getCycleCount();
+  uint8_t* buffer=display.getBuffer();
+  for (int page=0; page<SCREEN_HEIGHT/8; page++)
+    {
+    uint8_t* row=buffer+page*SCREEN_WIDTH;
+    uint8_t* shown=shownBuffer+page*SCREEN_WIDTH;
+    int first=0;
+    int last=SCREEN_WIDTH-1;
+    if (shownBufferValid)
+      {
+      while (first<SCREEN_WIDTH && row[first]==shown[first])
+        first++;
+      if (first==SCREEN_WIDTH)
+        continue; //nothing changed in this page
+      while (row[last]==shown[last])
+        last--;
+      }
+
+    display.ssd1306_command(SSD1306_PAGEADDR);
+    display.ssd1306_command(page);
+    display.ssd1306_command(page);
+    display.ssd1306_command(SSD1306_COLUMNADDR);
+    display.ssd1306_command(first);
+    display.ssd1306_command(last);
+
+    for (int col=first; col<=last; )
+      {
+      Wire.beginTransmission(SCREEN_ADDRESS);
+      Wire.write((uint8_t)0x40); //data follows
+      for (int n=0; n<OLED_I2C_CHUNK && col<=last; n++)
+        Wire.write(row[col++]);
+      Wire.endTransmission();
+      }
+    memcpy(shown+first,row+first,last-first+1);
+    }
+  shownBufferValid=true;
+  metrics.record(STAGE_DISPLAY,ESP.getCycleCount()-start);
   }
 
 
 //display something on the screen
-void show(String msg)
+void show(const char* msg)
   {
-  if (msg==lastMessage)
-    return;
-    
-  lastMessage=msg; //in case we need to redraw it
+  if (msg!=lastMessage)
+    {
+    if (strcmp(msg,lastMessage)==0)
+      return;
+    snprintf(lastMessage,sizeof(lastMessage),"%s",msg); //in case we need to redraw it
+    }
+  size_t length=strlen(lastMessage);
 
   if (settings.debug)
     {
-    Serial.print("Length of display message:");
-    Serial.println(msg.length());
+    console.print("Length of display message:");
+    console.println(length);
     }
   display.clearDisplay(); // clear the screen
   display.setCursor(0, 0);  // Top-left corner
 
-  if (msg.length()>20)
+  if (length>20)
     {
     display.setTextSize(1);      // tiny text
     }
-  else if (msg.length()>7 || rssiShowing) //make room for rssi indicator
+  else if (length>7 || rssiShowing) //make room for rssi indicator
     {
     display.setTextSize(2);      // small text
     }
@@ -250,109 +490,495 @@ void show(String msg)
     {
     display.setTextSize(3);      // Normal 1:1 pixel scale
     }
-  display.println(msg);
+  display.println(lastMessage);
   if (rssiShowing)
     {
     drawWifiStrength(WiFi.RSSI());
     }
-display.display(); // move the buffer contents to the OLED
+  flushDisplay(); // move the changed parts of the buffer to the OLED
+  }
+
+
+
+
+
+void showSettings()
+  {
+  settingsTable.show(console);
+  for (uint8_t i=0; i<frameRules.count(); i++)
+    {
+    console.print("rule ");
+    console.print(i+1);
+    console.print(": ");
+    frameRules.printRule(console,i);
+    console.println();
+    }
+  console.print("rule=<match action> (");
+  console.print(frameRules.count());
+  console.print(" of ");
+  console.print(RULES_MAX);
+  console.println(")");
+  console.println("delrule=<rule number>");
+  console.println("radio=<band>,<network ID>,<SF>,<BW>,<CR>,<preamble>,<power>[,<module number>]");
+  console.println("update=<http URL of the firmware>,<its MD5 in hex>");
+
+  for (uint8_t radio=1; radio<LORA_MAX_RADIOS; radio++)
+    {
+    radioSettings config=radioConfig(radio);
+    console.print("loRa");
+    console.print(radio+1);
+    console.print("Band, NetworkID, SpreadingFactor, Bandwidth, CodingRate, Preamble, Power (");
+    console.printf("%u, %u, %u, %u, %u, %u, %d)",config.band,config.networkID,config.spreadingFactor,
+                   config.bandwidth,config.codingRate,config.preamble,config.power);
+    console.println(radio<LORA_RADIO_COUNT?"":" not fitted");
+    }
+
+  uint32_t fullFrame=frameAirtime(RYLR998_MAX_PAYLOAD);
+  console.print("A full size frame takes ");
+  console.print(fullFrame/1000);
+  console.println(" ms on the air");
+  if (fullFrame>AIRTIME_WARNING)
+    console.println("*** Warning: these LoRa parameters are too slow for full size frames ***");
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    warnSmartReceive(radio);
+  console.print("Display messages dropped ");
+  console.print(messages.dropped);
+  console.print(", replaced while waiting ");
+  console.println(messages.coalesced);
+  uint32_t heldDropped=0;
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    if (radios[radio])
+      heldDropped+=radios[radio]->heldDropped;
+  console.print("Frames dropped while the LoRa module was busy with a command ");
+  console.println(heldDropped);
+  console.print("MQTT Client ID is ");
+  console.println(settings.mqttClientId);
+  console.print("Address is ");
+  console.println(wifiClient.localIP());
+  console.println("\n*** Use NULL to reset a setting to its default value ***");
+  console.println("*** Use \"factorydefaults=yes\" to reset all settings  ***");
+  console.println("*** Use \"save\" to write changes to flash right away ***");
+  console.println("*** Use \"record=<frames>\" and \"replay=<frames/s>\" to benchmark ***\n");
+  
+  console.print("\nSettings are ");
+  console.println(settingsAreValid?"valid.":"incomplete.");
   }
 
+// These are called when the setting they are named for has changed
 
-void show(uint16_t val, String suffix)
+void setLoRaAddress()
   {
-  String msg=String(val)+suffix;
-  show(msg);
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++) //they all answer to the same address
+    if (radios[radio])
+      radioConfigured(radios[radio]->setAddress(settings.loRaAddress),radio);
   }
 
+// Move every module to the new baud rate, and our end of each connection
+// with it. If one of them won't go, they all go back to the old rate.
+void setLoRaBaudRate()
+  {
+  uint32_t was=lora.baudRate();
+  uint8_t changed=0;
+  while (changed<LORA_RADIO_COUNT
+         && (!radios[changed] || radios[changed]->changeBaudRate(settings.loRaBaudRate)))
+    changed++;
+  if (changed==LORA_RADIO_COUNT)
+    return;
+
+  console.print("LoRa module ");
+  console.print(changed+1);
+  console.print(" didn't answer at the new baud rate, staying at ");
+  console.println(was);
+  while (changed-->0)
+    if (radios[changed])
+      radios[changed]->changeBaudRate(was);
+  settings.loRaBaudRate=was;
+  saveSettings();
+  }
 
+void setLowPower()
+  {
+  setLoRaMode();
+  setWiFiSleep();
+  }
 
+void setDebug()
+  {
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    if (radios[radio])
+      radios[radio]->setdebug(settings.debug);
+  }
 
-void showSettings()
+void setDisplayRotation()
   {
-  Serial.print("broker=<MQTT broker host name or address> (");
-  Serial.print(settings.mqttBrokerAddress);
-  Serial.println(")");
-  Serial.print("port=<port number>   (");
-  Serial.print(settings.mqttBrokerPort);
-  Serial.println(")");
-  Serial.print("topicroot=<topic root> (");
-  Serial.print(settings.mqttTopicRoot);
-  Serial.println(")  Note: must end with \"/\"");  
-  Serial.print("user=<mqtt user> (");
-  Serial.print(settings.mqttUsername);
-  Serial.println(")");
-  Serial.print("pass=<mqtt password> (");
-  Serial.print(settings.mqttPassword);
-  Serial.println(")");
-  Serial.print("ssid=<wifi ssid> (");
-  Serial.print(settings.ssid);
-  Serial.println(")");
-  Serial.print("wifipass=<wifi password> (");
-  Serial.print(settings.wifiPassword);
-  Serial.println(")");
-  Serial.print("address=<Static IP address if so desired> (");
-  Serial.print(settings.address);
-  Serial.println(")");
-  Serial.print("netmask=<Network mask to be used with static IP> (");
-  Serial.print(settings.netmask);
-  Serial.println(")");
-  Serial.print("debug=1|0 (");
-  Serial.print(settings.debug);
-  Serial.println(")");
-  Serial.print("invertdisplay=1|0 (");
-  Serial.print(settings.invertdisplay);
-  Serial.println(")");
-  Serial.print("loRaAddress=<LoRa module's address 0-65535> (");
-  Serial.print(settings.loRaAddress);
-  Serial.println(")");
-  Serial.print("loRaBand=<Freq in Hz> (");
-  Serial.print(settings.loRaBand);
-  Serial.println(")");
-  Serial.print("loRaBandwidth=<bandwidth code 7-9> (");
-  Serial.print(settings.loRaBandwidth);
-  Serial.println(")");
-  Serial.print("loRaCodingRate=<Coding rate code 1-4> (");
-  Serial.print(settings.loRaCodingRate);
-  Serial.println(")");
-  Serial.print("loRaNetworkID=<Network ID 3-15 or 18> (");
-  Serial.print(settings.loRaNetworkID);
-  Serial.println(")");
-  Serial.print("loRaSpreadingFactor=<Spreading Factor 5-11> (");
-  Serial.print(settings.loRaSpreadingFactor);
-  Serial.println(")");
-  Serial.print("loRaPreamble=<4-24, see docs> (");
-  Serial.print(settings.loRaPreamble);
-  Serial.println(")");
-  Serial.print("loRaBaudRate=<baud rate> (");
-  Serial.print(settings.loRaBaudRate);
-  Serial.println(")");
-  Serial.print("loRaPower=<RF power in dbm> (");
-  Serial.print(settings.loRaPower);
-  Serial.println(")");
-
-  Serial.print("MQTT Client ID is ");
-  Serial.println(settings.mqttClientId);
-  Serial.print("Address is ");
-  Serial.println(wifiClient.localIP());
-  Serial.println("\n*** Use NULL to reset a setting to its default value ***");
-  Serial.println("*** Use \"factorydefaults=yes\" to reset all settings  ***\n");
-  
-  Serial.print("\nSettings are ");
-  Serial.println(settingsAreValid?"valid.":"incomplete.");
+  display.setRotation(settings.invertdisplay?2:0);
   }
 
-// Configure some LoRa parameters. I don't know why these particular ones
-// are set all in one bunch on the RYLR998
-void setLoRaParameters()
+void setSpillToFlash()
   {
-  if (settingsAreValid)
+  frameStore.begin(settings.spillToFlash==1,console);
+  }
+
+void setChangeOnly()
+  {
+  deadband.clear(); //start from what's on the broker now
+  }
+
+// Smart receiving in low power mode, otherwise always listening
+void setLoRaMode()
+  {
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    setLoRaMode(radio);
+  }
+
+void setLoRaMode(uint8_t radio)
+  {
+  if (!radios[radio])
+    return;
+  warnSmartReceive(radio);
+  if (useSmartReceive(radio))
+    radioConfigured(radios[radio]->setMode(LORA_MODE_SMART_RECEIVE,settings.loRaRxTime,settings.loRaSleepTime),radio);
+  else
+    radioConfigured(radios[radio]->setMode(LORA_MODE_TRANSCEIVER),radio);
+  }
+
+// A module in smart receiving only hears a frame if it wakes up while the
+// preamble is still going, so the preamble has to last longer than it
+// sleeps. If it doesn't, frames are lost without a trace, so the module is
+// left always listening instead and the rest of low power mode carries on.
+bool smartReceiveFits(uint8_t radio)
+  {
+  radioSettings config=radioConfig(radio);
+  uint32_t preamble=preambleTime(config.spreadingFactor,config.bandwidth,config.preamble);
+  return (uint32_t)settings.loRaSleepTime*1000<=preamble;
+  }
+
+bool useSmartReceive(uint8_t radio)
+  {
+  return settings.lowPower && smartReceiveFits(radio);
+  }
+
+void warnSmartReceive(uint8_t radio)
+  {
+  if (!settings.lowPower || smartReceiveFits(radio))
+    return;
+  radioSettings config=radioConfig(radio);
+  console.print("*** Warning: LoRa module ");
+  console.print(radio+1);
+  console.print(" would sleep for longer than a frame's ");
+  console.print(preambleTime(config.spreadingFactor,config.bandwidth,config.preamble)/1000);
+  console.println(" ms preamble and miss frames, so it keeps listening.");
+  console.println("    Lower loRaSleepTime, or raise loRaPreamble on the nodes and here ***");
+  }
+
+// In low power mode the WiFi radio sleeps through a few beacons at a time.
+// Traffic for us, like the broker's keepalive replies, waits at the access
+// point until it wakes. Otherwise it's left to the SDK.
+void setWiFiSleep()
+  {
+  if (settings.lowPower)
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP,LOW_POWER_LISTEN_INTERVAL);
+  else
+    WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+  }
+
+void setDeadband()
+  {
+  deadband.configure(settings.deadband,settings.deadbandPercent,settings.heartbeat);
+  }
+
+// In low power mode, rest between passes through loop() until something
+// turns up, rather than spinning. delay() lets the SDK idle the CPU, and bytes
+// from the module wait in the UART buffer, which holds two full frames.
+void lowPowerIdle()
+  {
+  if (!settings.lowPower || ackCount>0 || replay.running() || settingsDirty || firmwareUpdate.running())
+    return;
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    if (radios[radio] && radios[radio]->commandPending())
+      return;
+  unsigned long start=millis();
+  while (millis()-start<LOW_POWER_IDLE_MS && !loRaAvailable()
+         && !console.available() && !wifiClient.available())
+    delay(1);
+  }
+
+// True if any of the modules has sent us something
+bool loRaAvailable()
+  {
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    if (radios[radio] && radios[radio]->available())
+      return true;
+  return false;
+  }
+
+// One module's radio settings. The first module's are kept where they always
+// were in the settings, the others in extraRadios.
+radioSettings radioConfig(uint8_t radio)
+  {
+  if (radio>0 && radio<LORA_MAX_RADIOS)
+    return settings.extraRadios[radio-1];
+  radioSettings config;
+  config.band=settings.loRaBand;
+  config.networkID=settings.loRaNetworkID;
+  config.spreadingFactor=settings.loRaSpreadingFactor;
+  config.bandwidth=settings.loRaBandwidth;
+  config.codingRate=settings.loRaCodingRate;
+  config.preamble=settings.loRaPreamble;
+  config.power=settings.loRaPower;
+  config.configHash=settings.loRaConfigHash;
+  return config;
+  }
+
+void defaultRadioSettings(radioSettings& config)
+  {
+  config.band=DEFAULT_LORA_BAND;
+  config.networkID=DEFAULT_LORA_NETWORK_ID;
+  config.spreadingFactor=DEFAULT_LORA_SPREADING_FACTOR;
+  config.bandwidth=DEFAULT_LORA_BANDWIDTH;
+  config.codingRate=DEFAULT_LORA_CODING_RATE;
+  config.preamble=DEFAULT_LORA_PREAMBLE;
+  config.power=DEFAULT_LORA_POWER;
+  config.configHash=0;
+  }
+
+// One radio setting by the name it has after "loRa" or "loRa2", like
+// "Band" or "SpreadingFactor". Returns false if it isn't one.
+bool setRadioField(loraRadio& config, const char* field, long value)
+  {
+  long small=constrain(value,0,255); //so a value too big for a byte can't wrap into range
+  if (strcmp(field,"Band")==0)
+    config.band=max(value,0L);
+  else if (strcmp(field,"NetworkID")==0)
+    config.networkID=small;
+  else if (strcmp(field,"SpreadingFactor")==0)
+    config.spreadingFactor=small;
+  else if (strcmp(field,"Bandwidth")==0)
+    config.bandwidth=small;
+  else if (strcmp(field,"CodingRate")==0)
+    config.codingRate=small;
+  else if (strcmp(field,"Preamble")==0)
+    config.preamble=small;
+  else if (strcmp(field,"Power")==0)
+    config.power=constrain(value,-1,127);
+  else
+    return false;
+  return true;
+  }
+
+// Settings for the other modules are named like the first one's with the
+// module number after "loRa", so loRa2Band, loRa3SpreadingFactor and so on.
+// Returns false if the name isn't one of those or the value isn't a number.
+bool checkRadioSetting(const char* name, const char* val, pendingCommands& pending)
+  {
+  int radio=name[4]-'1';
+  char* end;
+  long value=strtol(val,&end,10);
+  if (radio<1 || radio>=LORA_MAX_RADIOS || end==val || *end!='\0'
+      || !setRadioField(pending.radios[radio],name+5,value))
+    return false;
+  pending.radioChanged[radio]=true;
+  return true;
+  }
+
+// Whether each module's radio settings go together, as the line leaves them
+bool checkRadios(pendingCommands& pending)
+  {
+  for (uint8_t radio=0; radio<LORA_MAX_RADIOS; radio++)
+    {
+    const loraRadio& config=pending.radios[radio];
+    if (!pending.radioChanged[radio]
+        || (config.band>=LORA_BAND_MIN && config.band<=LORA_BAND_MAX && RYLR998::radioIsValid(config)))
+      continue;
+    console.print("LoRa module ");
+    console.print(radio+1);
+    console.println(": those radio settings don't go together. The band has to be in range, SF up to 9 "
+                    "at bandwidth 7, 10 at 8, 11 at 9, network ID 3-15 or 18, and a preamble other "
+                    "than 12 only with network ID 18.");
+    return false;
+    }
+  return true;
+  }
+
+// radio=<band>,<network ID>,<SF>,<BW>,<CR>,<preamble>,<power>[,<module number>]
+bool checkRadio(const char* val, pendingCommands& pending)
+  {
+  long values[8];
+  uint8_t count=0;
+  const char* next=val;
+  while (next && count<8)
+    {
+    char* end;
+    values[count++]=strtol(next,&end,10);
+    if (end==next || (*end!=',' && *end!='\0'))
+      count=0xFF; //not a number
+    next=*end==','?end+1:nullptr;
+    }
+  if ((count!=7 && count!=8) || next)
+    {
+    console.println("radio takes <band>,<network ID>,<SF>,<BW>,<CR>,<preamble>,<power>[,<module number>]");
+    return false;
+    }
+  int radio=count==8?values[7]-1:0;
+  if (radio<0 || radio>=LORA_MAX_RADIOS)
+    {
+    console.println("No such module.");
+    return false;
+    }
+  loraRadio& config=pending.radios[radio];
+  config.band=max(values[0],0L);
+  config.networkID=constrain(values[1],0,255);
+  config.spreadingFactor=constrain(values[2],0,255);
+  config.bandwidth=constrain(values[3],0,255);
+  config.codingRate=constrain(values[4],0,255);
+  config.preamble=constrain(values[5],0,255);
+  config.power=constrain(values[6],-1,127);
+  pending.radioChanged[radio]=true;
+  return true;
+  }
+
+loraRadio loraRadioFor(const radioSettings& config)
+  {
+  loraRadio radio;
+  radio.band=config.band;
+  radio.networkID=config.networkID;
+  radio.spreadingFactor=config.spreadingFactor;
+  radio.bandwidth=config.bandwidth;
+  radio.codingRate=config.codingRate;
+  radio.preamble=config.preamble;
+  radio.power=config.power;
+  return radio;
+  }
+
+// Keep a module's radio settings, wherever they live for that module
+void storeRadioConfig(uint8_t radio, const loraRadio& config)
+  {
+  if (radio==0)
+    {
+    settings.loRaBand=config.band;
+    settings.loRaNetworkID=config.networkID;
+    settings.loRaSpreadingFactor=config.spreadingFactor;
+    settings.loRaBandwidth=config.bandwidth;
+    settings.loRaCodingRate=config.codingRate;
+    settings.loRaPreamble=config.preamble;
+    settings.loRaPower=config.power;
+    }
+  else if (radio<LORA_MAX_RADIOS)
+    {
+    radioSettings& extra=settings.extraRadios[radio-1];
+    extra.band=config.band;
+    extra.networkID=config.networkID;
+    extra.spreadingFactor=config.spreadingFactor;
+    extra.bandwidth=config.bandwidth;
+    extra.codingRate=config.codingRate;
+    extra.preamble=config.preamble;
+    extra.power=config.power;
+    }
+  saveSettings();
+  }
+
+// Give a module a new set of radio settings, and keep them if it takes them.
+// If it doesn't, the module is left as it was and the settings are set back
+// to what it has, so a bad setting can't cut a gateway off. A module that
+// isn't there, or isn't being used yet, gets them at the next boot.
+bool applyRadio(uint8_t radio, const loraRadio& config)
+  {
+  RYLR998* module=radio<LORA_RADIO_COUNT && settingsAreValid?radios[radio]:nullptr;
+  bool ok=RYLR998::radioIsValid(config);
+  if (!ok)
+    console.println("Those radio settings don't go together. SF up to 9 at bandwidth 7, 10 at 8, "
+                    "11 at 9, and a preamble other than 12 only with network ID 18.");
+  else if (!module)
+    {
+    storeRadioConfig(radio,config);
+    radioConfigured(false,radio); //so they all get sent at the next boot
+    return true;
+    }
+  else if (!module->setRadio(config))
+    {
+    console.print("LoRa module ");
+    console.print(radio+1);
+    console.print(" didn't take the radio settings, error ");
+    console.print(module->lastError());
+    console.println(", so it's still on the old ones");
+    ok=false;
+    }
+
+  loraRadio now;
+  if (ok)
+    storeRadioConfig(radio,config);
+  else if (module && module->getRadio(now))
+    storeRadioConfig(radio,now); //what the module actually has
+  else
+    return false;
+  radioConfigured(ok,radio);
+  if (ok && settings.lowPower)
+    setLoRaMode(radio); //the preamble may no longer cover the sleep, or now it does
+  return ok;
+  }
+
+// A hash of everything we configure in the module, so that at boot we can
+// tell whether it's already set up without asking it
+uint32_t radioConfigHash(uint8_t radio)
+  {
+  radioSettings config=radioConfig(radio);
+  struct __attribute__((packed))
+    {
+    uint16_t address;
+    byte networkID;
+    uint32_t band;
+    byte sf,bw,cr,preamble;
+    int power;
+    byte mode;
+    uint16_t rxTime,sleepTime;
+    } packed={(uint16_t)settings.loRaAddress,config.networkID,config.band,
+              config.spreadingFactor,config.bandwidth,config.codingRate,
+              config.preamble,config.power,
+              useSmartReceive(radio),settings.loRaRxTime,settings.loRaSleepTime};
+  uint32_t hash=NodeTable::hashPayload((const char*)&packed,sizeof(packed));
+  return hash?hash:1; //0 means unknown
+  }
+
+// Note whether the module now has our settings. If a command failed we
+// don't know what it has, so everything gets applied again at the next boot.
+// complete is for configureLoRa(), which has just sent the lot. A single
+// setting that worked only keeps a hash that was already good; the module
+// could still be missing whatever failed before.
+void radioConfigured(bool ok, uint8_t radio, bool complete)
+  {
+  if (radio>=LORA_MAX_RADIOS)
+    return;
+  uint32_t& stored=radio==0?settings.loRaConfigHash:settings.extraRadios[radio-1].configHash;
+  uint32_t hash=ok && (complete || stored!=0)?radioConfigHash(radio):0;
+  if (hash==stored)
+    return;
+  stored=hash;
+  saveSettings();
+  }
+
+// Give the module our settings, unless it got these ones last time. The
+// module keeps them through a power cycle, so normally this costs nothing.
+void configureLoRa(uint8_t radio)
+  {
+  RYLR998& module=*radios[radio];
+  radioSettings config=radioConfig(radio);
+  console.print("LoRa module ");
+  console.print(radio+1);
+  if (config.configHash==radioConfigHash(radio))
     {
-    lora.setParameter(settings.loRaSpreadingFactor, 
-                      settings.loRaBandwidth, 
-                      settings.loRaCodingRate, 
-                      settings.loRaPreamble);
+    console.println(" already configured");
+    return;
     }
+  console.println(" being configured");
+  warnSmartReceive(radio);
+  bool ok=module.setAddress(settings.loRaAddress)
+      && module.setRadio(loraRadioFor(config))
+      && (useSmartReceive(radio)
+          ?module.setMode(LORA_MODE_SMART_RECEIVE,settings.loRaRxTime,settings.loRaSleepTime)
+          :module.setMode(LORA_MODE_TRANSCEIVER));
+  if (!ok)
+    console.println("LoRa module didn't take the settings, will try again next boot");
+  radioConfigured(ok,radio,true);
   }
 
   
@@ -364,7 +990,7 @@ String getConfigCommand()
   {
   if (commandComplete) 
     {
-    Serial.println(commandString);
+    console.println(commandString);
     String newCommand=commandString;
     if (newCommand.length()==0)
       newCommand='\n'; //to show available commands
@@ -376,479 +1002,1258 @@ String getConfigCommand()
   else return "";
   }
 
-bool processCommand(String cmd)
+// Carry out a line from the console or MQTT. It can hold several commands
+// separated by ";", like "loRaSpreadingFactor=9;loRaBandwidth=8". They are
+// all checked before any of them is carried out, each against what the ones
+// before it will leave, so a mistake in one means none of them happen. Each
+// module's radio settings are checked together and sent once at the end, and
+// whatever else has to follow a change happens once after that. Returns false
+// if anything was wrong with the line, or a module or server let us down.
+bool processCommand(const char* cmd)
   {
-  bool commandFound=true; //saves a lot of code
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme=strtok((char *)str,"=");
-  if (nme!=NULL)
-    val=strtok(NULL,"=");
-
-  if (nme[0]=='\n' || nme[0]=='\r' || nme[0]=='\0') //a single cr means show current settings
+  char line[COMMAND_LINE_SIZE];
+  snprintf(line,sizeof(line),"%s",cmd);
+  size_t length=strlen(line);
+  while (length>0 && (line[length-1]=='\r' || line[length-1]=='\n' || line[length-1]==' '))
+    line[--length]='\0';
+  if (length==0) //an empty line means show current settings
     {
     showSettings();
-    commandFound=false; //command not found
+    return false;
     }
-  else
-    {
-    //Get rid of the carriage return
-    if (val!=NULL && strlen(val)>0 && val[strlen(val)-1]==13)
-      val[strlen(val)-1]=0; 
 
-    if (val!=NULL)
+  struct
+    {
+    const char* name;
+    const char* val; //nullptr if there was no "="
+    const settingField* field;
+    const commandHandler* handler;
+    } parts[COMMAND_MAX_PARTS];
+  uint8_t count=0;
+  pendingCommands pending;
+  pending.rules=frameRules.count();
+  for (uint8_t radio=0; radio<LORA_MAX_RADIOS; radio++)
+    {
+    pending.radios[radio]=loraRadioFor(radioConfig(radio));
+    pending.radioChanged[radio]=false;
+    }
+  for (char* part=line; part; )
+    {
+    char* next=strchr(part,';');
+    if (next)
+      *next++='\0';
+    if (*part=='\0')
+      {
+      part=next;
+      continue; //";;" or a ";" on the end
+      }
+    if (count>=COMMAND_MAX_PARTS)
       {
+      console.println("Too many commands on one line.");
+      return false;
+      }
+    char* val=strchr(part,'=');
+    if (val)
+      {
+      *val++='\0';
       if (strcmp(val,"NULL")==0) //to nullify a value, you have to really mean it
-        {
-        strcpy(val,"");
-        }
-      
-      if (strcmp(nme,"broker")==0)
-        {
-        strcpy(settings.mqttBrokerAddress,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"port")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.mqttBrokerPort=atoi(val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"topicroot")==0)
-        {
-        strcpy(settings.mqttTopicRoot,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"user")==0)
-        {
-        strcpy(settings.mqttUsername,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"pass")==0)
-        {
-        strcpy(settings.mqttPassword,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"ssid")==0)
-        {
-        strcpy(settings.ssid,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"wifipass")==0)
-        {
-        strcpy(settings.wifiPassword,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"address")==0)
-        {
-        strcpy(settings.address,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"netmask")==0)
-        {
-        strcpy(settings.netmask,val);
-        saveSettings();
-        }
-      else if (strcmp(nme,"invertdisplay")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.invertdisplay=atoi(val)==1?true:false;
-        display.setRotation(settings.invertdisplay?2:0); //go ahead and do it
-        saveSettings();
-        }
-      else if (strcmp(nme,"loRaAddress")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaAddress=atoi(val);
-        saveSettings();
-        lora.setAddress(settings.loRaAddress);
-        }
-      else if (strcmp(nme,"loRaBand")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaBand=atoi(val);
-        saveSettings();
-        lora.setBand(settings.loRaBand);
-        }
-      else if (strcmp(nme,"loRaBandwidth")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaBandwidth=atoi(val);
-        saveSettings();
-        setLoRaParameters();
-        }
-      else if (strcmp(nme,"loRaCodingRate")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaCodingRate=atoi(val);
-        saveSettings();
-        setLoRaParameters();
-        }
-      else if (strcmp(nme,"loRaNetworkID")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaNetworkID=atoi(val);
-        saveSettings();
-        lora.setNetworkID(settings.loRaNetworkID);
-        }
-      else if (strcmp(nme,"loRaSpreadingFactor")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaSpreadingFactor=atoi(val);
-        saveSettings();
-        setLoRaParameters();
-        }
-      else if (strcmp(nme,"loRaPreamble")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaPreamble=atoi(val);
-        saveSettings();
-        setLoRaParameters();
-        }
-      else if (strcmp(nme,"loRaBaudRate")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaBaudRate=atoi(val);
-        saveSettings();
-        lora.setBaudRate(settings.loRaBaudRate);
-
-        //this affects the baud rate of the software serial connection
-        //so we need to reboot
-        Serial.println("********** Rebooting ************");
-        delay(2000);
-        ESP.restart();
-        }
-      else if (strcmp(nme,"loRaPower")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.loRaPower=atoi(val);
-        saveSettings();
-        lora.setRFPower(settings.loRaPower);
-        }
-      else if (strcmp(nme,"debug")==0)
-        {
-        if (!val)
-          strcpy(val,"0");
-        settings.debug=atoi(val)==1?true:false;
-        saveSettings();
-        lora.setdebug(settings.debug);
-        }
-      else if ((strcmp(nme,"resetmqttid")==0)&& (strcmp(val,"yes")==0))
-        {
-        generateMqttClientId(settings.mqttClientId);
-        saveSettings();
-        }
-      else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
-        {
-        Serial.println("\n*********************** Resetting EEPROM Values ************************");
-        initializeSettings();
-        saveSettings();
-        delay(2000);
-        ESP.restart();
-        }
-      else
-        {
-        showSettings();
-        commandFound=false; //command not found
-        }
+        val[0]='\0';
+      else if (val[0]=='\0')
+        val=nullptr; //"name=" with nothing after it
+      }
+    parts[count].name=part;
+    parts[count].val=val;
+    parts[count].field=settingsTable.find(part);
+    parts[count].handler=findByName(commandHandlers,commandOrder.index,
+                                    sizeof(commandHandlers)/sizeof(commandHandlers[0]),part);
+    bool radio=strncmp(part,"loRa",4)==0 && isdigit(part[4]); //the other modules' settings
+
+    if (!parts[count].field && !parts[count].handler && !radio)
+      {
+      showSettings();
+      return false; //command not found
+      }
+    if ((parts[count].field || radio) && !val)
+      {
+      console.print(part);
+      console.println(" needs a value.");
+      return false;
+      }
+    if (parts[count].field && !settingsTable.check(*parts[count].field,val))
+      {
+      console.print("Can't set ");
+      console.print(part);
+      console.print(" to ");
+      console.print(val);
+      console.print(", it takes ");
+      console.println(parts[count].field->help);
+      return false;
       }
+    if (parts[count].field && strncmp(part,"loRa",4)==0
+        && setRadioField(pending.radios[0],part+4,atol(val))) //the first module's radio settings
+      pending.radioChanged[0]=true;
+    if (parts[count].handler && parts[count].handler->check
+        && !parts[count].handler->check(val,pending))
+      return false;
+    if (radio && !parts[count].field && !checkRadioSetting(part,val,pending))
+      {
+      console.print("Can't set ");
+      console.print(part);
+      console.print(" to ");
+      console.println(val);
+      return false;
+      }
+    count++;
+    part=next;
+    }
+  if (!checkRadios(pending))
+    return false;
+
+  bool ok=true;
+  void (*changed[COMMAND_MAX_PARTS])(); //what to do about the changes, each once
+  uint8_t changedCount=0;
+  for (uint8_t i=0; i<count; i++)
+    {
+    const settingField* field=parts[i].field;
+    if (field)
+      {
+      settingsTable.set(*field,parts[i].val);
+      saveSettings();
+      bool already=false;
+      for (uint8_t j=0; j<changedCount; j++)
+        already|=changed[j]==field->changed;
+      if (field->changed && !already)
+        changed[changedCount++]=field->changed;
+      }
+    else if (parts[i].handler && parts[i].handler->run)
+      ok&=parts[i].handler->run(parts[i].val);
     }
-  return commandFound;
+  for (uint8_t radio=0; radio<LORA_MAX_RADIOS; radio++)
+    if (pending.radioChanged[radio])
+      ok&=applyRadio(radio,pending.radios[radio]);
+  for (uint8_t i=0; i<changedCount; i++)
+    changed[i]();
+  return ok;
   }
 
-void initializeSettings()
+// rule=<match action> adds a rule, rule=NULL clears them all
+bool checkRule(const char* val, pendingCommands& pending)
   {
-  settings.validConfig=0; 
-  strcpy(settings.ssid,"");
-  strcpy(settings.wifiPassword,"");
-  strcpy(settings.mqttBrokerAddress,""); //default
-  settings.mqttBrokerPort=1883;
-  strcpy(settings.mqttUsername,"");
-  strcpy(settings.mqttPassword,"");
-  strcpy(settings.mqttTopicRoot,"");
-  strcpy(settings.address,"");
-  strcpy(settings.netmask,"255.255.255.0");
-  settings.invertdisplay=false;
-  settings.loRaAddress=DEFAULT_LORA_ADDRESS;
-  settings.loRaNetworkID=DEFAULT_LORA_NETWORK_ID;
-  settings.loRaBand=DEFAULT_LORA_BAND;
-  settings.loRaSpreadingFactor=DEFAULT_LORA_SPREADING_FACTOR;
-  settings.loRaBandwidth=DEFAULT_LORA_BANDWIDTH;
-  settings.loRaCodingRate=DEFAULT_LORA_CODING_RATE;
-  settings.loRaPreamble=DEFAULT_LORA_PREAMBLE;
-  settings.loRaBaudRate=DEFAULT_LORA_BAUD_RATE;
-  settings.loRaPower=DEFAULT_LORA_POWER;
-  generateMqttClientId(settings.mqttClientId);
+  if (!val)
+    {
+    console.println("rule takes <match action>, or NULL to clear them all");
+    return false;
+    }
+  if (strlen(val)==0)
+    pending.rules=0;
+  else if (pending.rules>=RULES_MAX)
+    {
+    console.println("No room for another rule.");
+    return false;
+    }
+  else if (!frameRules.check(val))
+    {
+    console.println("Can't make sense of that rule.");
+    return false;
+    }
+  else
+    pending.rules++;
+  return true;
+  }
+
+bool commandRule(const char* val)
+  {
+  if (!val)
+    return false;
+  if (strlen(val)==0)
+    frameRules.clear();
+  else if (!frameRules.add(val))
+    {
+    console.println(frameRules.count()>=RULES_MAX?"No room for another rule.":"Can't make sense of that rule.");
+    return false;
+    }
+  saveSettings();
+  return true;
+  }
+
+bool checkDeleteRule(const char* val, pendingCommands& pending)
+  {
+  int rule=val?atoi(val):0;
+  if (rule<1 || rule>pending.rules)
+    {
+    console.println("There is no rule with that number.");
+    return false;
+    }
+  pending.rules--;
+  return true;
+  }
+
+bool commandDeleteRule(const char* val)
+  {
+  if (!val || !frameRules.remove(atoi(val)-1))
+    {
+    console.println("There is no rule with that number.");
+    return false;
+    }
+  saveSettings();
+  return true;
+  }
+
+// record= and replay= take a number, or nothing for 0
+bool checkCount(const char* val, pendingCommands& pending)
+  {
+  if (!val)
+    return true;
+  char* end;
+  long count=strtol(val,&end,10);
+  if (end==val || *end!='\0' || count<0 || count>65535)
+    {
+    console.println("That takes a number, 0-65535.");
+    return false;
+    }
+  return true;
+  }
+
+bool commandRecord(const char* val)
+  {
+  int frames=val?atoi(val):0;
+  if (!replay.record(frames))
+    return false;
+  if (frames>0)
+    console.println("Recording frames for replay");
+  return true;
+  }
+
+bool commandReplay(const char* val)
+  {
+  if (!replay.start(val?atoi(val):0))
+    return false;
+  console.println("Replaying recorded frames");
+  return true;
+  }
+
+bool commandSave(const char* val)
+  {
+  return commitSettings();
+  }
+
+// update=<url>,<md5> starts pulling new firmware, update=cancel stops it
+bool checkUpdate(const char* val, pendingCommands& pending)
+  {
+  if (val && strcmp(val,"cancel")==0)
+    return true;
+  const char* comma=val?strrchr(val,','):nullptr;
+  if (!comma || strncmp(val,"http://",7)!=0 || !FirmwareUpdate::isValidMd5(comma+1))
+    {
+    console.println("update takes <http URL of the firmware>,<its MD5, 32 hex digits>");
+    return false;
+    }
+  if (firmwareUpdate.running())
+    {
+    console.println("Already updating.");
+    return false;
+    }
+  if (WiFi.status()!=WL_CONNECTED)
+    {
+    console.println("Can't update without WiFi.");
+    return false;
+    }
+  return true;
+  }
+
+bool commandUpdate(const char* val)
+  {
+  if (strcmp(val,"cancel")==0)
+    {
+    firmwareUpdate.cancel();
+    return true;
+    }
+  const char* comma=strrchr(val,',');
+  char url[COMMAND_LINE_SIZE];
+  snprintf(url,sizeof(url),"%.*s",(int)(comma-val),val);
+  if (!firmwareUpdate.start(url,comma+1))
+    return false;
+  queue("Updating");
+  return true;
+  }
+
+// resetmqttid= and factorydefaults= have to be told yes
+bool checkYes(const char* val, pendingCommands& pending)
+  {
+  if (val && strcmp(val,"yes")==0)
+    return true;
+  console.println("That needs =yes, to be sure.");
+  return false;
+  }
+
+bool commandResetMqttId(const char* val)
+  {
+  generateMqttClientId(settings.mqttClientId);
+  saveSettings();
+  return true;
+  }
+
+bool commandFactoryDefaults(const char* val) //reset all eeprom settings
+  {
+  console.println("\n*********************** Resetting EEPROM Values ************************");
+  initializeSettings();
+  saveSettings();
+  commitSettings();
+  delay(2000);
+  ESP.restart();
+  return true;
+  }
+
+void initializeSettings()
+  {
+  settings.validConfig=0; 
+  strcpy(settings.ssid,"");
+  strcpy(settings.wifiPassword,"");
+  strcpy(settings.mqttBrokerAddress,""); //default
+  settings.mqttBrokerPort=1883;
+  strcpy(settings.mqttUsername,"");
+  strcpy(settings.mqttPassword,"");
+  strcpy(settings.mqttTopicRoot,"");
+  setTopicRoot();
+  strcpy(settings.address,"");
+  strcpy(settings.netmask,"255.255.255.0");
+  settings.invertdisplay=false;
+  settings.loRaAddress=DEFAULT_LORA_ADDRESS;
+  settings.loRaNetworkID=DEFAULT_LORA_NETWORK_ID;
+  settings.loRaBand=DEFAULT_LORA_BAND;
+  settings.loRaSpreadingFactor=DEFAULT_LORA_SPREADING_FACTOR;
+  settings.loRaBandwidth=DEFAULT_LORA_BANDWIDTH;
+  settings.loRaCodingRate=DEFAULT_LORA_CODING_RATE;
+  settings.loRaPreamble=DEFAULT_LORA_PREAMBLE;
+  settings.loRaBaudRate=DEFAULT_LORA_BAUD_RATE;
+  settings.loRaPower=DEFAULT_LORA_POWER;
+  settings.lowPower=0;
+  settings.loRaRxTime=DEFAULT_LORA_RX_TIME;
+  settings.loRaSleepTime=DEFAULT_LORA_SLEEP_TIME;
+  for (int radio=0; radio<LORA_MAX_RADIOS-1; radio++)
+    defaultRadioSettings(settings.extraRadios[radio]);
+  frameRules.begin(settings.rules);
+  frameRules.clear();
+  settings.changeOnly=0;
+  settings.deadband=DEFAULT_DEADBAND;
+  settings.deadbandPercent=DEFAULT_DEADBAND_PERCENT;
+  settings.heartbeat=DEFAULT_HEARTBEAT;
+  setDeadband();
+  settings.publishMode=PUBLISH_MODE_FIELDS;
+  settings.spillToFlash=0;
+  settings.nodeSummaryInterval=DEFAULT_NODE_SUMMARY_INTERVAL;
+  settings.duplicateWindow=DEFAULT_DUPLICATE_WINDOW;
+  settings.decimals=DEFAULT_DECIMALS;
+  settings.dutyCycle=DEFAULT_DUTY_CYCLE;
+  settings.metricsInterval=DEFAULT_METRICS_INTERVAL;
+  settings.publishQos=DEFAULT_PUBLISH_QOS;
+  generateMqttClientId(settings.mqttClientId);
+  }
+
+void checkForCommand()
+  {
+  if (console.available())
+    {
+    incomingSerialData();
+    String cmd=getConfigCommand();
+    if (cmd.length()>0)
+      {
+      processCommand(cmd.c_str());
+      }
+    }
+  }
+
+// Add a message to the ones waiting for the display. If the same one is
+// already waiting it isn't added again.
+void queue(const char* text)
+  {
+  if (!messages.push(text) && settings.debug)
+    console.println("Display queue full, message dropped");
+  }
+
+uint32_t ackStarted=0; //cycle count when the ack in flight went to the module
+
+//Called by the LoRa driver when the module has finished sending an ack
+void ackComplete(bool ok, const char* response)
+  {
+  metrics.record(STAGE_ACK,ESP.getCycleCount()-ackStarted);
+  if (!ok)
+    {
+    console.print("Ack failed: ");
+    console.println(response[0]?response:"no response");
+    queue("Ack Fail.");
+    }
+  else if (settings.debug)
+    console.println("Ack sent.");
+  }
+
+//Acknowledge receipt of LoRa message and status of MQTT report. This only 
+//queues the ack for sendAcks(), so the result here is whether it could be queued.
+bool ack(bool ok)
+  {
+  return ack(ok,lastFrame.address,lastFrame.channel);
+  }
+
+//Acknowledge a frame from this node, which isn't always the latest one. It
+//goes back out on the module the frame came in on.
+bool ack(bool ok, uint16_t address, uint8_t channel)
+  {
+  if (settings.debug)
+    console.println(ok?"Replying with ACK":"Replying with NAK");
+  if (ackCount>=ACK_QUEUE_LENGTH)
+    return false;
+  pendingAck& next=acks[(ackHead+ackCount)%ACK_QUEUE_LENGTH];
+  next.address=address;
+  next.channel=channel;
+  next.ok=ok;
+  next.queuedAt=millis();
+  next.held=false;
+  ackCount++;
+  return true;
+  }
+
+// Send the oldest waiting ack, unless the channel is busy or our duty cycle
+// is used up. An ack that can't go out in time is dropped, since the sender
+// will have given up on it and will resend the frame anyway.
+void sendAcks()
+  {
+  if (ackCount==0)
+    return;
+  pendingAck& next=acks[ackHead];
+  RYLR998& radio=*radios[next.channel];
+  if (radio.commandPending())
+    return;
+  const char* text=next.ok?"{\"ack\":true}":"{\"ack\":false}";
+  uint32_t airtime=frameAirtime(strlen(text),next.channel);
+
+  if (millis()-next.queuedAt>ACK_MAX_DELAY)
+    {
+    console.println("Ack held back too long, dropped.");
+    queue("Ack Drop");
+    acksDropped++;
+    }
+  else
+    {
+    bool overBudget=settings.dutyCycle>0
+        && ackAirtime.total()+airtime>(uint32_t)settings.dutyCycle*ackAirtime.window(); //permille of ms is us
+    bool busy=recentAirtime.permille()>ACK_BUSY_PERMILLE;
+    if (overBudget || busy)
+      {
+      if (!next.held && settings.debug)
+        console.println(overBudget?"Duty cycle used up, holding ack.":"Channel busy, holding ack.");
+      if (!next.held)
+        acksHeld++;
+      next.held=true;
+      return;
+      }
+    if (!radio.sendAsync(next.address,text,ackComplete))
+      return; //try again next time
+    ackStarted=ESP.getCycleCount();
+    ackAirtime.add(airtime);
+    channelAirtime.add(airtime);
+    recentAirtime.add(airtime);
+    }
+  ackHead=(ackHead+1)%ACK_QUEUE_LENGTH;
+  ackCount--;
+  }
+
+// Time on the air for a frame with this many payload bytes, in microseconds,
+// at the settings of the module on this channel
+uint32_t frameAirtime(uint8_t length, uint8_t channel)
+  {
+  radioSettings config=radioConfig(channel);
+  return timeOnAir(length,config.spreadingFactor,config.bandwidth,
+                   config.codingRate,config.preamble);
+  }
+
+/************************
+ * Do the MQTT thing
+ ************************/
+// The topic root is kept at the front of this buffer so that making a topic
+// is just copying the suffix in after it. Only setTopicRoot() touches the root.
+char topicBuffer[MQTT_TOPIC_SIZE];
+size_t topicRootLength=0;
+
+// The fixed topic suffixes, with their lengths worked out at compile time.
+// These must be in the same order as topicSuffix.
+#define SUFFIX(text) {text,sizeof(text)-1}
+const struct 
+  {
+  const char* text;
+  uint8_t length;
+  } topicSuffixes[TOPIC_SUFFIX_COUNT]=
+  {
+  SUFFIX(MQTT_TOPIC_ADDRESS),
+  SUFFIX(MQTT_TOPIC_LENGTH),
+  SUFFIX(MQTT_TOPIC_RSSI),
+  SUFFIX(MQTT_TOPIC_SNR),
+  SUFFIX(MQTT_TOPIC_COMMAND_REQUEST),
+  SUFFIX(MQTT_TOPIC_NODE_SUMMARY),
+  SUFFIX(MQTT_TOPIC_METRICS),
+  SUFFIX(MQTT_TOPIC_CHANNEL)
+  };
+#undef SUFFIX
+
+// Copy the topic root into the topic buffer. Call this whenever it changes.
+void setTopicRoot()
+  {
+  useTopicRoot(settings.mqttTopicRoot);
+  }
+
+// Make topics with some other root until setTopicRoot() puts it back
+void useTopicRoot(const char* root)
+  {
+  topicRootLength=strnlen(root,MQTT_TOPIC_SIZE-1);
+  memcpy(topicBuffer,root,topicRootLength);
+  topicBuffer[topicRootLength]='\0';
+  }
+
+// Make a topic from the root and a suffix. The topic is cut short if it won't
+// fit. The buffer is reused by the next call, so use the topic right away.
+char* topicFor(const char* suffix, size_t length)
+  {
+  if (length>MQTT_TOPIC_SIZE-1-topicRootLength)
+    length=MQTT_TOPIC_SIZE-1-topicRootLength;
+  memcpy(topicBuffer+topicRootLength,suffix,length);
+  topicBuffer[topicRootLength+length]='\0';
+  return topicBuffer;
+  }
+
+char* topicFor(const char* suffix)
+  {
+  return topicFor(suffix,strnlen(suffix,MQTT_TOPIC_SIZE));
+  }
+
+char* topicFor(topicSuffix suffix)
+  {
+  return topicFor(topicSuffixes[suffix].text,topicSuffixes[suffix].length);
+  }
+
+// Get a frame's fields ready for publishing. They stay valid as long as the
+// frame's payload doesn't change.
+void loadFrame(const rcvFrame& frame)
+  {
+  uint32_t start=ESP.getCycleCount();
+  frameScanned=scanner.scan(frame.payload,frame.payloadLength);
+  if (!frameScanned)
+    {
+    lora.decodeFrame(frame); //nested, binary, or something else the scanner can't do
+#if LORA_RADIO_COUNT>1
+    doc[MQTT_TOPIC_CHANNEL]=frame.channel+1;
+#endif
+    }
+  metrics.record(STAGE_DECODE,ESP.getCycleCount()-start);
+  }
+
+// Print, publish and show one field from this node. Neither key nor reading
+// need to be NUL terminated. Returns false if the publish failed. A field
+// that hasn't changed counts as published.
+bool publishField(uint16_t address, const char* key, size_t keyLength, const char* reading, size_t length)
+  {
+  bool ok=true;
+  const frameRule* rule=frameRules.keyRule(key,keyLength);
+  if (rule && rule->action==RULE_DROP)
+    return true;
+  if (rule && rule->action==RULE_RENAME)
+    {
+    key=rule->text;
+    keyLength=strlen(rule->text);
+    }
+  console.write(key,keyLength);
+  console.print(":");
+  console.write(reading,length);
+  console.println();
+
+  if (settings.publishMode!=PUBLISH_MODE_JSON //otherwise the whole frame goes out as one message
+      && strlen(settings.mqttBrokerAddress)>0) //only if broker is configured
+    {
+    char routed[MQTT_TOPIC_SIZE];
+    char* topic;
+    if (rule && rule->action==RULE_ROUTE)
+      {
+      snprintf(routed,sizeof(routed),"%s%.*s",rule->text,(int)keyLength,key);
+      topic=routed;
+      }
+    else
+      topic=topicFor(key,keyLength);
+    if (settings.changeOnly && !deadband.isNew(address,topic,reading,length))
+      {
+      if (settings.debug)
+        console.println("Unchanged, not published.");
+      }
+    else
+      {
+      ok=publish(topic,reading,length,true); //retain
+      if (ok && settings.changeOnly)
+        deadband.published();
+      }
+    if (!ok)
+      {
+      console.print("************ Failed publishing ");
+      console.write(key,keyLength);
+      console.println("!");
+      }
+    }
+
+  if (!isFrameField(key,keyLength)) //the summary's first line has those
+    frameSummary.add(key,keyLength,reading,length);
+  return ok;
+  }
+
+// Whether this is one of the fields added to every frame, like rssi
+bool isFrameField(const char* key, size_t keyLength)
+  {
+  const topicSuffix frameFields[]={TOPIC_ADDRESS,TOPIC_LENGTH,TOPIC_RSSI,TOPIC_SNR,TOPIC_CHANNEL};
+  for (topicSuffix field : frameFields)
+    if (topicSuffixes[field].length==keyLength && memcmp(topicSuffixes[field].text,key,keyLength)==0)
+      return true;
+  return false;
+  }
+
+// Publish the fields the scanner found, then the standard ones
+bool publishScannedFields(const rcvFrame& frame)
+  {
+  bool ok=true;
+  char reading[24];
+  for (uint8_t i=0; i<scanner.count(); i++)
+    {
+    const jsonField& field=scanner.field(i);
+    const char* value=field.value;
+    size_t length=field.valueLength;
+    if (field.type==JSON_FIELD_NULL)
+      {
+      console.write(field.key,field.keyLength);
+      console.println(":Unknown type, not published");
+      continue; //nothing to publish isn't a failure
+      }
+    if (field.type==JSON_FIELD_NUMBER) //reformat it to the configured decimal places
+      {
+      char number[24];
+      snprintf(number,sizeof(number),"%.*s",(int)length,value);
+      length=formatFixed(reading,sizeof(reading),strtod(number,NULL),settings.decimals);
+      value=reading;
+      }
+    ok&=publishField(frame.address,field.key,field.keyLength,value,length);
+    }
+
+  // These are the standard data that go with all messages, same as decodeFrame() adds
+  const struct {topicSuffix name; long value;} standard[]=
+    {
+    {TOPIC_ADDRESS,frame.address},
+    {TOPIC_LENGTH,frame.length},
+    {TOPIC_RSSI,frame.rssi},
+    {TOPIC_SNR,frame.snr},
+#if LORA_RADIO_COUNT>1
+    {TOPIC_CHANNEL,frame.channel+1},
+#endif
+    };
+  for (const auto& field : standard)
+    {
+    size_t length=formatInteger(reading,sizeof(reading),field.value);
+    ok&=publishField(frame.address,topicSuffixes[field.name].text,topicSuffixes[field.name].length,reading,length);
+    }
+  return ok;
+  }
+
+// Publish the fields in doc, for frames the scanner couldn't handle
+bool publishDocFields(const rcvFrame& frame)
+  {
+  bool ok=true;
+  char reading[RYLR998_MAX_PAYLOAD+1]; //no value can be longer than the frame it came in
+  JsonObject root = doc.as<JsonObject>();
+  for (JsonPair kv : root)
+    {
+    const char* key = kv.key().c_str();  // Get the key as a C string
+    JsonVariant value = kv.value();     // Get the value
+    size_t length=formatValue(reading,sizeof(reading),value,settings.decimals);
+    if (length==0 && !value.is<const char*>()) 
+      {
+      console.print(key);
+      console.println(":Unknown type, not published");
+      continue; //nothing to publish isn't a failure
+      }
+    ok&=publishField(frame.address,key,strlen(key),reading,length);
+    }
+  return ok;
+  }
+
+// Publish a frame that has been through loadFrame(). Returns true if
+// everything was published. started, if given, says whether any PUBLISH went
+// out at all, which it doesn't when rules or changeonly leave nothing to send.
+bool publishFrame(const rcvFrame& frame, bool* started)
+  {
+  uint32_t publishes=framePublishes;
+  const frameRule* rule=frameRules.match(frame.address,radioConfig(frame.channel).networkID);
+  bool routed=rule && rule->action==RULE_ROUTE;
+  if (routed)
+    useTopicRoot(rule->text);
+  console.println();
+  if (frameScanned)
+    console.write(frame.payload,frame.payloadLength); //print it to the console
+  else
+    serializeJson(doc, console);
+  console.println();
+
+  frameSummary.begin(frame.address,frame.rssi,frame.snr);
+  bool ok=frameScanned?publishScannedFields(frame):publishDocFields(frame);
+  frameSummary.end(messages); //one screen for the whole frame
+  if (settings.publishMode==PUBLISH_MODE_JSON)
+    ok=true; //the fields weren't published, only the JSON message counts
+
+  // send the whole frame as a single message to <topicroot><address>/json
+  if (settings.publishMode!=PUBLISH_MODE_FIELDS && strlen(settings.mqttBrokerAddress)>0)
+    {
+    char suffix[12];
+    formatInteger(suffix,sizeof(suffix),frame.address);
+    strcat(suffix,"/" MQTT_TOPIC_JSON);
+    char* topic=topicFor(suffix);
+    if (!(frameScanned?publishJsonFrame(topic,frame,true):publishJson(topic,doc,true))) //retain
+      {
+      console.println("************ Failed publishing JSON message!");
+      ok=false;
+      }
+    }
+  if (routed)
+    setTopicRoot();
+  if (started)
+    *started=framePublishes!=publishes;
+  return ok;
+  }
+
+// Publish a frame and let the sender know how it went
+bool report(const rcvFrame& frame)
+  {
+  bool started;
+  bool ok=publishFrame(frame,&started);
+  bool awaiting=ok && started && settings.publishQos==1 //with nothing sent there's no PUBACK to wait for
+      && qosPublisher.await(frame.address,frame.channel,NodeTable::hashPayload(frame.payload,frame.payloadLength));
+  bool ackStatus=awaiting || ack(ok); //if it's awaiting the broker, servicePubacks() acks it
+  console.print("Publish ");
+  console.println(ok?"OK":"Failed");
+  console.print("Ack ");
+  console.println(awaiting?"waiting for broker.":ackStatus?"queued.":"failed.");
+  if (!ok)
+    queue("Pub Fail.");
+  if (!ackStatus)
+    {
+    queue("Ack Fail.");
+    }
+  return ok;
+  }
+
+
+bool uplinkConnected()
+  {
+  return WiFi.status()==WL_CONNECTED && mqttClient.connected();
+  }
+
+// A frame has just come in. Publish it if we can, otherwise keep it until the
+// connection to the broker is back. Once anything is stored, newer frames get
+// stored behind it so they are published in the order they arrived. A frame
+// the sender resent because it missed our ack is only acked again.
+void handleFrame(RYLR998& radio)
+  {
+  // copy it out of the driver's line buffer so it stays put for the status command
+  const rcvFrame& received=radio.getFrame();
+  memcpy(lastPayload,received.payload,received.payloadLength);
+  lastPayload[received.payloadLength]='\0';
+  lastFrame=received;
+  lastFrame.payload=lastPayload;
+  const rcvFrame& frame=lastFrame;
+
+  loadFrame(frame);
+  if (replaying)
+    {
+    publishFrame(frame); //it's not really on the air, so nothing else
+    return;
+    }
+  replay.capture(frame);
+  updateNodeStats(frame);
+  if (duplicates.isDuplicate(frame,settings.duplicateWindow*1000UL))
+    {
+    console.println("Duplicate frame, not publishing it again.");
+    if (!qosPublisher.waitingFor(frame.address)) //the ack for the first one will do
+      ack(true);
+    return;
+    }
+  const frameRule* rule=frameRules.match(frame.address,radioConfig(frame.channel).networkID);
+  if (!frameRules.admit(rule,frame.address))
+    {
+    console.println(rule->action==RULE_DROP?"Frame dropped by rule.":"Frame rate limited by rule.");
+    ack(true); //it got here, and that's all the sender needs to know
+    return;
+    }
+
+  bool handled;
+  if (strlen(settings.mqttBrokerAddress)>0 
+      && (!uplinkConnected() || !frameStore.isEmpty()))
+    {
+    handled=frameStore.push(frame);
+    console.print("Uplink not ready, frame ");
+    console.println(handled?"stored.":"dropped, store is full!");
+    queue(handled?"Stored":"Store Full");
+    ack(handled); //once it's stored it's our problem, not the sender's
+    }
+  else
+    {
+    handled=report(frame);
+    }
+  if (handled)
+    duplicates.remember(frame);
+  }
+
+// Ack the frames the broker has confirmed, and NAK the ones it didn't confirm
+// in time. Those are forgotten as duplicates so that the resend gets published.
+void servicePubacks()
+  {
+  qosFrame frame;
+  while (qosPublisher.nextResult(frame,PUBACK_TIMEOUT))
+    {
+    if (!frame.confirmed)
+      {
+      console.println("Broker didn't confirm a frame, sending NAK.");
+      queue("No PUBACK");
+      duplicates.forget(frame.address,frame.payloadHash);
+      }
+    ack(frame.confirmed,frame.address,frame.channel);
+    }
+  }
+
+// Start publishing a frame's message, at QoS 1 if that's what we're doing
+boolean beginFramePublish(char* topic, size_t length, boolean retain)
+  {
+  bool ok=settings.publishQos==1?qosPublisher.beginPublish(mqttClient,topic,length,retain)
+                                :mqttClient.beginPublish(topic,length,retain);
+  if (ok)
+    framePublishes++;
+  return ok;
+  }
+
+// Feed recorded frames through the receive pipeline, timing each one from
+// the +RCV line to the last publish
+void serviceReplay()
+  {
+  for (int frames=0; frames<MAX_FRAMES_PER_LOOP && replay.running(); frames++)
+    {
+    const char* line=replay.nextLine();
+    if (!line)
+      break;
+    uint32_t heap=ESP.getFreeHeap();
+    uint32_t start=ESP.getCycleCount();
+    if (lora.replayLine(line))
+      {
+      replaying=true;
+      handleFrame(lora);
+      replaying=false;
+      replay.frameDone(ESP.getCycleCount()-start,heap);
+      }
+    else
+      {
+      replay.lineSkipped();
+      }
+    }
+  }
+
+// Add the frame that just came in to its sender's statistics
+void updateNodeStats(const rcvFrame& frame)
+  {
+  uint32_t airtime=frameAirtime(frame.length,frame.channel);
+  channelAirtime.add(airtime);
+  recentAirtime.add(airtime);
+  nodeStats* node=nodeTable.update(frame,airtime);
+
+  // nodes don't agree on upper or lower case key names
+  if (frameScanned)
+    {
+    for (uint8_t i=0; i<scanner.count(); i++)
+      {
+      const jsonField& field=scanner.field(i);
+      if (field.keyLength==strlen(MQTT_TOPIC_BATTERY)
+          && strncasecmp(field.key,MQTT_TOPIC_BATTERY,field.keyLength)==0
+          && (field.type==JSON_FIELD_INTEGER || field.type==JSON_FIELD_NUMBER))
+        {
+        char number[24];
+        snprintf(number,sizeof(number),"%.*s",(int)field.valueLength,field.value);
+        node->battery=strtod(number,NULL);
+        node->hasBattery=true;
+        }
+      }
+    return;
+    }
+
+  JsonObject root = doc.as<JsonObject>();
+  for (JsonPair kv : root)
+    {
+    if (strcasecmp(kv.key().c_str(),MQTT_TOPIC_BATTERY)==0 && kv.value().is<float>())
+      {
+      node->battery=kv.value().as<float>();
+      node->hasBattery=true;
+      }
+    }
+  }
+
+// Publish the node statistics table, streaming it straight into the MQTT
+// client since it can be much bigger than the client's buffer.
+boolean publishNodes(char* topic, bool compact, boolean retain)
+  {
+  boolean ok=false;
+  uint32_t now=millis(); //the same ages for measuring and printing
+  if (uplinkConnected()
+      && mqttClient.beginPublish(topic,nodeTable.measureJson(compact,now),retain))
+    {
+    nodeTable.printJson(mqttClient,compact,now);
+    ok=mqttClient.endPublish();
+    }
+  return ok;
+  }
+
+// Publish the timing metrics, streamed like the node table
+boolean publishMetrics(char* topic, boolean retain)
+  {
+  boolean ok=false;
+  metrics.snapshot(messages);
+  if (uplinkConnected()
+      && mqttClient.beginPublish(topic,metrics.measureJson(),retain))
+    {
+    metrics.printJson(mqttClient);
+    ok=mqttClient.endPublish();
+    }
+  return ok;
+  }
+
+// The settings JSON, with a couple of things that aren't settings on the end
+size_t printSettingsJson(Print& out)
+  {
+  size_t n=out.print("{");
+  n+=settingsTable.printJsonFields(out);
+  n+=out.print(",\"mqttClientId\":\"");
+  n+=out.print(settings.mqttClientId);
+  n+=out.print("\",\"IPAddress\":\"");
+  n+=out.print(wifiClient.localIP().toString());
+  n+=out.print("\"}");
+  return n;
   }
 
-void checkForCommand()
+// Publish the settings, streamed like the node table so there is no need
+// for a buffer big enough to hold them all
+boolean publishSettings(char* topic, boolean retain)
   {
-  if (Serial.available())
+  boolean ok=false;
+  ByteCounter counter;
+  printSettingsJson(counter);
+  if (uplinkConnected()
+      && mqttClient.beginPublish(topic,counter.count,retain))
     {
-    incomingSerialData();
-    String cmd=getConfigCommand();
-    if (cmd.length()>0)
-      {
-      processCommand(cmd);
-      }
+    printSettingsJson(mqttClient);
+    ok=mqttClient.endPublish();
     }
+  return ok;
   }
 
-void queue(String text)
+// Publish the rules, streamed like the node table
+boolean publishRules(char* topic, boolean retain)
   {
-  showTailPointer++;
-  if (showTailPointer>=SHOWBUF_LENGTH)
-    showTailPointer=0;
-  snprintf(showbuffer[showTailPointer],SHOWBUF_WIDTH,"%s",text.c_str());
+  boolean ok=false;
+  if (uplinkConnected()
+      && mqttClient.beginPublish(topic,frameRules.measureJson(),retain))
+    {
+    frameRules.printJson(mqttClient);
+    ok=mqttClient.endPublish();
+    }
+  return ok;
   }
 
-//Acknowledge receipt of LoRa message and status of MQTT report
-bool ack(bool ok)
+// Every so often, publish the timing metrics
+void publishMetricsReport()
   {
-  bool good=false;
-  String tf=ok?"true":"false";
-  String ack="{\"ack\":"+tf+"}";
-  if (String(doc["address"]).length()>0)
-    good=lora.send((int)doc["address"],ack);
-  if (settings.debug)
-    Serial.println("Replying with "+ok?"ACK":"NAK");
-  return good;
+  static unsigned long lastReport=0;
+  if (settings.metricsInterval==0
+      || !uplinkConnected()
+      || millis()-lastReport<settings.metricsInterval*1000UL)
+    return;
+  lastReport=millis();
+
+  if (!publishMetrics(topicFor(TOPIC_METRICS),false)) //not retained, it's a time series
+    console.println("************ Failed publishing metrics!");
   }
 
-/************************
- * Do the MQTT thing
- ************************/
-bool report()
+// Every so often, publish a compact summary of all the nodes we hear
+void publishNodeSummary()
   {
-  uint8_t allGood=0;
-  char topic[MQTT_TOPIC_SIZE];
-  char reading[18];
-  
-  Serial.println();
-  serializeJson(doc, Serial); //print it to the console
-  Serial.println();
+  static unsigned long lastSummary=0;
+  if (settings.nodeSummaryInterval==0 
+      || nodeTable.count()==0
+      || !uplinkConnected()
+      || millis()-lastSummary<settings.nodeSummaryInterval*1000UL)
+    return;
+  lastSummary=millis();
 
-  // iterate through all of the KV pairs and report them
-  JsonObject root = doc.as<JsonObject>();
-  for (JsonPair kv : root)
+  if (!publishNodes(topicFor(TOPIC_NODE_SUMMARY),true,true)) //retain
+    console.println("************ Failed publishing node summary!");
+  }
+
+// Publish stored frames once the broker is reachable again, a few at a time
+// so the receive path keeps running.
+void forwardStoredFrames()
+  {
+  static unsigned long lastForward=0;
+  if (frameStore.isEmpty() 
+      || !uplinkConnected() 
+      || millis()-lastForward<FRAME_STORE_FORWARD_INTERVAL)
+    return;
+  lastForward=millis();
+
+  rcvFrame frame;
+  char payload[RYLR998_MAX_PAYLOAD+1];
+  if (frameStore.peek(frame,payload))
     {
-    const char* key = kv.key().c_str();  // Get the key as a C string
-    JsonVariant value = kv.value();     // Get the value
+    loadFrame(frame);
+    if (publishFrame(frame))
+      frameStore.pop();
+    else
+      console.println("Failed forwarding a stored frame, will try again.");
+    }
+  }
 
-    // Print and publish the key and value
-    strcpy(topic,settings.mqttTopicRoot);
-    strcat(topic,key);
+boolean publish(char* topic, const char* reading, boolean retain)
+  {
+  return publish(topic,reading,strlen(reading),retain);
+  }
 
-    Serial.print(key);
-    Serial.print(":");
-    if (value.is<const char*>()) 
-      {
-      Serial.println(value.as<const char*>());
-      sprintf(reading,"%s",value.as<const char*>()); 
-      } 
-    else if (value.is<int>()) 
-      {
-      Serial.println(value.as<int>());
-      sprintf(reading,"%d",value.as<int>()); 
-      }
-    else if (value.is<double>()) 
-      {
-      //sprintf on Arduino doesn't work with doubles. We have to jump through some hoops.
-      double number=value.as<double>();
-      int width=(number < 1 && number > -1) ? 2 : log10(abs(number)) + 4; // +4 for decimal point, 2 decimal places, and sign if negative
-      dtostrf(number,width,2,reading);
-      Serial.println(reading);
-      } 
-    else if (value.is<bool>()) 
-      {
-      Serial.println(value.as<bool>() ? "true" : "false");
-      sprintf(reading,"%s",value.as<bool>() ? "true" : "false"); 
-      } 
-    else 
-      {
-      Serial.println("Unknown type");
-      }
+boolean publish(char* topic, const char* reading, size_t length, boolean retain)
+  {
+  if (settings.debug)
+    {
+    console.print(topic);
+    console.print(" ");
+    console.write(reading,length);
+    console.println();
+    }
+  boolean ok=false;
 
-    if (strlen(settings.mqttBrokerAddress)>0) //only if broker is configured
-      {
-      boolean success=false;
-      success=publish(topic,reading,true); //retain
-      if (!success)
-        {
-        Serial.print("************ Failed publishing ");
-        Serial.print(key);
-        Serial.println("!");
-        }
-      else
-        allGood++;
-      }
-    else
-      allGood++;
-    
-    queue(String(key)+":\n"+String(reading)); //Add this to the display buffer
+  if (mqttClient.connected() && 
+      settings.mqttTopicRoot &&
+      WiFi.status()==WL_CONNECTED)
+    {
+    uint32_t start=ESP.getCycleCount();
+    ok=beginFramePublish(topic,length,retain)
+        && mqttClient.write((const uint8_t*)reading,length)==length
+        && mqttClient.endPublish();
+    metrics.record(STAGE_PUBLISH,ESP.getCycleCount()-start);
     }
-    
-  bool ok=allGood>=root.size();
-  bool ackStatus=ack(ok);
-  Serial.print("Publish ");
-  Serial.println(ok?"OK":"Failed");
-  Serial.print("Ack ");
-  Serial.println(ackStatus?"sent.":"failed.");
-  if (!ok)
-    queue("Pub Fail.");
-  if (!ackStatus)
+  else
     {
-    queue("Ack Fail.");
+    console.print("Can't publish due to ");
+    if (WiFi.status()!=WL_CONNECTED)
+      console.println("no WiFi connection.");
+    else if (!mqttClient.connected())
+      console.println("not connected to broker.");
     }
   return ok;
   }
 
+// Publish a frame the scanner handled as one JSON message. The payload goes
+// out as it came in, with the standard fields added before the closing brace.
+boolean publishJsonFrame(char* topic, const rcvFrame& frame, boolean retain)
+  {
+  char tail[80];
+  int tailLength=snprintf(tail,sizeof(tail),"%s\"address\":%u,\"length\":%u,\"rssi\":%d,\"snr\":%d",
+                          scanner.count()>0?",":"",frame.address,frame.length,frame.rssi,frame.snr);
+#if LORA_RADIO_COUNT>1
+  tailLength+=snprintf(tail+tailLength,sizeof(tail)-tailLength,",\"" MQTT_TOPIC_CHANNEL "\":%u",frame.channel+1);
+#endif
+  tailLength+=snprintf(tail+tailLength,sizeof(tail)-tailLength,"}");
+  size_t head=scanner.closingBrace();
+  if (settings.debug)
+    {
+    console.print(topic);
+    console.print(" ");
+    console.write(frame.payload,head);
+    console.println(tail);
+    }
+  boolean ok=false;
+
+  uint32_t start=ESP.getCycleCount();
+  if (uplinkConnected()
+      && beginFramePublish(topic,head+tailLength,retain))
+    {
+    mqttClient.write((const uint8_t*)frame.payload,head);
+    mqttClient.write((const uint8_t*)tail,tailLength);
+    ok=mqttClient.endPublish();
+    metrics.record(STAGE_PUBLISH,ESP.getCycleCount()-start);
+    }
+  else
+    console.println("Can't publish, not connected to broker.");
+  return ok;
+  }
 
-boolean publish(char* topic, const char* reading, boolean retain)
+// Publish a JSON document as one message. It is serialized straight into the
+// MQTT client so no intermediate buffer is needed.
+boolean publishJson(char* topic, JsonDocument& json, boolean retain)
   {
   if (settings.debug)
     {
-    Serial.print(topic);
-    Serial.print(" ");
-    Serial.println(reading);
+    console.print(topic);
+    console.print(" ");
+    serializeJson(json, console);
+    console.println();
     }
   boolean ok=false;
-  connectToWiFi(); //just in case we're disconnected from WiFi
-  reconnect(); //also just in case we're disconnected from the broker
 
-  if (mqttClient.connected() && 
-      settings.mqttTopicRoot &&
-      WiFi.status()==WL_CONNECTED)
+  if (mqttClient.connected() && WiFi.status()==WL_CONNECTED)
     {
-    ok=mqttClient.publish(topic,reading,retain); 
+    uint32_t start=ESP.getCycleCount();
+    if (beginFramePublish(topic,measureJson(json),retain))
+      {
+      serializeJson(json,mqttClient);
+      ok=mqttClient.endPublish();
+      metrics.record(STAGE_PUBLISH,ESP.getCycleCount()-start);
+      }
     }
   else
     {
-    Serial.print("Can't publish due to ");
+    console.print("Can't publish due to ");
     if (WiFi.status()!=WL_CONNECTED)
-      Serial.println("no WiFi connection.");
+      console.println("no WiFi connection.");
     else if (!mqttClient.connected())
-      Serial.println("not connected to broker.");
+      console.println("not connected to broker.");
     }
   return ok;
   }
 
 
+// Commands that came in over MQTT, waiting to be run from loop()
+char mqttCommands[MQTT_COMMAND_QUEUE_LENGTH][MQTT_COMMAND_SIZE];
+int mqttCommandHead=0;
+int mqttCommandCount=0;
+unsigned long rebootTime=0; //when not zero, reboot once millis() gets here
+
+/**
+ * Handler for incoming MQTT messages. This is called from inside mqttClient.loop()
+ * so it only queues the command; processMqttCommands() runs it later.
+ */
+void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+  {
+  if (settings.debug)
+    {
+    console.println("====================================> Callback works.");
+    }
+  if (mqttCommandCount>=MQTT_COMMAND_QUEUE_LENGTH)
+    {
+    console.println("************ MQTT command queue is full, command ignored!");
+    return;
+    }
+  char* cmd=mqttCommands[(mqttCommandHead+mqttCommandCount)%MQTT_COMMAND_QUEUE_LENGTH];
+  if (length>MQTT_COMMAND_SIZE-1)
+    length=MQTT_COMMAND_SIZE-1;
+  memcpy(cmd,payload,length);
+  cmd[length]='\0';
+  mqttCommandCount++;
+  }
+
+// Run the oldest queued MQTT command, if there is one
+void processMqttCommands()
+  {
+  if (mqttCommandCount==0)
+    return;
+  char charbuf[MQTT_COMMAND_SIZE];
+  strcpy(charbuf,mqttCommands[mqttCommandHead]);
+  mqttCommandHead=(mqttCommandHead+1)%MQTT_COMMAND_QUEUE_LENGTH;
+  mqttCommandCount--;
+  handleMqttCommand(charbuf);
+  }
 
 /**
- * Handler for incoming MQTT messages.  The payload is the command to perform. 
+ * Perform a command that came in over MQTT.  The payload is the command to perform. 
  * The MQTT message topic sent is the topic root plus the command.
  * Implemented commands are: 
  * MQTT_PAYLOAD_SETTINGS_COMMAND: sends a JSON payload of all user-specified settings
  * MQTT_PAYLOAD_REBOOT_COMMAND: Reboot the controller
  * MQTT_PAYLOAD_VERSION_COMMAND Show the version number
  * MQTT_PAYLOAD_STATUS_COMMAND Show the most recent flow values
+ * MQTT_PAYLOAD_STORE_COMMAND Show the store and forward counters
+ * MQTT_PAYLOAD_NODES_COMMAND Show the statistics for each node we hear
+ * MQTT_PAYLOAD_DUPLICATES_COMMAND Show how many resent frames were not published
+ * MQTT_PAYLOAD_AIRTIME_COMMAND Show channel use and how the acks are doing
+ * MQTT_PAYLOAD_METRICS_COMMAND Show how long each part of handling a frame takes
+ * MQTT_PAYLOAD_RULES_COMMAND Show the filtering and routing rules
  */
-void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+void handleMqttCommand(char* charbuf) 
   {
-  if (settings.debug)
-    {
-    Serial.println("====================================> Callback works.");
-    }
-  payload[length]='\0'; //this should have been done in the calling code, shouldn't have to do it here
   boolean rebootScheduled=false; //so we can reboot after sending the reboot response
-  char charbuf[100];
-  sprintf(charbuf,"%s",payload);
-  const char* response;
+  boolean sendNodes=false; //the node table is streamed out instead of a response string
+  boolean sendMetrics=false; //so are the metrics
+  boolean sendRules=false; //and the rules
+  boolean sendSettings=false; //and the settings
+  const char* response="";
   
   
   //if the command is MQTT_PAYLOAD_SETTINGS_COMMAND, send all of the settings
   if (strcmp(charbuf,MQTT_PAYLOAD_SETTINGS_COMMAND)==0)
     {
-    char tempbuf[35]; //for converting numbers to strings
-    char jsonStatus[JSON_STATUS_SIZE];
-    
-    strcpy(jsonStatus,"{");
-    strcat(jsonStatus,"\"broker\":\"");
-    strcat(jsonStatus,settings.mqttBrokerAddress);
-    strcat(jsonStatus,"\", \"port\":");
-    sprintf(tempbuf,"%d",settings.mqttBrokerPort);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,", \"topicroot\":\"");
-    strcat(jsonStatus,settings.mqttTopicRoot);
-    strcat(jsonStatus,"\", \"user\":\"");
-    strcat(jsonStatus,settings.mqttUsername);
-    strcat(jsonStatus,"\", \"pass\":\"");
-    strcat(jsonStatus,settings.mqttPassword);
-    strcat(jsonStatus,"\", \"ssid\":\"");
-    strcat(jsonStatus,settings.ssid);
-    strcat(jsonStatus,"\", \"wifipass\":\"");
-    strcat(jsonStatus,settings.wifiPassword);
-    strcat(jsonStatus,"\", \"mqttClientId\":\"");
-    strcat(jsonStatus,settings.mqttClientId);
-    strcat(jsonStatus,"\", \"address\":\"");
-    strcat(jsonStatus,settings.address);
-    strcat(jsonStatus,"\", \"netmask\":\"");
-    strcat(jsonStatus,settings.netmask);
-
-    strcat(jsonStatus,"\", \"loRaAddress\":");
-    sprintf(tempbuf,"%d",settings.loRaAddress);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaBand\":");
-    sprintf(tempbuf,"%d",settings.loRaBand);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaBandwidth\":");
-    sprintf(tempbuf,"%d",settings.loRaBandwidth);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaCodingRate\":");
-    sprintf(tempbuf,"%d",settings.loRaCodingRate);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaNetworkID\":");
-    sprintf(tempbuf,"%d",settings.loRaNetworkID);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaSpreadingFactor\":");
-    sprintf(tempbuf,"%d",settings.loRaSpreadingFactor);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaPreamble\":");
-    sprintf(tempbuf,"%d",settings.loRaPreamble);
-    strcat(jsonStatus,tempbuf);
-    strcat(jsonStatus,"\", \"loRaBaudRate\":");
-    sprintf(tempbuf,"%d",settings.loRaBaudRate);
-    strcat(jsonStatus,tempbuf);
-   
-    strcat(jsonStatus,"\", \"debug\":\"");
-    strcat(jsonStatus,settings.debug?"true":"false");
-    strcat(jsonStatus,"\", \"IPAddress\":\"");
-    strcat(jsonStatus,wifiClient.localIP().toString().c_str());
-    
-    strcat(jsonStatus,"\"}");
-    response=jsonStatus;
+    sendSettings=true;
     }
   else if (strcmp(charbuf,MQTT_PAYLOAD_VERSION_COMMAND)==0) //show the version number
     {
-    char tmp[15];
-    strcpy(tmp,VERSION);
-    response=tmp;
+    response=VERSION;
     }
   else if (strcmp(charbuf,MQTT_PAYLOAD_STATUS_COMMAND)==0) //show the latest value
     {
-    report();
-    
-    char tmp[25];
-    strcpy(tmp,"Status report complete");
+    if (lastFrame.payload==nullptr)
+      response="No frames received yet";
+    else
+      {
+      loadFrame(lastFrame);
+      publishFrame(lastFrame); //republish only, the node that sent it isn't waiting for another ack
+      response="Status report complete";
+      }
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_STORE_COMMAND)==0) //show the store and forward counters
+    {
+    static char tmp[128]; //about 103 with every counter at its largest
+    snprintf(tmp,sizeof(tmp),
+            "{\"waiting\":%u,\"stored\":%lu,\"forwarded\":%lu,\"spilled\":%lu,\"dropped\":%lu}",
+            frameStore.count(),(unsigned long)frameStore.stored,(unsigned long)frameStore.forwarded,
+            (unsigned long)frameStore.spilled,(unsigned long)frameStore.dropped);
     response=tmp;
     }
-  else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
+  else if (strcmp(charbuf,MQTT_PAYLOAD_NODES_COMMAND)==0) //show the statistics for each node
+    {
+    sendNodes=true;
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_DUPLICATES_COMMAND)==0) //show the duplicate counter
+    {
+    static char tmp[80];
+    snprintf(tmp,sizeof(tmp),"{\"suppressed\":%lu,\"window\":%u,\"unchanged\":%lu}",
+            (unsigned long)duplicates.suppressed,settings.duplicateWindow,(unsigned long)deadband.suppressed);
+    response=tmp;
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_METRICS_COMMAND)==0) //show the timing metrics
+    {
+    sendMetrics=true;
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_RULES_COMMAND)==0) //show the rules and what they've done
+    {
+    sendRules=true;
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_AIRTIME_COMMAND)==0) //show channel utilisation, in percent
     {
-    char tmp[10];
-    strcpy(tmp,"REBOOTING");
+    static char tmp[160]; //about 155 with every counter at its largest
+    uint16_t channel=channelAirtime.permille();
+    uint16_t recent=recentAirtime.permille();
+    uint16_t acked=ackAirtime.permille();
+    snprintf(tmp,sizeof(tmp),
+            "{\"channel\":%u.%u,\"recent\":%u.%u,\"acks\":%u.%u,\"dutycycle\":%u.%u,\"held\":%lu,\"dropped\":%lu,"
+            "\"confirmed\":%lu,\"unconfirmed\":%lu}",
+            channel/10,channel%10,recent/10,recent%10,acked/10,acked%10,
+            settings.dutyCycle/10,settings.dutyCycle%10,
+            (unsigned long)acksHeld,(unsigned long)acksDropped,
+            (unsigned long)qosPublisher.confirmed,(unsigned long)qosPublisher.timedOut);
     response=tmp;
+    }
+  else if (strcmp(charbuf,MQTT_PAYLOAD_REBOOT_COMMAND)==0) //reboot the controller
+    {
+    response="REBOOTING";
     rebootScheduled=true;
     }
   else if (processCommand(charbuf))
@@ -857,23 +2262,28 @@ void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length)
     }
   else
     {
-    char badCmd[18];
-    strcpy(badCmd,"(empty)");
-    response=badCmd;
+    response="(empty)";
     }
     
-  char topic[MQTT_TOPIC_SIZE];
-  strcpy(topic,settings.mqttTopicRoot);
-  strcat(topic,charbuf); //the incoming command becomes the topic suffix
-
-  if (!publish(topic,response,false)) //do not retain
-    Serial.println("************ Failure when publishing status response!");
-    
-  delay(2000); //give publish time to complete
+  char* topic=topicFor(charbuf); //the incoming command becomes the topic suffix
+
+  boolean sent; //do not retain
+  if (sendNodes)
+    sent=publishNodes(topic,false,false);
+  else if (sendMetrics)
+    sent=publishMetrics(topic,false);
+  else if (sendRules)
+    sent=publishRules(topic,false);
+  else if (sendSettings)
+    sent=publishSettings(topic,false);
+  else
+    sent=publish(topic,response,false);
+  if (!sent)
+    console.println("************ Failure when publishing status response!");
   
   if (rebootScheduled)
     {
-    ESP.restart();
+    rebootTime=millis()+REBOOT_DELAY; //give the response time to get to the broker
     }
   }
 
@@ -885,118 +2295,68 @@ char* generateMqttClientId(char* mqttId)
   strcat(mqttId, String(random(0xffff), HEX).c_str());
   if (settings.debug)
     {
-    Serial.print("New MQTT userid is ");
-    Serial.println(mqttId);
+    console.print("New MQTT userid is ");
+    console.println(mqttId);
     }
   return mqttId;
   }
 
 
-void setup_wifi()
-  {
-  // WiFi connection setup code here
-  if (WiFi.status() != WL_CONNECTED)
-    {
-    Serial.print("Attempting to connect to WPA SSID \"");
-    Serial.print(settings.ssid);
-    Serial.println("\"");
-
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
-
-    if (ip.isSet()) //Go with a dynamic address if no valid IP has been entered
-      {
-      if (!WiFi.config(ip,ip,mask))
-        {
-        Serial.println("STA Failed to configure");
-        }
-      }
-
-    unsigned long connectTimeout = millis() + WIFI_TIMEOUT_SECONDS*1000; // 10 second timeout
-    WiFi.begin(settings.ssid, settings.wifiPassword);
-    while (WiFi.status() != WL_CONNECTED && millis() < connectTimeout) 
-      {
-      // not yet connected
-      // Serial.print(".");
-      // checkForCommand(); // Check for input in case something needs to be changed to work
-      delay(100);
-      }
-    
-    checkForCommand(); // Check for input in case something needs to be changed to work
-
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      Serial.println("Connection to network failed. ");
-      Serial.println();
-//      show("Wifi failed to \nconnect");
-      delay(3000);
-      }
-    else 
-      {
-      Serial.print("Connected to network with address ");
-      Serial.println(WiFi.localIP());
-      Serial.println();
-      queue(WiFi.localIP().toString());
-      }
-    }
-  } 
-
 /*
- * Reconnect to the MQTT broker
+ * Reconnect to the MQTT broker. This is called every time through loop() and
+ * makes at most one connection attempt. Failed attempts back off exponentially
+ * so a missing broker doesn't tie up the gateway.
  */
 void reconnect() 
   {
-  if (strlen(settings.mqttBrokerAddress)>0)
+  static unsigned long nextAttempt=0;
+  static unsigned long backoff=MQTT_BACKOFF_MIN;
+  static bool notSetShown=false;
+
+  if (strlen(settings.mqttBrokerAddress)==0)
     {
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      Serial.println("WiFi not ready, skipping MQTT connection");
-      }
-    else
-      {
-      // Loop until we're reconnected
-      while (!mqttClient.connected()) 
-        {
-        queue("Connecting\nto MQTT");    
-        Serial.print("Attempting MQTT connection...");
-
-        mqttClient.setBufferSize(JSON_STATUS_SIZE); //default (256) isn't big enough
-        mqttClient.setKeepAlive(120); //seconds
-        mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
-        mqttClient.setCallback(incomingMqttHandler);
-        
-        // Attempt to connect
-        if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword))
-          {
-          Serial.println("connected to MQTT broker.");
-          queue("Connected\nto MQTT");
-
-          //resubscribe to the incoming message topic
-          char topic[MQTT_TOPIC_SIZE];
-          strcpy(topic,settings.mqttTopicRoot);
-          strcat(topic,MQTT_TOPIC_COMMAND_REQUEST);
-          bool subgood=mqttClient.subscribe(topic);
-          showSub(topic,subgood);
-          }
-        else 
-          {
-          Serial.print("failed, rc=");
-          Serial.println(mqttClient.state());
-          Serial.println("Will try again in a second");
-          
-          // Wait a second before retrying
-          // In the meantime check for input in case something needs to be changed to make it work
-        //  checkForCommand(); 
-          
-          delay(1000);
-          }
-        checkForCommand();
-        }
-      mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
-      }
+    if (settings.debug && !notSetShown)
+      console.println("Broker address not set, ignoring MQTT");
+    notSetShown=true;
+    return;
     }
-  else if (settings.debug)
+  if (WiFi.status()!=WL_CONNECTED || mqttClient.connected())
+    return;
+  if ((long)(millis()-nextAttempt)<0)
+    return; //not time to try again yet
+
+  queue("Connecting\nto MQTT");    
+  console.print("Attempting MQTT connection...");
+
+  mqttClient.setBufferSize(MQTT_BUFFER_SIZE); //default (256) isn't big enough
+  mqttClient.setKeepAlive(120); //seconds
+  mqttClient.setSocketTimeout(MQTT_CONNECT_TIMEOUT); //seconds to wait for the broker to answer
+  wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT*1000); //ms to wait for the TCP connection
+  mqttClient.setServer(settings.mqttBrokerAddress, settings.mqttBrokerPort);
+  mqttClient.setCallback(incomingMqttHandler);
+  
+  // Attempt to connect
+  if (mqttClient.connect(settings.mqttClientId,settings.mqttUsername,settings.mqttPassword))
+    {
+    console.println("connected to MQTT broker.");
+    queue("Connected\nto MQTT");
+    backoff=MQTT_BACKOFF_MIN;
+    deadband.clear(); //the broker may have lost the retained values
+
+    //resubscribe to the incoming message topic
+    char* topic=topicFor(TOPIC_COMMAND);
+    bool subgood=mqttClient.subscribe(topic);
+    showSub(topic,subgood);
+    }
+  else 
     {
-    Serial.println("Broker address not set, ignoring MQTT");
+    console.print("failed, rc=");
+    console.println(mqttClient.state());
+    console.print("Will try again in ");
+    console.print(backoff/1000);
+    console.println(" seconds");
+    nextAttempt=millis()+backoff;
+    backoff=min(backoff*2,(unsigned long)MQTT_BACKOFF_MAX);
     }
   }
 
@@ -1004,15 +2364,19 @@ void showSub(char* topic, bool subgood)
   {
   if (settings.debug)
     {
-    Serial.print("++++++Subscribing to ");
-    Serial.print(topic);
-    Serial.print(":");
-    Serial.println(subgood);
+    console.print("++++++Subscribing to ");
+    console.print(topic);
+    console.print(":");
+    console.println(subgood);
     }
   }
 
 /*
  * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Writing flash erases a whole sector and holds everything up for a while, so
+ * this only notes that the settings have changed. serviceSettings() writes
+ * them once they've been left alone for SETTINGS_COMMIT_DELAY, so a batch of
+ * changes costs one write.
  */
 boolean saveSettings()
   {
@@ -1023,13 +2387,13 @@ boolean saveSettings()
       strlen(settings.mqttTopicRoot)>0 &&
       strlen(settings.mqttClientId)>0)
     {
-    Serial.println("Settings deemed complete");
+    console.println("Settings deemed complete");
     settings.validConfig=VALID_SETTINGS_FLAG;
     settingsAreValid=true;
     }
   else
     {
-    Serial.println("Settings still incomplete");
+    console.println("Settings still incomplete");
     settings.validConfig=0;
     settingsAreValid=false;
     }
@@ -1040,44 +2404,89 @@ boolean saveSettings()
     generateMqttClientId(settings.mqttClientId);
     }
     
+  settingsDirty=true;
+  settingsChangedAt=millis();
+  return true;
+  }
+
+// Write the settings to flash now, unless they are the same as what's there
+boolean commitSettings()
+  {
+  settingsDirty=false;
+  if (memcmp(EEPROM.getConstDataPtr(),&settings,sizeof(settings))==0)
+    {
+    if (settings.debug)
+      console.println("Settings unchanged, not writing eeprom");
+    return true;
+    }
   EEPROM.put(0,settings);
   if (settings.debug)
-    Serial.println("Committing settings to eeprom");
+    console.println("Committing settings to eeprom");
   return EEPROM.commit();
   }
 
-// populate the box struct from the received json
-void deserialize(StaticJsonDocument<250> &doc)
+// Write changed settings once nobody has touched them for a while
+void serviceSettings()
   {
-  boxStatus.address=doc["address"];
-  boxStatus.battery=doc["battery"];
-  boxStatus.distance=doc["distance"];
+  if (settingsDirty && millis()-settingsChangedAt>=SETTINGS_COMMIT_DELAY)
+    commitSettings();
   }
 
 void initLoRa()
   {
-  lora.begin(settings.loRaBaudRate);
-  lora.setJsonDocument(doc);
- 
-  Serial.println(lora.getMode());
-  Serial.println(lora.getBand());
-  Serial.println(lora.getParameter());
-  Serial.println(lora.getAddress());
-  Serial.println(lora.getNetworkID());
-  Serial.println(lora.getCPIN());
-  Serial.println(lora.getRFPower());
-  Serial.println(lora.getBaudRate()); 
+#ifdef LORA_HARDWARE_SERIAL
+  console.println("The console is moving to D4, which can't take commands. Use MQTT from here on.");
+  Serial1.begin(115200);
+  console.use(Serial1); //UART0 is the module's from here
+#endif
+#if LORA_RADIO_COUNT>1
+  const uint8_t rxPins[]=LORA_EXTRA_RX_PINS;
+  const uint8_t txPins[]=LORA_EXTRA_TX_PINS;
+  for (uint8_t radio=1; radio<LORA_RADIO_COUNT; radio++)
+    if (!radios[radio])
+      radios[radio]=new RYLR998(rxPins[radio-1],txPins[radio-1]);
+#endif
+  for (uint8_t radio=0; radio<LORA_RADIO_COUNT; radio++)
+    {
+    RYLR998& module=*radios[radio];
+    module.setChannel(radio);
+    module.setJsonDocument(doc); //only one frame is handled at a time, so they can share it
+    module.setAutoDecode(false); //handleFrame() decides whether a frame needs doc
+    module.setLogOutput(console);
+    if (!module.begin(settings.loRaBaudRate,LORA_PROBE_ATTEMPTS))
+      {
+      console.print("No response from RYLR998 "); //carry on, frames will come when it does
+      console.println(radio+1);
+      continue;
+      }
+    console.print("RYLR998 ");
+    console.print(radio+1);
+    console.println(" is working.");
+    configureLoRa(radio);
+
+    if (settings.debug) //the full sweep takes a while, so only when asked
+      {
+      console.println(module.getMode());
+      console.println(module.getBand());
+      console.println(module.getParameter());
+      console.println(module.getAddress());
+      console.println(module.getNetworkID());
+      console.println(module.getCPIN());
+      console.println(module.getRFPower());
+      console.println(module.getBaudRate()); 
+      }
+    }
  }
 
 
 void initSerial()
   {
-  Serial.begin(115200);
-  Serial.setTimeout(10000);
+  console.begin(115200);
+  console.setTimeout(10000);
+  lora.setLogOutput(console);
   
-  while (!Serial); // wait here for serial port to connect.
-  Serial.println();
-  Serial.println("Serial communications established.");
+  console.println();
+  console.println("Serial communications established.");
   }
 
 /*
@@ -1086,17 +2495,61 @@ void initSerial()
 void loadSettings()
   {
   EEPROM.get(0,settings);
+  setTopicRoot();
+  frameRules.begin(settings.rules);
+  if (!frameRules.isValid()) //never written, or by older firmware
+    frameRules.clear();
   if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
     {
     settingsAreValid=true;
+
+    //settings added after the EEPROM was last written will be garbage
+    if (settings.publishMode>PUBLISH_MODE_BOTH)
+      settings.publishMode=PUBLISH_MODE_FIELDS;
+    if (settings.spillToFlash>1)
+      settings.spillToFlash=0;
+    if (settings.nodeSummaryInterval==0xFFFF)
+      settings.nodeSummaryInterval=DEFAULT_NODE_SUMMARY_INTERVAL;
+    if (settings.duplicateWindow==0xFFFF)
+      settings.duplicateWindow=DEFAULT_DUPLICATE_WINDOW;
+    if (settings.decimals>FORMAT_MAX_DECIMALS)
+      settings.decimals=DEFAULT_DECIMALS;
+    if (settings.dutyCycle>1000)
+      settings.dutyCycle=DEFAULT_DUTY_CYCLE;
+    if (settings.metricsInterval==0xFFFF)
+      settings.metricsInterval=DEFAULT_METRICS_INTERVAL;
+    if (settings.publishQos>1)
+      settings.publishQos=DEFAULT_PUBLISH_QOS;
+    if (settings.lowPower>1)
+      settings.lowPower=0;
+    if (settings.loRaRxTime<LORA_SMART_TIME_MIN || settings.loRaRxTime>LORA_SMART_TIME_MAX)
+      settings.loRaRxTime=DEFAULT_LORA_RX_TIME;
+    if (settings.loRaSleepTime<LORA_SMART_TIME_MIN || settings.loRaSleepTime>LORA_SMART_TIME_MAX)
+      settings.loRaSleepTime=DEFAULT_LORA_SLEEP_TIME;
+    for (int radio=0; radio<LORA_MAX_RADIOS-1; radio++)
+      {
+      radioSettings& config=settings.extraRadios[radio];
+      if (config.band==0xFFFFFFFF || config.spreadingFactor>12 || config.bandwidth>9
+          || config.codingRate>4 || config.preamble<4)
+        defaultRadioSettings(config);
+      }
+    if (settings.changeOnly>1)
+      settings.changeOnly=0;
+    if (isnan(settings.deadband) || settings.deadband<0)
+      settings.deadband=DEFAULT_DEADBAND;
+    if (settings.deadbandPercent>100)
+      settings.deadbandPercent=DEFAULT_DEADBAND_PERCENT;
+    if (settings.heartbeat==0xFFFF)
+      settings.heartbeat=DEFAULT_HEARTBEAT;
+    setDeadband();
     if (settings.debug)
       {
-      Serial.println("\nLoaded configuration values from EEPROM");
+      console.println("\nLoaded configuration values from EEPROM");
       }
     }
   else
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
+    console.println("Skipping load from EEPROM, device not configured.");    
     settingsAreValid=false;
     }
     showSettings();
@@ -1111,78 +2564,122 @@ void initSettings()
   loadSettings(); //set the values from eeprom 
 
   //show the MAC address
-  Serial.print("ESP8266 MAC Address: ");
-  Serial.println(WiFi.macAddress());
+  console.print("ESP8266 MAC Address: ");
+  console.println(WiFi.macAddress());
 
   if (settings.mqttBrokerPort < 0) //then this must be the first powerup
     {
-    Serial.println("\n*********************** Resetting All EEPROM Values ************************");
+    console.println("\n*********************** Resetting All EEPROM Values ************************");
     initializeSettings();
     saveSettings();
+    commitSettings();
     delay(2000);
     ESP.restart();
     }
   }
 
+// These are set by the WiFi event handlers and picked up in connectToWiFi()
+volatile bool wifiGotIP=false;
+volatile bool wifiLost=false;
+WiFiEventHandler gotIPHandler;
+WiFiEventHandler disconnectedHandler;
+
 /*
- * If not connected to wifi, connect.
+ * If not connected to wifi, connect. This is called every time through loop()
+ * and never waits; the WiFi events tell us when the connection comes up or
+ * goes away.
  */
 void connectToWiFi()
   {
-  if (settingsAreValid && WiFi.status() != WL_CONNECTED)
-    {
-    queue("Connecting\nto WiFi");
-    Serial.print("Attempting to connect to WPA SSID \"");
-    Serial.print(settings.ssid);
-    Serial.println("\"");
+  static wifiState state=WIFI_STATE_IDLE;
+  static unsigned long stateTime=0;
 
-//    WiFi.forceSleepWake(); //turn on the radio
-//    delay(1);              //return control to let it come on
-    
-    WiFi.persistent(false);  // Disables saving WiFi config to flash
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+  if (!settingsAreValid)
+    return;
 
-    if (ip.isSet()) //Go with a dynamic address if no valid IP has been entered
+  if (wifiLost)
+    {
+    wifiLost=false;
+    if (state==WIFI_STATE_CONNECTED)
       {
-      if (!WiFi.config(ip,ip,mask))
-        {
-        Serial.println("STA Failed to configure");
-        }
+      console.println("Lost WiFi connection.");
+      queue("WiFi Lost");
+      state=WIFI_STATE_CONNECTING; //the SDK will keep trying to reconnect
+      stateTime=millis();
       }
+    }
 
-    unsigned long connectTimeout = millis() + WIFI_TIMEOUT_SECONDS*1000; // 10 second timeout
-    WiFi.begin(settings.ssid, settings.wifiPassword);
-    delay(1000);
-    while (WiFi.status() != WL_CONNECTED && millis() < connectTimeout) 
+  if (wifiGotIP)
+    {
+    wifiGotIP=false;
+    state=WIFI_STATE_CONNECTED;
+    console.print("\nConnected to network with address ");
+    console.println(WiFi.localIP());
+    console.println();
+    // if this is just turning on, reshow the last message except smaller
+    if (!rssiShowing)
       {
-      // not yet connected
-      // Serial.print(".");
-      // checkForCommand(); // Check for input in case something needs to be changed to work
-      Serial.print(".");
-      checkForCommand();
-      delay(500);
+      rssiShowing=true;
+      show(lastMessage);
       }
-    
-    checkForCommand(); // Check for input in case something needs to be changed to work
+    queue("Connected\nTo Wifi");
+    }
 
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      Serial.println("\nConnection to network failed. ");
-      delay(3000);
-      }
-    else 
-      {
-      Serial.print("\nConnected to network with address ");
-      Serial.println(WiFi.localIP());
-      Serial.println();
-          // if this is just turning on, reshow the last message except smaller
-      if (!rssiShowing)
+  switch (state)
+    {
+    case WIFI_STATE_IDLE:
+      queue("Connecting\nto WiFi");
+      console.print("Attempting to connect to WPA SSID \"");
+      console.print(settings.ssid);
+      console.println("\"");
+
+      if (!gotIPHandler)
+        {
+        gotIPHandler=WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP& event)
+          {
+          wifiGotIP=true;
+          });
+        disconnectedHandler=WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected& event)
+          {
+          wifiLost=true;
+          });
+        }
+
+      WiFi.persistent(false);  // Disables saving WiFi config to flash
+      WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+      WiFi.setAutoReconnect(true);
+      setWiFiSleep();
+
+      if (ip.isSet()) //Go with a dynamic address if no valid IP has been entered
         {
-        rssiShowing=true;
-        show(lastMessage);
+        if (!WiFi.config(ip,ip,mask))
+          {
+          console.println("STA Failed to configure");
+          }
         }
-      queue("Connected\nTo Wifi");
-      }
+
+      WiFi.begin(settings.ssid, settings.wifiPassword);
+      state=WIFI_STATE_CONNECTING;
+      stateTime=millis();
+      break;
+
+    case WIFI_STATE_CONNECTING:
+      if (millis()-stateTime>WIFI_TIMEOUT_SECONDS*1000UL)
+        {
+        console.println("\nConnection to network failed. ");
+        WiFi.disconnect();
+        state=WIFI_STATE_WAITING;
+        stateTime=millis();
+        }
+      break;
+
+    case WIFI_STATE_WAITING: //give it a rest before starting over
+      if (millis()-stateTime>WIFI_RETRY_DELAY)
+        state=WIFI_STATE_IDLE;
+      break;
+
+    case WIFI_STATE_CONNECTED:
+      break;
     }
   }
 
@@ -1192,14 +2689,15 @@ void initDisplay()
 
   if (settings.debug)
     {
-    Serial.println("Initializing display");
+    console.println("Initializing display");
     }
   if(!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS)) 
     {
-    Serial.println(F("SSD1306 allocation failed"));
+    console.println(F("SSD1306 allocation failed"));
     delay(5000);
     ESP.reset();  //try again
     }
+  Wire.setClock(OLED_I2C_CLOCK); //SSD1306 is good for 400kHz
   display.setRotation(settings.invertdisplay?2:0); //make it look right
   display.clearDisplay();       //no initial logo
   display.setTextSize(3);      // Normal 1:1 pixel scale
@@ -1211,100 +2709,164 @@ void initDisplay()
     show("Init");
   }
 
-//show the next message in the message queue
+//show the next message in the message queue, each for at least a second
 void showMessages()
   {
-  static unsigned long nextTime=millis();
-  if (millis() >= nextTime)
+  static unsigned long shownAt=0;
+  if (millis()-shownAt<1000 || messages.isEmpty())
+    return; //the next one goes up as soon as it arrives, if the last has had its second
+  char text[MESSAGE_SIZE];
+  messages.pop(text,sizeof(text));
+  show(text);
+  shownAt=millis();
+  showListeningStatus=millis()+5000;
+  }
+
+
+// Keep the download going, a chunk at a time. Once the new firmware has
+// checked out, reboot into it as soon as nothing is waiting on us, or after
+// UPDATE_DRAIN_TIMEOUT if the broker isn't taking the stored frames.
+void serviceFirmwareUpdate()
+  {
+  static unsigned long verifiedAt=0;
+  bool wasRunning=firmwareUpdate.running();
+  firmwareUpdate.service();
+  if (wasRunning && !firmwareUpdate.running())
+    {
+    queue(firmwareUpdate.state()==UPDATE_VERIFIED?"Update OK":"Update Fail");
+    verifiedAt=millis();
+    }
+  if (firmwareUpdate.state()!=UPDATE_VERIFIED || rebootTime!=0)
+    return;
+  bool drained=frameStore.isEmpty() && ackCount==0 && qosPublisher.inFlight()==0;
+  if (drained || millis()-verifiedAt>=UPDATE_DRAIN_TIMEOUT)
+    {
+    console.println("********** Rebooting into the new firmware ************");
+    rebootTime=millis()+REBOOT_DELAY;
+    }
+  }
+
+
+// Everything that needs complete settings. Done at boot if they are, or
+// else as soon as the first time setup on the console completes them.
+void startGateway()
+  {
+  static bool started=false;
+  if (started)
+    return;
+  started=true;
+
+  //initialize everything
+  initDisplay();
+
+  console.println("Initializing LoRa module");
+  initLoRa();
+
+  if (settings.debug)
     {
-    nextTime=millis()+1000; //one second per message
-    if (++showHeadPointer >= SHOWBUF_LENGTH)
-      showHeadPointer=0; //don't overflow it
-    if (showbuffer[showHeadPointer][0]!='\0') //must be something here
+    if (!ip.fromString(settings.address))
       {
-      show(showbuffer[showHeadPointer]);
-      showbuffer[showHeadPointer][0]='\0'; //clear it out
-      showListeningStatus=millis()+5000;
+      console.println("IP Address "+String(settings.address)+" is not valid. Using dynamic addressing.");
+      // settingsAreValid=false;
+      // settings.validConfig=false;
+      }
+    else if (!mask.fromString(settings.netmask))
+      {
+      console.println("Network mask "+String(settings.netmask)+" is not valid.");
+      // settingsAreValid=false;
+      // settings.validConfig=false;
       }
     }
   }
 
-
 void setup()
   {
+#ifndef LORA_HARDWARE_SERIAL //the LED shares GPIO2 with the UART1 console
   pinMode(LED_BUILTIN,OUTPUT);// The blue light on the board shows LoRa message
+#endif
   initSerial();
 
   initSettings();
+  frameStore.begin(settings.spillToFlash==1,console);
+  replay.setLogOutput(console);
+  firmwareUpdate.setLogOutput(console);
 
   if (settingsAreValid)
-    {      
-    //initialize everything
-    initDisplay();
-
-    Serial.println("Initializing LoRa module");
-    initLoRa();
-
-    if (settings.debug)
-      {
-      if (!ip.fromString(settings.address))
-        {
-        Serial.println("IP Address "+String(settings.address)+" is not valid. Using dynamic addressing.");
-        // settingsAreValid=false;
-        // settings.validConfig=false;
-        }
-      else if (!mask.fromString(settings.netmask))
-        {
-        Serial.println("Network mask "+String(settings.netmask)+" is not valid.");
-        // settingsAreValid=false;
-        // settings.validConfig=false;
-        }
-      }
-    }
+    startGateway();
   //showSettings();
-  if (lora.testComm())
-    Serial.println("RYLR998 is working.");
-  else
-    Serial.println("No response from RYLR998");
+  console.print("Listening ");
+  console.print(millis());
+  console.println(" ms after reset");
   }
 
 void loop()
   {
+  uint32_t loopStart=ESP.getCycleCount();
+#ifndef LORA_HARDWARE_SERIAL //the LED shares GPIO2 with the UART1 console
   static ulong ledOffTime=0;
   if (ledOffTime>millis())
     digitalWrite(LED_BUILTIN,LED_ON); //show a message came in
   else
     digitalWrite(LED_BUILTIN,LED_OFF); //show no message
+#endif
   
   if (showListeningStatus<millis())
     show(""); //don't wear out the display
 
   if (settingsAreValid)
     {      
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      connectToWiFi();
-      }
-    if (!mqttClient.connected() && WiFi.status() == WL_CONNECTED)
-     {
-      reconnect();
-      }
-
-    if (lora.handleIncoming()) 
+    startGateway(); //only does something the first time
+    connectToWiFi(); //these only do something when they need to, and never wait
+    reconnect();
+
+    // drain whatever frames have queued up, taking the modules in turn so a
+    // busy one can't starve the others, and don't starve everything else
+    static uint8_t nextRadio=0;
+    uint8_t quiet=0; //modules in a row with nothing waiting
+    for (int frames=0; frames<MAX_FRAMES_PER_LOOP && quiet<LORA_RADIO_COUNT; )
       {
+      RYLR998* radio=radios[nextRadio];
+      nextRadio=(nextRadio+1)%LORA_RADIO_COUNT;
+      if (!radio || !radio->handleIncoming())
+        {
+        quiet++;
+        continue;
+        }
+      quiet=0;
+      frames++;
+      metrics.record(STAGE_LINE,radio->lineCycles());
+      metrics.record(STAGE_PARSE,radio->parseCycles());
+#ifndef LORA_HARDWARE_SERIAL
       ledOffTime=millis()+1000; //turns on LED to indicate message has arrived
+#endif
       showListeningStatus=millis()+5000; //how long to leave stuff on the display
-      report();
+      handleFrame(*radio);
       }
+    serviceReplay();
+    sendAcks();
+    forwardStoredFrames();
+    publishNodeSummary();
+    publishMetricsReport();
     // else
     //   {
     //   ack(false);
     //   }
     mqttClient.loop();
+    servicePubacks();
+    processMqttCommands();
+    serviceFirmwareUpdate();
+    }
+  serviceSettings();
+  if (rebootTime!=0 && (long)(millis()-rebootTime)>=0)
+    {
+    commitSettings(); //don't lose a change made just before the reboot command
+    ESP.restart();
     }
   yield();
   checkForCommand();
   showMessages();
+  metrics.record(STAGE_LOOP,ESP.getCycleCount()-loopStart);
+  lowPowerIdle(); //after the timing, it's not work
   }
 
 /*
@@ -1314,10 +2876,10 @@ void loop()
 */
 void incomingSerialData() 
   {
-  while (Serial.available()) 
+  while (console.available()) 
     {
-    char inChar = (char)Serial.read(); // get the new byte
-    Serial.print(inChar); //echo it back to the terminal
+    char inChar = (char)console.read(); // get the new byte
+    console.print(inChar); //echo it back to the terminal
 
     // if the incoming character is a newline, set a flag so the main loop can
     // do something about it 
@@ -0,0 +1,317 @@
+/* Benchmark of the receive pipeline, built and run on the build machine.
+ *
+ *   pio run -e native -t exec
+ * or, once built,
+ *   .pio/build/native/program [-v] [-g <ms>] [-s "<settings>"] [-b <baseline>]
+ *                             [-a <allocations>] [-l <us>] [-r <frames/s>] [<trace>]
+ *
+ * The whole gateway is built as it is, against the shims in shims/, with a
+ * stand-in RYLR998 behind SoftwareSerial and a broker that takes everything.
+ * Each +RCV line of the trace (test/native/replay.txt unless another is
+ * given, in the same form as the replay file) is handed to the module and
+ * loop() is run until it has been read, published and acked. Reported are
+ * the frames per second, the allocations per frame and the worst time from
+ * the line arriving to the gateway being done with it.
+ *
+ * Allocations are counted by replacing operator new and, with glibc, malloc
+ * as well, so the String and std library calls in the shims count too. They
+ * only count while a frame is being handled. An allocation in steady state
+ * is one the ESP8266 pays for in heap fragmentation.
+ *
+ * -s takes settings in the same form as on the console, like
+ * "publishmode=1;changeonly=1", applied after the ones the benchmark needs.
+ * -g is the time between frames on the shims' clock, 1000ms unless given.
+ * Only the clock moves on, the benchmark doesn't wait, but acks are held
+ * back while the channel has been busy, so frames can't come closer
+ * together than a real channel would let them.
+ * -v shows the console.
+ *
+ * The figures are checked against the budgets in test/native/baseline.txt,
+ * or the file given with -b: the most allocations in any frame, the worst
+ * latency in microseconds and the lowest frames/s. -a, -l and -r override
+ * them for the run. Without a baseline file any allocation still fails it.
+ *
+ * Exits with 1 if a budget was exceeded, a streamed publish didn't send the
+ * length it announced or a frame was never finished, which is to be
+ * expected when a low dutycycle= or a short -g holds acks back. Worth
+ * running with -s "publishmode=2", "changeonly=1;qos=1" and "dupwindow=0"
+ * as well as the defaults before a change goes in.
+ */
+
+#include <Arduino.h>
+#include <new>
+#include <chrono>
+#include <vector>
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+#include <EEPROM.h>
+#include <ArduinoJson.h>
+#include <Adafruit_SSD1306.h>
+#include <Adafruit_GFX.h>
+#include <SoftwareSerial.h>
+#include "RYLR998.h"
+#include "FrameStore.h"
+#include "NodeTable.h"
+#include "DuplicateCache.h"
+#include "ValueFormat.h"
+#include "JsonScanner.h"
+#include "Airtime.h"
+#include "Metrics.h"
+#include "Replay.h"
+#include "QosPublisher.h"
+#include "FrameRules.h"
+#include "Deadband.h"
+#include "SettingsTable.h"
+#include "ByteCounter.h"
+#include "MessageQueue.h"
+#include "FirmwareUpdate.h"
+#include "ConsolePort.h"
+#include "lora2mqtt.h"
+
+#define BENCH_TRACE "test/native/replay.txt"
+#define BENCH_SETTINGS "ssid=bench;wifipass=bench;broker=broker.local;topicroot=bench/"
+#define BENCH_FRAME_GAP 1000 //ms between frames unless -g says otherwise
+#define BENCH_MAX_PASSES 100 //passes through loop() a frame may take before it is given up on
+#define BENCH_LINE_SIZE 512
+#define BENCH_BASELINE "test/native/baseline.txt"
+
+// What a run may cost before it fails, 0 for no limit on latency and rate
+typedef struct
+  {
+  double allocations; //most in any one frame
+  double latency;     //worst, in us
+  double rate;        //frames/s, at least
+  } benchBudget;
+
+extern RYLR998 lora;
+extern PubSubClient mqttClient;
+extern WiFiClient wifiClient; //where QoS 1 publishes go
+extern QosPublisher qosPublisher;
+extern int ackCount;
+
+static bool counting=false;
+static unsigned long allocations=0;
+
+static void* counted(void* block)
+  {
+  if (counting && block)
+    allocations++;
+  return block;
+  }
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* block, size_t size);
+extern "C" void __libc_free(void* block);
+
+extern "C" void* malloc(size_t size) {return counted(__libc_malloc(size));}
+extern "C" void* calloc(size_t count, size_t size) {return counted(__libc_calloc(count,size));}
+extern "C" void* realloc(void* block, size_t size) {return counted(__libc_realloc(block,size));}
+extern "C" void free(void* block) {__libc_free(block);}
+
+static void* allocate(size_t size) {return __libc_malloc(size?size:1);}
+static void release(void* block) {__libc_free(block);}
+#else
+static void* allocate(size_t size) {return counted(malloc(size?size:1));}
+static void release(void* block) {free(block);}
+#endif
+
+void* operator new(size_t size)
+  {
+  void* block=allocate(size);
+  if (!block)
+    throw std::bad_alloc();
+  return counted(block);
+  }
+
+void* operator new[](size_t size) {return operator new(size);}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {return counted(allocate(size));}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {return counted(allocate(size));}
+void operator delete(void* block) noexcept {release(block);}
+void operator delete[](void* block) noexcept {release(block);}
+void operator delete(void* block, size_t) noexcept {release(block);}
+void operator delete[](void* block, size_t) noexcept {release(block);}
+
+// Read, published and acked, with nothing left waiting on the module or the broker
+static bool finished(SoftwareSerial* module)
+  {
+  return module->idle() && !lora.commandPending() && ackCount==0 && qosPublisher.inFlight()==0;
+  }
+
+// Read name=value lines into the budget, ignoring # comments. Returns false
+// if the file can't be read.
+static bool readBaseline(const char* path, benchBudget& budget)
+  {
+  FILE* file=fopen(path,"r");
+  if (!file)
+    return false;
+  char line[BENCH_LINE_SIZE];
+  while (fgets(line,sizeof(line),file))
+    {
+    line[strcspn(line,"#\r\n")]='\0';
+    char* value=strchr(line,'=');
+    if (!value)
+      continue;
+    *value++='\0';
+    char* name=line+strspn(line," \t");
+    name[strcspn(name," \t")]='\0';
+    if (strcmp(name,"allocations")==0)
+      budget.allocations=atof(value);
+    else if (strcmp(name,"latency")==0)
+      budget.latency=atof(value);
+    else if (strcmp(name,"rate")==0)
+      budget.rate=atof(value);
+    else
+      fprintf(stderr,"Unknown budget \"%s\" in %s\n",name,path);
+    }
+  fclose(file);
+  return true;
+  }
+
+static bool apply(const char* settings)
+  {
+  char command[BENCH_LINE_SIZE];
+  strlcpy(command,settings,sizeof(command));
+  if (processCommand(command))
+    return true;
+  fprintf(stderr,"Settings not taken: %s\n",settings);
+  return false;
+  }
+
+int main(int argc, char** argv)
+  {
+  const char* trace=BENCH_TRACE;
+  const char* extra=nullptr;
+  unsigned long gap=BENCH_FRAME_GAP;
+  const char* baseline=nullptr;
+  double allocationLimit=-1, latencyLimit=-1, rateLimit=-1; //from the command line, if given
+  for (int i=1; i<argc; i++)
+    {
+    if (strcmp(argv[i],"-v")==0)
+      Serial.echoTo(stdout);
+    else if (strcmp(argv[i],"-b")==0 && i+1<argc)
+      baseline=argv[++i];
+    else if (strcmp(argv[i],"-a")==0 && i+1<argc)
+      allocationLimit=atof(argv[++i]);
+    else if (strcmp(argv[i],"-l")==0 && i+1<argc)
+      latencyLimit=atof(argv[++i]);
+    else if (strcmp(argv[i],"-r")==0 && i+1<argc)
+      rateLimit=atof(argv[++i]);
+    else if (strcmp(argv[i],"-g")==0 && i+1<argc)
+      gap=strtoul(argv[++i],nullptr,10);
+    else if (strcmp(argv[i],"-s")==0 && i+1<argc)
+      extra=argv[++i];
+    else
+      trace=argv[i];
+    }
+
+  benchBudget budget={0,0,0};
+  if (!readBaseline(baseline?baseline:BENCH_BASELINE,budget) && baseline)
+    {
+    fprintf(stderr,"Can't open %s\n",baseline);
+    return 1;
+    }
+  if (allocationLimit>=0)
+    budget.allocations=allocationLimit;
+  if (latencyLimit>=0)
+    budget.latency=latencyLimit;
+  if (rateLimit>=0)
+    budget.rate=rateLimit;
+
+  FILE* file=fopen(trace,"r");
+  if (!file)
+    {
+    fprintf(stderr,"Can't open %s\n",trace);
+    return 1;
+    }
+  std::vector<std::string> lines;
+  char line[BENCH_LINE_SIZE];
+  while (fgets(line,sizeof(line),file))
+    {
+    line[strcspn(line,"\r\n")]='\0';
+    if (strncmp(line,"+RCV=",5)==0)
+      lines.push_back(line);
+    }
+  fclose(file);
+  if (lines.empty())
+    {
+    fprintf(stderr,"No +RCV lines in %s\n",trace);
+    return 1;
+    }
+
+  setup();
+  initializeSettings(); //the EEPROM starts out empty, this gives it the defaults
+  if (!apply(BENCH_SETTINGS) || (extra && !apply(extra)))
+    return 1;
+  for (int i=0; i<BENCH_MAX_PASSES && !(mqttClient.connected() && SoftwareSerial::opened[0]); i++)
+    loop();
+  SoftwareSerial* module=SoftwareSerial::opened[0];
+  if (!module || !mqttClient.connected())
+    {
+    fprintf(stderr,"The gateway didn't get going\n");
+    return 1;
+    }
+  for (int i=0; i<BENCH_MAX_PASSES && !finished(module); i++)
+    loop();
+
+  unsigned long messages=mqttClient.messages+wifiClient.published;
+  unsigned long bytes=mqttClient.payloadBytes+wifiClient.payloadBytes;
+  unsigned long total=0;    //allocations over all frames
+  unsigned long most=0;     //in the frame with the most
+  unsigned long unfinished=0;
+  double worst=0, sum=0;    //microseconds per frame
+  auto started=std::chrono::steady_clock::now();
+  for (const std::string& rcv:lines)
+    {
+    advanceClock(gap);
+    allocations=0;
+    counting=true;
+    auto arrived=std::chrono::steady_clock::now();
+    module->receive(rcv.c_str());
+    int passes=0;
+    do
+      loop();
+    while (++passes<BENCH_MAX_PASSES && !finished(module));
+    double took=std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now()-arrived).count();
+    counting=false;
+    if (passes>=BENCH_MAX_PASSES)
+      unfinished++;
+    total+=allocations;
+    most=max(most,allocations);
+    sum+=took;
+    worst=max(worst,took);
+    }
+  double seconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-started).count();
+
+  size_t frames=lines.size();
+  printf("Trace           %s\n",trace);
+  printf("Frames          %zu\n",frames);
+  printf("Frames/s        %.0f\n",frames/seconds);
+  printf("Allocations     %.2f per frame, %lu at most\n",(double)total/frames,most);
+  printf("Latency         %.1f us mean, %.1f us worst\n",sum/frames,worst);
+  printf("MQTT            %lu messages, %lu payload bytes\n",
+         mqttClient.messages+wifiClient.published-messages,mqttClient.payloadBytes+wifiClient.payloadBytes-bytes);
+  if (mqttClient.badLengths)
+    printf("*** %lu streamed publishes didn't send the length they announced\n",mqttClient.badLengths);
+  if (unfinished)
+    printf("*** %lu frames weren't finished in %d passes through loop()\n",unfinished,BENCH_MAX_PASSES);
+
+  bool over=false;
+  if (most>budget.allocations)
+    {
+    printf("*** %lu allocations in one frame, the budget is %.0f\n",most,budget.allocations);
+    over=true;
+    }
+  if (budget.latency>0 && worst>budget.latency)
+    {
+    printf("*** Worst latency %.1f us, the budget is %.0f us\n",worst,budget.latency);
+    over=true;
+    }
+  if (budget.rate>0 && frames/seconds<budget.rate)
+    {
+    printf("*** %.0f frames/s, the budget is at least %.0f\n",frames/seconds,budget.rate);
+    over=true;
+    }
+  return over || mqttClient.badLengths || unfinished?1:0;
+  }
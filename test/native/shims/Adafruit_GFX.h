@@ -0,0 +1,47 @@
+#ifndef ADAFRUIT_GFX_H
+#define ADAFRUIT_GFX_H
+
+#include <Arduino.h>
+#include <algorithm>
+
+// Keeps a frame buffer, so code that looks at it works, but draws nothing in it
+class Adafruit_GFX: public Print
+    {
+    public:
+        Adafruit_GFX(int16_t width, int16_t height) : _width(width), _height(height) {}
+        void setCursor(int16_t, int16_t) {}
+        void setTextSize(uint8_t) {}
+        void setTextColor(uint16_t) {}
+        void setTextColor(uint16_t, uint16_t) {}
+        void setTextWrap(bool) {}
+        void cp437(bool=true) {}
+        void setRotation(uint8_t rotation) {_rotation=rotation;}
+        uint8_t getRotation() const {return _rotation;}
+        int16_t width() const {return _width;}
+        int16_t height() const {return _height;}
+        void drawPixel(int16_t, int16_t, uint16_t) {}
+        void drawCircle(int16_t, int16_t, int16_t, uint16_t) {}
+        void fillCircle(int16_t, int16_t, int16_t, uint16_t) {}
+        void fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+        void drawBitmap(int16_t, int16_t, const uint8_t*, int16_t, int16_t, uint16_t) {}
+        using Print::write;
+        size_t write(uint8_t) override {return 1;}
+
+    protected:
+        int16_t _width;
+        int16_t _height;
+        uint8_t _rotation=0;
+    };
+
+class GFXcanvas1: public Adafruit_GFX
+    {
+    public:
+        GFXcanvas1(uint16_t width, uint16_t height) : Adafruit_GFX(width,height), _buffer((width+7)/8*height,0) {}
+        uint8_t* getBuffer() {return _buffer.data();}
+        void fillScreen(uint16_t colour) {std::fill(_buffer.begin(),_buffer.end(),colour?0xFF:0);}
+
+    private:
+        std::basic_string<uint8_t> _buffer;
+    };
+
+#endif // ADAFRUIT_GFX_H
@@ -0,0 +1,29 @@
+#ifndef ADAFRUIT_SSD1306_H
+#define ADAFRUIT_SSD1306_H
+
+#include <Adafruit_GFX.h>
+#include <Wire.h>
+
+#define SSD1306_BLACK 0
+#define SSD1306_WHITE 1
+#define SSD1306_SWITCHCAPVCC 0x02
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_COLUMNADDR 0x21
+
+class Adafruit_SSD1306: public Adafruit_GFX
+    {
+    public:
+        Adafruit_SSD1306(uint8_t width, uint8_t height, TwoWire*, int8_t, uint32_t=400000UL, uint32_t=100000UL)
+            : Adafruit_GFX(width,height), _buffer(width*((height+7)/8),0) {}
+        bool begin(uint8_t, uint8_t, bool=true, bool=true) {return true;}
+        void clearDisplay() {std::fill(_buffer.begin(),_buffer.end(),0);}
+        void display() {}
+        void dim(bool) {}
+        void ssd1306_command(uint8_t) {}
+        uint8_t* getBuffer() {return _buffer.data();}
+
+    private:
+        std::basic_string<uint8_t> _buffer;
+    };
+
+#endif // ADAFRUIT_SSD1306_H
@@ -0,0 +1,201 @@
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial(0);
+HardwareSerial Serial1(1);
+EspClass ESP;
+
+static const auto bootTime=std::chrono::steady_clock::now();
+static std::chrono::nanoseconds skipped(0); //by advanceClock()
+
+static std::chrono::nanoseconds sinceBoot()
+    {
+    return std::chrono::steady_clock::now()-bootTime+skipped;
+    }
+
+void advanceClock(unsigned long ms)
+    {
+    skipped+=std::chrono::milliseconds(ms);
+    }
+
+unsigned long millis()
+    {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(sinceBoot()).count();
+    }
+
+unsigned long micros()
+    {
+    return std::chrono::duration_cast<std::chrono::microseconds>(sinceBoot()).count();
+    }
+
+void delay(unsigned long ms)
+    {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    }
+
+void delayMicroseconds(unsigned int us)
+    {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+
+void yield() {}
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) {return LOW;}
+int analogRead(uint8_t) {return 0;}
+long random(long high) {return high>0?rand()%high:0;}
+long random(long low, long high) {return high>low?low+rand()%(high-low):low;}
+void randomSeed(unsigned long seed) {srand(seed);}
+
+uint32_t EspClass::getCycleCount()
+    {
+    uint64_t ns=std::chrono::duration_cast<std::chrono::nanoseconds>(sinceBoot()).count();
+    return (uint32_t)(ns*getCpuFreqMHz()/1000);
+    }
+
+void EspClass::restart()
+    {
+    fprintf(stderr,"ESP.restart() called, stopping\n");
+    exit(2);
+    }
+
+#ifndef NATIVE_HAS_STRLCPY
+extern "C" size_t strlcpy(char* destination, const char* source, size_t size)
+    {
+    size_t length=strlen(source);
+    if (size>0)
+        {
+        size_t n=length<size-1?length:size-1;
+        memcpy(destination,source,n);
+        destination[n]='\0';
+        }
+    return length;
+    }
+
+extern "C" size_t strlcat(char* destination, const char* source, size_t size)
+    {
+    size_t used=strnlen(destination,size);
+    if (used==size)
+        return size+strlen(source);
+    return used+strlcpy(destination+used,source,size-used);
+    }
+#endif
+
+char* dtostrf(double value, signed char width, unsigned char decimals, char* buffer)
+    {
+    sprintf(buffer,"%*.*f",width,decimals,value);
+    return buffer;
+    }
+
+String::String(double value, unsigned char decimals)
+    {
+    char text[40];
+    snprintf(text,sizeof(text),"%.*f",decimals,value);
+    _s=text;
+    }
+
+std::string String::_number(long long value, unsigned char base)
+    {
+    char text[72];
+    if (base==HEX)
+        snprintf(text,sizeof(text),"%llx",(unsigned long long)value);
+    else
+        snprintf(text,sizeof(text),"%lld",value);
+    return text;
+    }
+
+void String::trim()
+    {
+    size_t start=_s.find_first_not_of(" \t\r\n");
+    size_t end=_s.find_last_not_of(" \t\r\n");
+    _s=start==std::string::npos?std::string():_s.substr(start,end-start+1);
+    }
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+    {
+    size_t n=0;
+    while (size--)
+        n+=write(*buffer++);
+    return n;
+    }
+
+size_t Print::print(long long value, int base)
+    {
+    if (value<0 && base==DEC)
+        return print('-')+print((unsigned long long)-value,base);
+    return print((unsigned long long)value,base);
+    }
+
+size_t Print::print(unsigned long long value, int base)
+    {
+    char text[72];
+    char* at=text+sizeof(text)-1;
+    *at='\0';
+    if (base<2)
+        base=DEC;
+    do
+        {
+        int digit=value%base;
+        *--at=digit<10?'0'+digit:'A'+digit-10;
+        value/=base;
+        } while (value);
+    return write(at);
+    }
+
+size_t Print::print(double value, int decimals)
+    {
+    char text[48];
+    if (isnan(value))
+        return write("nan");
+    if (isinf(value))
+        return write("inf");
+    snprintf(text,sizeof(text),"%.*f",decimals,value);
+    return write(text);
+    }
+
+size_t Print::printf(const char* format, ...)
+    {
+    char text[256];
+    va_list args;
+    va_start(args,format);
+    int length=vsnprintf(text,sizeof(text),format,args);
+    va_end(args);
+    return length>0?write((const uint8_t*)text,min((size_t)length,sizeof(text)-1)):0;
+    }
+
+size_t Stream::readBytes(char* buffer, size_t length)
+    {
+    size_t n=0;
+    while (n<length && available())
+        buffer[n++]=read();
+    return n;
+    }
+
+String Stream::readStringUntil(char terminator)
+    {
+    String text;
+    while (available())
+        {
+        char c=read();
+        if (c==terminator)
+            break;
+        text+=c;
+        }
+    return text;
+    }
+
+int HardwareSerial::read()
+    {
+    if (_read>=_input.size())
+        return -1;
+    return (uint8_t)_input[_read++];
+    }
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size)
+    {
+    written+=size;
+    if (_out)
+        fwrite(buffer,1,size,_out);
+    return size;
+    }
@@ -0,0 +1,244 @@
+/* Just enough of the ESP8266 Arduino core to build the gateway on the build
+ * machine, for the native benchmark. Time comes from the host's clock, and
+ * the cycle counter runs at a make-believe 80MHz off it, so the Metrics
+ * figures come out in real microseconds. advanceClock() moves all of them
+ * on, so frames can be spaced out as they would be on the air without
+ * waiting for it.
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef unsigned long ulong;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define FALLING 2
+#define RISING 1
+#define CHANGE 3
+#define LED_BUILTIN 2
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define DEC 10
+#define HEX 16
+#define BIN 2
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || (defined(__GLIBC__) && (__GLIBC__>2 || __GLIBC_MINOR__>=38))
+#define NATIVE_HAS_STRLCPY
+#else
+extern "C" size_t strlcpy(char* destination, const char* source, size_t size);
+extern "C" size_t strlcat(char* destination, const char* source, size_t size);
+#endif
+char* dtostrf(double value, signed char width, unsigned char decimals, char* buffer);
+
+template<class T> T min(T a, T b) {return a<b?a:b;}
+template<class T> T max(T a, T b) {return a>b?a:b;}
+template<class T, class L, class H> T constrain(T value, L low, H high)
+    {
+    return value<low?low:(value>high?high:value);
+    }
+inline long map(long value, long fromLow, long fromHigh, long toLow, long toHigh)
+    {
+    return (value-fromLow)*(toHigh-toLow)/(fromHigh-fromLow)+toLow;
+    }
+
+class String
+    {
+    public:
+        String() {}
+        String(const char* text) : _s(text?text:"") {}
+        String(const std::string& text) : _s(text) {}
+        explicit String(char c) : _s(1,c) {}
+        String(int value, unsigned char base=DEC) : _s(_number(value,base)) {}
+        String(unsigned value, unsigned char base=DEC) : _s(_number(value,base)) {}
+        String(long value, unsigned char base=DEC) : _s(_number(value,base)) {}
+        String(unsigned long value, unsigned char base=DEC) : _s(_number(value,base)) {}
+        String(double value, unsigned char decimals=2);
+        const char* c_str() const {return _s.c_str();}
+        unsigned length() const {return _s.size();}
+        void reserve(unsigned size) {_s.reserve(size);}
+        bool concat(const char* text) {_s+=text; return true;}
+        bool concat(const char* text, unsigned length) {_s.append(text,length); return true;}
+        bool concat(char c) {_s+=c; return true;}
+        String& operator+=(const String& other) {_s+=other._s; return *this;}
+        String& operator+=(const char* text) {_s+=text; return *this;}
+        String& operator+=(char c) {_s+=c; return *this;}
+        String& operator=(char c) {_s.assign(1,c); return *this;}
+        String& operator=(const char* text) {_s=text?text:""; return *this;}
+        friend String operator+(const String& a, const String& b) {return String(a._s+b._s);}
+        friend String operator+(const char* a, const String& b) {return String(a+b._s);}
+        friend String operator+(const String& a, const char* b) {return String(a._s+b);}
+        bool operator==(const String& other) const {return _s==other._s;}
+        bool operator==(const char* text) const {return _s==text;}
+        bool operator!=(const String& other) const {return _s!=other._s;}
+        bool operator!=(const char* text) const {return _s!=text;}
+        char operator[](unsigned index) const {return index<_s.size()?_s[index]:0;}
+        int indexOf(char c, unsigned from=0) const {return _found(_s.find(c,from));}
+        int indexOf(const char* text, unsigned from=0) const {return _found(_s.find(text,from));}
+        int lastIndexOf(char c) const {return _found(_s.rfind(c));}
+        String substring(unsigned from) const {return from<_s.size()?String(_s.substr(from)):String();}
+        String substring(unsigned from, unsigned to) const
+            {
+            return from<to && from<_s.size()?String(_s.substr(from,to-from)):String();
+            }
+        bool startsWith(const char* prefix) const {return _s.compare(0,strlen(prefix),prefix)==0;}
+        bool startsWith(const String& prefix) const {return startsWith(prefix.c_str());}
+        void remove(unsigned index) {if (index<_s.size()) _s.erase(index);}
+        void remove(unsigned index, unsigned count) {if (index<_s.size()) _s.erase(index,count);}
+        void trim();
+        long toInt() const {return atol(_s.c_str());}
+        float toFloat() const {return atof(_s.c_str());}
+
+    private:
+        std::string _s;
+        static int _found(size_t at) {return at==std::string::npos?-1:(int)at;}
+        static std::string _number(long long value, unsigned char base);
+    };
+
+class Print;
+
+class Printable
+    {
+    public:
+        virtual ~Printable() {}
+        virtual size_t printTo(Print& out) const=0;
+    };
+
+class Print
+    {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c)=0;
+        virtual size_t write(const uint8_t* buffer, size_t size);
+        size_t write(const char* text) {return text?write((const uint8_t*)text,strlen(text)):0;}
+        size_t write(const char* buffer, size_t size) {return write((const uint8_t*)buffer,size);}
+        virtual void flush() {}
+        virtual int availableForWrite() {return 0;}
+
+        size_t print(const char* text) {return write(text);}
+        size_t print(const String& text) {return write(text.c_str(),text.length());}
+        size_t print(char c) {return write((uint8_t)c);}
+        size_t print(unsigned char value, int base=DEC) {return print((unsigned long long)value,base);}
+        size_t print(int value, int base=DEC) {return print((long long)value,base);}
+        size_t print(unsigned value, int base=DEC) {return print((unsigned long long)value,base);}
+        size_t print(long value, int base=DEC) {return print((long long)value,base);}
+        size_t print(unsigned long value, int base=DEC) {return print((unsigned long long)value,base);}
+        size_t print(long long value, int base=DEC);
+        size_t print(unsigned long long value, int base=DEC);
+        size_t print(double value, int decimals=2);
+        size_t print(const Printable& value) {return value.printTo(*this);}
+        size_t printf(const char* format, ...) __attribute__((format(printf,2,3)));
+
+        size_t println() {return write("\r\n");}
+        template<class T> size_t println(const T& value) {return print(value)+println();}
+        template<class T> size_t println(const T& value, int format) {return print(value,format)+println();}
+    };
+
+class Stream: public Print
+    {
+    public:
+        virtual int available()=0;
+        virtual int read()=0;
+        virtual int peek() {return -1;}
+        void setTimeout(unsigned long timeout) {_timeout=timeout;}
+        size_t readBytes(char* buffer, size_t length);
+        size_t readBytes(uint8_t* buffer, size_t length) {return readBytes((char*)buffer,length);}
+        String readStringUntil(char terminator);
+
+    protected:
+        unsigned long _timeout=1000;
+    };
+
+// Sends to a file, normally nowhere, and reads from a string the benchmark sets
+class HardwareSerial: public Stream
+    {
+    public:
+        HardwareSerial(int uart) : _uart(uart) {}
+        void begin(unsigned long baudRate) {_baudRate=baudRate;}
+        void end() {}
+        void swap() {}
+        size_t setRxBufferSize(size_t size) {return size;}
+        void setDebugOutput(bool) {}
+        void updateBaudRate(unsigned long baudRate) {_baudRate=baudRate;}
+        void echoTo(FILE* out) {_out=out;}
+        void type(const char* text) {_input+=text;}
+        int available() override {return _input.size()-_read;}
+        int read() override;
+        int peek() override {return _read<_input.size()?(uint8_t)_input[_read]:-1;}
+        using Print::write;
+        size_t write(uint8_t c) override {return write(&c,1);}
+        size_t write(const uint8_t* buffer, size_t size) override;
+        int availableForWrite() override {return 128;}
+        operator bool() const {return true;}
+        unsigned long written=0; //bytes sent, whether or not they went anywhere
+
+    private:
+        int _uart;
+        unsigned long _baudRate=0;
+        FILE* _out=nullptr;
+        std::string _input;
+        size_t _read=0;
+    };
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+long random(long high);
+long random(long low, long high);
+void randomSeed(unsigned long seed);
+void advanceClock(unsigned long ms); //only here, not on the device
+
+class EspClass
+    {
+    public:
+        uint32_t getCycleCount();
+        uint32_t getCpuFreqMHz() {return 80;}
+        uint32_t getFreeHeap() {return 40000;} //the host's heap says nothing about the ESP8266's
+        uint8_t getHeapFragmentation() {return 0;}
+        uint32_t getMaxFreeBlockSize() {return 32000;}
+        uint32_t getChipId() {return 0x123456;}
+        String getResetReason() {return "Native";}
+        String getSketchMD5() {return "00000000000000000000000000000000";}
+        uint32_t getFreeSketchSpace() {return 1<<20;}
+        void restart();
+        void reset() {restart();}
+        void deepSleep(uint64_t) {restart();}
+    };
+extern EspClass ESP;
+
+#endif // ARDUINO_H
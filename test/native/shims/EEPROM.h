@@ -0,0 +1,33 @@
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <Arduino.h>
+
+// Starts out all zeros each run, so the gateway boots unconfigured
+class EEPROMClass
+    {
+    public:
+        void begin(size_t size) {_size=size<sizeof(_data)?size:sizeof(_data);}
+        template<class T> T& get(int at, T& value)
+            {
+            memcpy(&value,_data+at,sizeof(T));
+            return value;
+            }
+        template<class T> const T& put(int at, const T& value)
+            {
+            memcpy(_data+at,&value,sizeof(T));
+            return value;
+            }
+        bool commit() {commits++; return true;}
+        const uint8_t* getConstDataPtr() const {return _data;}
+        uint8_t* getDataPtr() {return _data;}
+        size_t length() {return _size;}
+        unsigned long commits=0;
+
+    private:
+        uint8_t _data[4096]={};
+        size_t _size=0;
+    };
+extern EEPROMClass EEPROM;
+
+#endif // EEPROM_H
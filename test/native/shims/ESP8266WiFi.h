@@ -0,0 +1,112 @@
+#ifndef ESP8266WIFI_H
+#define ESP8266WIFI_H
+
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+
+class IPAddress: public Printable
+    {
+    public:
+        IPAddress() {}
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _bytes{a,b,c,d}, _set(true) {}
+        bool isSet() const {return _set;}
+        bool fromString(const char* text);
+        String toString() const;
+        size_t printTo(Print& out) const override {return out.print(toString());}
+
+    private:
+        uint8_t _bytes[4]={};
+        bool _set=false;
+    };
+
+typedef enum
+    {
+    WL_IDLE_STATUS=0,
+    WL_NO_SSID_AVAIL=1,
+    WL_CONNECTED=3,
+    WL_CONNECT_FAILED=4,
+    WL_DISCONNECTED=6
+    } wl_status_t;
+typedef enum {WIFI_OFF, WIFI_STA} WiFiMode_t;
+typedef enum {WIFI_NONE_SLEEP, WIFI_LIGHT_SLEEP, WIFI_MODEM_SLEEP} WiFiSleepType_t;
+
+struct WiFiEventStationModeGotIP {IPAddress ip, mask, gw;};
+struct WiFiEventStationModeDisconnected {String ssid; uint8_t reason;};
+typedef std::shared_ptr<int> WiFiEventHandler;
+
+// Joins any network straight away, and never loses it
+class ESP8266WiFiClass
+    {
+    public:
+        wl_status_t status() {return _status;}
+        int begin(const char* ssid, const char* password);
+        bool config(IPAddress, IPAddress, IPAddress) {return true;}
+        bool mode(WiFiMode_t) {return true;}
+        void persistent(bool) {}
+        void setAutoReconnect(bool) {}
+        bool setSleepMode(WiFiSleepType_t, uint8_t=0) {return true;}
+        bool disconnect(bool=false) {_status=WL_DISCONNECTED; return true;}
+        int32_t RSSI() {return -60;}
+        IPAddress localIP() {return IPAddress(192,168,4,2);}
+        String macAddress() {return "02:00:00:00:00:01";}
+        WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler);
+        WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)> handler);
+
+    private:
+        wl_status_t _status=WL_IDLE_STATUS;
+        std::function<void(const WiFiEventStationModeGotIP&)> _gotIP;
+    };
+extern ESP8266WiFiClass WiFi;
+
+class Client: public Stream
+    {
+    public:
+        virtual int connect(IPAddress ip, uint16_t port)=0;
+        virtual int connect(const char* host, uint16_t port)=0;
+        using Print::write;
+        virtual int read(uint8_t* buffer, size_t size)=0;
+        using Stream::read;
+        virtual void stop()=0;
+        virtual uint8_t connected()=0;
+        virtual operator bool()=0;
+    };
+
+// A connection to a broker that takes everything. What PubSubClient writes
+// straight to it, which is only QoS 1 PUBLISHes built by QosPublisher, is
+// followed packet by packet, counted, and answered with a PUBACK.
+class WiFiClient: public Client
+    {
+    public:
+        int connect(IPAddress, uint16_t) override {return 1;}
+        int connect(const char*, uint16_t) override {return 1;}
+        size_t write(uint8_t c) override;
+        size_t write(const uint8_t* buffer, size_t size) override;
+        int available() override {return _ackLength-_ackRead;}
+        int read() override {return available()>0?_acks[_ackRead++]:-1;}
+        int read(uint8_t* buffer, size_t size) override;
+        int peek() override {return available()>0?_acks[_ackRead]:-1;}
+        void flush() override {}
+        void stop() override {}
+        uint8_t connected() override {return 1;}
+        operator bool() override {return true;}
+        IPAddress localIP() {return WiFi.localIP();}
+
+        unsigned long published=0;    //PUBLISH packets written whole
+        unsigned long payloadBytes=0;
+
+    private:
+        enum {PACKET_TYPE,PACKET_LENGTH,PACKET_BODY} _state=PACKET_TYPE;
+        uint8_t _type=0;
+        uint32_t _length=0;     //of the packet body
+        uint8_t _lengthShift=0;
+        uint32_t _at=0;         //bytes of the body so far
+        uint16_t _topicLength=0;
+        uint16_t _id=0;
+        uint8_t _acks[64];      //PUBACKs waiting to be read
+        uint8_t _ackLength=0;
+        uint8_t _ackRead=0;
+        void _packetDone();
+    };
+
+#endif // ESP8266WIFI_H
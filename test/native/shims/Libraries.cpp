@@ -0,0 +1,269 @@
+/* The objects and the less trivial parts of the library shims */
+
+#include <ESP8266WiFi.h>
+#include <PubSubClient.h>
+#include <SoftwareSerial.h>
+#include <EEPROM.h>
+#include <LittleFS.h>
+#include <Wire.h>
+#include <Updater.h>
+
+ESP8266WiFiClass WiFi;
+EEPROMClass EEPROM;
+FS LittleFS;
+TwoWire Wire;
+UpdaterClass Update;
+SoftwareSerial* SoftwareSerial::opened[4]={};
+
+bool IPAddress::fromString(const char* text)
+    {
+    unsigned a,b,c,d;
+    char end;
+    if (!text || sscanf(text,"%u.%u.%u.%u%c",&a,&b,&c,&d,&end)!=4 || a>255 || b>255 || c>255 || d>255)
+        return false;
+    *this=IPAddress(a,b,c,d);
+    return true;
+    }
+
+String IPAddress::toString() const
+    {
+    char text[16];
+    snprintf(text,sizeof(text),"%u.%u.%u.%u",_bytes[0],_bytes[1],_bytes[2],_bytes[3]);
+    return text;
+    }
+
+int ESP8266WiFiClass::begin(const char*, const char*)
+    {
+    _status=WL_CONNECTED;
+    if (_gotIP)
+        _gotIP(WiFiEventStationModeGotIP{localIP(),IPAddress(255,255,255,0),IPAddress(192,168,4,1)});
+    return _status;
+    }
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP&)> handler)
+    {
+    _gotIP=handler;
+    return std::make_shared<int>(0);
+    }
+
+WiFiEventHandler ESP8266WiFiClass::onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected&)>)
+    {
+    return std::make_shared<int>(0);
+    }
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retain)
+    {
+    return publish(topic,(const uint8_t*)payload,strlen(payload),retain);
+    }
+
+bool PubSubClient::publish(const char*, const uint8_t*, unsigned int length, bool)
+    {
+    if (!_connected)
+        return false;
+    messages++;
+    payloadBytes+=length;
+    return true;
+    }
+
+bool PubSubClient::beginPublish(const char*, unsigned int length, bool)
+    {
+    if (!_connected)
+        return false;
+    _streaming=true;
+    _announced=length;
+    _streamed=0;
+    return true;
+    }
+
+int PubSubClient::endPublish()
+    {
+    if (_streaming)
+        {
+        _streaming=false;
+        if (_streamed!=_announced)
+            badLengths++;
+        messages++;
+        payloadBytes+=_streamed;
+        }
+    return _connected?1:0;
+    }
+
+size_t PubSubClient::write(const uint8_t* buffer, size_t size)
+    {
+    if (_streaming)
+        {
+        _streamed+=size;
+        return size;
+        }
+    rawBytes+=size;
+    return _client->write(buffer,size);
+    }
+
+bool PubSubClient::loop()
+    {
+    while (_client->available()>0)
+        _client->read();
+    return _connected;
+    }
+
+size_t WiFiClient::write(uint8_t c)
+    {
+    switch (_state)
+        {
+        case PACKET_TYPE:
+            _type=c;
+            _length=0;
+            _lengthShift=0;
+            _state=PACKET_LENGTH;
+            break;
+        case PACKET_LENGTH:
+            _length|=(uint32_t)(c&0x7F)<<_lengthShift;
+            _lengthShift+=7;
+            if (c&0x80)
+                break;
+            _at=0;
+            _topicLength=0;
+            _id=0;
+            _state=PACKET_BODY;
+            if (_length==0)
+                _packetDone();
+            break;
+        case PACKET_BODY:
+            if (_at<2)
+                _topicLength=_topicLength<<8|c;
+            else if (_at<2u+_topicLength+2)
+                _id=_id<<8|c; //only the last two of these are the ID
+            if (++_at==_length)
+                _packetDone();
+            break;
+        }
+    return 1;
+    }
+
+size_t WiFiClient::write(const uint8_t* buffer, size_t size)
+    {
+    for (size_t i=0; i<size; i++)
+        write(buffer[i]);
+    return size;
+    }
+
+int WiFiClient::read(uint8_t* buffer, size_t size)
+    {
+    int n=0;
+    while ((size_t)n<size && available()>0)
+        buffer[n++]=_acks[_ackRead++];
+    return n;
+    }
+
+void WiFiClient::_packetDone()
+    {
+    _state=PACKET_TYPE;
+    if ((_type&0xF0)!=0x30)
+        return;
+    bool qos1=(_type&0x06)==0x02;
+    published++;
+    payloadBytes+=_length-2-_topicLength-(qos1?2:0);
+    if (!qos1)
+        return;
+    if (_ackRead==_ackLength)
+        _ackRead=_ackLength=0;
+    if (_ackLength+4u>sizeof(_acks))
+        return; //nobody is reading them
+    _acks[_ackLength++]=0x40; //PUBACK
+    _acks[_ackLength++]=2;
+    _acks[_ackLength++]=_id>>8;
+    _acks[_ackLength++]=_id&0xFF;
+    }
+
+SoftwareSerial::SoftwareSerial()
+    {
+    _rx.reserve(4096); //so answering commands doesn't allocate
+    _command.reserve(256);
+    _values["BAND"]="915000000";
+    _values["NETWORKID"]="18";
+    _values["PARAMETER"]="9,7,1,12";
+    _values["CRFOP"]="22";
+    _values["ADDRESS"]="0";
+    _values["MODE"]="0";
+    _values["IPR"]="115200";
+    _values["CPIN"]="No Password!";
+    }
+
+void SoftwareSerial::begin(uint32_t, SoftwareSerialConfig, int8_t, int8_t, bool, int, int)
+    {
+    for (SoftwareSerial*& slot : opened)
+        {
+        if (slot==this)
+            return;
+        if (!slot)
+            {
+            slot=this;
+            return;
+            }
+        }
+    }
+
+void SoftwareSerial::receive(const char* line)
+    {
+    _rx+=line;
+    _rx+="\r\n";
+    }
+
+int SoftwareSerial::read()
+    {
+    if (idle())
+        return -1;
+    int c=(uint8_t)_rx[_read++];
+    if (idle())
+        {
+        _rx.clear(); //keeps its capacity
+        _read=0;
+        }
+    return c;
+    }
+
+size_t SoftwareSerial::write(uint8_t c)
+    {
+    if (c=='\n')
+        {
+        _answer();
+        _command.clear();
+        }
+    else if (c!='\r')
+        _command+=c;
+    return 1;
+    }
+
+void SoftwareSerial::_answer()
+    {
+    commands++;
+    if (_command=="AT")
+        {
+        receive("+OK");
+        return;
+        }
+    if (_command.compare(0,3,"AT+")!=0)
+        {
+        receive("+ERR=1");
+        return;
+        }
+    size_t end=_command.find_first_of("=?",3);
+    if (end==std::string::npos)
+        {
+        receive("+ERR=2");
+        return;
+        }
+    std::string name=_command.substr(3,end-3);
+    if (_command[end]=='?')
+        {
+        auto value=_values.find(name);
+        std::string answer="+"+name+"="+(value==_values.end()?"":value->second);
+        receive(answer.c_str());
+        }
+    else
+        {
+        if (name!="SEND") //the only one that comes with every frame, and nothing asks for it back
+            _values[name]=_command.substr(end+1);
+        receive("+OK");
+        }
+    }
@@ -0,0 +1,38 @@
+#ifndef LITTLEFS_H
+#define LITTLEFS_H
+
+#include <Arduino.h>
+
+enum SeekMode {SeekSet, SeekCur, SeekEnd};
+
+// A filesystem with nothing on it that can't be mounted, so the frame store
+// stays in RAM and there is nothing to replay on the "device"
+class File: public Stream
+    {
+    public:
+        operator bool() const {return false;}
+        bool seek(uint32_t, SeekMode=SeekSet) {return false;}
+        size_t position() const {return 0;}
+        size_t size() const {return 0;}
+        bool truncate(uint32_t) {return false;}
+        void close() {}
+        const char* name() const {return "";}
+        int available() override {return 0;}
+        int read() override {return -1;}
+        size_t read(uint8_t*, size_t) {return 0;}
+        size_t readBytesUntil(char, char*, size_t) {return 0;}
+        using Print::write;
+        size_t write(uint8_t) override {return 0;}
+    };
+
+class FS
+    {
+    public:
+        bool begin() {return false;}
+        File open(const char*, const char*) {return File();}
+        bool exists(const char*) {return false;}
+        bool remove(const char*) {return false;}
+    };
+extern FS LittleFS;
+
+#endif // LITTLEFS_H
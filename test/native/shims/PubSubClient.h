@@ -0,0 +1,52 @@
+#ifndef PUBSUBCLIENT_H
+#define PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <functional>
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+// A broker that takes everything. It counts what is published, and checks
+// that a streamed message is as long as beginPublish() said it would be.
+// Anything written outside beginPublish() goes to the client as it would on
+// the device, and loop() reads whatever the client has for us.
+class PubSubClient: public Print
+    {
+    public:
+        PubSubClient(Client& client) : _client(&client) {}
+        PubSubClient& setServer(const char*, uint16_t) {return *this;}
+        PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) {return *this;}
+        PubSubClient& setKeepAlive(uint16_t) {return *this;}
+        PubSubClient& setSocketTimeout(uint16_t) {return *this;}
+        bool setBufferSize(uint16_t size) {_bufferSize=size; return true;}
+        uint16_t getBufferSize() {return _bufferSize;}
+        bool connect(const char*, const char*, const char*) {_connected=true; return true;}
+        bool connected() {return _connected;}
+        void disconnect() {_connected=false;}
+        int state() {return _connected?0:-1;}
+        bool loop();
+        bool subscribe(const char*) {return _connected;}
+        bool publish(const char* topic, const char* payload, bool retain=false);
+        bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain=false);
+        bool beginPublish(const char* topic, unsigned int length, bool retain);
+        int endPublish();
+        using Print::write;
+        size_t write(uint8_t c) override {return write(&c,1);}
+        size_t write(const uint8_t* buffer, size_t size) override;
+
+        unsigned long messages=0;     //published whole
+        unsigned long payloadBytes=0;
+        unsigned long badLengths=0;   //streamed messages that didn't match their announced length
+        unsigned long rawBytes=0;     //written straight to the client, like QosPublisher's packets
+
+    private:
+        Client* _client;
+        bool _connected=false;
+        uint16_t _bufferSize=256;
+        bool _streaming=false;
+        unsigned long _announced=0;
+        unsigned long _streamed=0;
+    };
+
+#endif // PUBSUBCLIENT_H
@@ -0,0 +1,42 @@
+#ifndef SOFTWARESERIAL_H
+#define SOFTWARESERIAL_H
+
+#include <Arduino.h>
+#include <map>
+
+enum SoftwareSerialConfig {SWSERIAL_8N1};
+
+// Stands in for a RYLR998 on the other end of the wire. AT commands are
+// answered straight away: "AT+X=..." with +OK, remembering the value, and
+// "AT+X?" with +X= whatever it was last set to. The benchmark puts +RCV
+// lines in with receive().
+class SoftwareSerial: public Stream
+    {
+    public:
+        SoftwareSerial();
+        SoftwareSerial(int8_t, int8_t, bool=false) : SoftwareSerial() {}
+        void begin(uint32_t baudRate, SoftwareSerialConfig=SWSERIAL_8N1, int8_t rxPin=-1, int8_t txPin=-1,
+                   bool invert=false, int bufferSize=64, int isrBufferSize=0);
+        void end() {}
+        bool overflow() {return false;}
+        void enableRx(bool) {}
+        void receive(const char* line);
+        bool idle() {return _read>=_rx.size();} //everything it sent has been read
+        int available() override {return _rx.size()-_read;}
+        int read() override;
+        int peek() override {return idle()?-1:(uint8_t)_rx[_read];}
+        using Print::write;
+        size_t write(uint8_t c) override;
+
+        static SoftwareSerial* opened[4]; //the modules, in the order they were started
+        unsigned long commands=0;
+
+    private:
+        std::string _rx;
+        size_t _read=0;
+        std::string _command;
+        std::map<std::string,std::string> _values;
+        void _answer();
+    };
+
+#endif // SOFTWARESERIAL_H
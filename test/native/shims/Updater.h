@@ -0,0 +1,18 @@
+#ifndef UPDATER_H
+#define UPDATER_H
+
+#include <Arduino.h>
+
+class UpdaterClass
+    {
+    public:
+        bool begin(size_t, int=0) {return false;}
+        bool setMD5(const char*) {return true;}
+        size_t write(uint8_t*, size_t) {return 0;}
+        bool end(bool=false) {return false;}
+        bool isRunning() {return false;}
+        String getErrorString() {return "No flash here";}
+    };
+extern UpdaterClass Update;
+
+#endif // UPDATER_H
@@ -0,0 +1,17 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <Arduino.h>
+
+class TwoWire
+    {
+    public:
+        void begin() {}
+        void setClock(uint32_t) {}
+        void beginTransmission(uint8_t) {}
+        size_t write(uint8_t) {return 1;}
+        uint8_t endTransmission(bool=true) {return 0;}
+    };
+extern TwoWire Wire;
+
+#endif // WIRE_H